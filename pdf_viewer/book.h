@@ -6,6 +6,7 @@
 //#include <gl/glew.h>
 #include <qopengl.h>
 #include <mutex>
+#include <functional>
 #include <variant>
 #include <qjsonobject.h>
 
@@ -99,6 +100,12 @@ struct SearchResult {
 	int page;
 };
 
+// called with the search results found since the last call and the fraction of the document which is searched so far
+using SearchResultsCallback = std::function<void(std::vector<SearchResult>&& results, float percent_done)>;
+// searches a document without using mupdf (e.g. using the super fast search index) and reports the results as they are
+// found, returns false if the search was stopped because `should_stop` returned true
+using IncrementalSearchFunction = std::function<bool(const std::function<bool()>& should_stop, const SearchResultsCallback& on_results)>;
+
 
 struct TocNode {
 	std::vector<TocNode*> children;
@@ -40,6 +40,7 @@ CachedChecksummer::CachedChecksummer(const std::vector<std::pair<std::wstring, s
 
 std::optional<std::string> CachedChecksummer::get_checksum_fast(std::wstring file_path) {
     // return the checksum only if it is alreay precomputed in cache
+    std::lock_guard guard(checksum_mutex);
     if (cached_checksums.find(file_path) != cached_checksums.end()) {
         return cached_checksums[file_path];
     }
@@ -51,16 +52,23 @@ std::string CachedChecksummer::get_checksum(std::wstring file_path) {
 		auto cached_checksum = get_checksum_fast(file_path);
 
 		if (!cached_checksum) {
+			// computing the checksum requires reading the entire file, so we don't hold the lock while doing it
 			std::string checksum = compute_checksum(QString::fromStdWString(file_path), QCryptographicHash::Md5);
-			cached_checksums[file_path] = checksum;
-            cached_paths[checksum].push_back(file_path);
+			std::lock_guard guard(checksum_mutex);
+			if (cached_checksums.find(file_path) == cached_checksums.end()) {
+				cached_checksums[file_path] = checksum;
+				cached_paths[checksum].push_back(file_path);
+			}
+			return cached_checksums[file_path];
 		}
-		return cached_checksums[file_path];
+		return cached_checksum.value();
 
 }
 
 std::optional<std::wstring> CachedChecksummer::get_path(std::string checksum) {
+    checksum_mutex.lock();
     const std::vector<std::wstring> paths = cached_paths[checksum];
+    checksum_mutex.unlock();
 
     for (const auto& path_string : paths) {
         if (QFile::exists(QString::fromStdWString(path_string))) {
@@ -6,6 +6,7 @@
 #include <qfile.h>
 #include <utility>
 #include <optional>
+#include <mutex>
 
 std::string compute_checksum(const QString& file_name, QCryptographicHash::Algorithm hash_algorithm);
 
@@ -13,6 +14,8 @@ class CachedChecksummer {
 private:
 	std::unordered_map<std::wstring, std::string> cached_checksums;
 	std::unordered_map<std::string, std::vector<std::wstring>> cached_paths;
+	// checksums are also computed by background threads (e.g. when writing cached page images)
+	std::mutex checksum_mutex;
 
 public:
 	CachedChecksummer(const std::vector<std::pair<std::wstring, std::wstring>>* loaded_checksums);
@@ -106,6 +106,20 @@ extern bool IGNORE_STATUSBAR_IN_PRESENTATION_MODE;
 extern bool SUPER_FAST_SEARCH;
 extern bool SHOW_CLOSEST_BOOKMARK_IN_STATUSBAR;
 extern int PRERENDERED_PAGE_COUNT;
+extern int RENDER_CACHE_MEGABYTES;
+extern int DISPLAY_LIST_CACHE_PAGES;
+extern int PAGE_IMAGE_CACHE_MEGABYTES;
+extern int STEXT_CACHE_MEGABYTES;
+extern int PAGE_DATA_CACHE_MEGABYTES;
+extern int TEXTURE_UPLOAD_MEGABYTES_PER_FRAME;
+extern int INDEXING_THREADS;
+extern int SEARCH_THREADS;
+extern int PAGE_DIMENSION_THREADS;
+extern bool CACHE_DOCUMENT_INDICES;
+extern int DOCUMENT_INDEX_CACHE_MEGABYTES;
+extern int REGEX_SEARCH_TIMEOUT_MILLISECONDS;
+extern bool INCREMENTAL_SEARCH;
+extern bool LIBRARY_SEARCH;
 extern bool CASE_SENSITIVE_SEARCH;
 extern bool SHOW_DOCUMENT_NAME_IN_STATUSBAR;
 extern bool SHOW_CLOSE_PORTAL_IN_STATUSBAR;
@@ -422,6 +436,20 @@ ConfigManager::ConfigManager(const Path& default_path, const Path& auto_path ,co
 	configs.push_back({ L"show_closest_bookmark_in_statusbar", &SHOW_CLOSEST_BOOKMARK_IN_STATUSBAR, bool_serializer, bool_deserializer, bool_validator });
 	configs.push_back({ L"show_close_portal_in_statusbar", &SHOW_CLOSE_PORTAL_IN_STATUSBAR, bool_serializer, bool_deserializer, bool_validator });
 	configs.push_back({ L"prerendered_page_count", &PRERENDERED_PAGE_COUNT, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"render_cache_megabytes", &RENDER_CACHE_MEGABYTES, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"display_list_cache_pages", &DISPLAY_LIST_CACHE_PAGES, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"page_image_cache_megabytes", &PAGE_IMAGE_CACHE_MEGABYTES, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"stext_cache_megabytes", &STEXT_CACHE_MEGABYTES, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"page_data_cache_megabytes", &PAGE_DATA_CACHE_MEGABYTES, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"texture_upload_megabytes_per_frame", &TEXTURE_UPLOAD_MEGABYTES_PER_FRAME, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"indexing_threads", &INDEXING_THREADS, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"search_threads", &SEARCH_THREADS, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"page_dimension_threads", &PAGE_DIMENSION_THREADS, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"cache_document_indices", &CACHE_DOCUMENT_INDICES, bool_serializer, bool_deserializer, bool_validator });
+	configs.push_back({ L"document_index_cache_megabytes", &DOCUMENT_INDEX_CACHE_MEGABYTES, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"regex_search_timeout_milliseconds", &REGEX_SEARCH_TIMEOUT_MILLISECONDS, int_serializer, int_deserializer, nullptr });
+	configs.push_back({ L"incremental_search", &INCREMENTAL_SEARCH, bool_serializer, bool_deserializer, bool_validator });
+	configs.push_back({ L"library_search", &LIBRARY_SEARCH, bool_serializer, bool_deserializer, bool_validator });
 	configs.push_back({ L"case_sensitive_search", &CASE_SENSITIVE_SEARCH, bool_serializer, bool_deserializer, bool_validator });
 	configs.push_back({ L"show_document_name_in_statusbar", &SHOW_DOCUMENT_NAME_IN_STATUSBAR, bool_serializer, bool_deserializer, bool_validator });
 	configs.push_back({ L"ui_selected_background_color", UI_SELECTED_BACKGROUND_COLOR, vec3_serializer, color3_deserializer, color_3_validator });
@@ -7,12 +7,17 @@
 #include <qdatetime.h>
 #include <map>
 #include <regex>
+#include <atomic>
+#include <chrono>
+#include <sstream>
 #include <qcryptographichash.h>
 #include <qjsondocument.h>
 
 #include <mupdf/pdf.h>
 
 #include "checksum.h"
+#include "document_index_cache.h"
+#include "linear_regex.h"
 
 extern float SMALL_PIXMAP_SCALE;
 extern float HIGHLIGHT_COLORS[26 * 3];
@@ -26,6 +31,12 @@ extern bool CREATE_TABLE_OF_CONTENTS_IF_NOT_EXISTS;
 extern int MAX_CREATED_TABLE_OF_CONTENTS_SIZE;
 extern bool FORCE_CUSTOM_LINE_ALGORITHM;
 extern bool SUPER_FAST_SEARCH;
+extern bool DEBUG;
+extern int INDEXING_THREADS;
+extern int PAGE_DIMENSION_THREADS;
+extern bool CACHE_DOCUMENT_INDICES;
+extern bool LIBRARY_SEARCH;
+extern int REGEX_SEARCH_TIMEOUT_MILLISECONDS;
 
 
 int Document::get_mark_index(char symbol) {
@@ -304,13 +315,20 @@ bool Document::get_mark_location_if_exists(char symbol, float* y_offset) {
 	return true;
 }
 
-Document::Document(fz_context* context, std::wstring file_name, DatabaseManager* db, CachedChecksummer* checksummer) :
+Document::Document(fz_context* context, std::wstring file_name, DatabaseManager* db, CachedChecksummer* checksummer, PageImageCache* page_image_cache, LibraryIndex* library_index, DocumentHandlePool* document_handle_pool) :
 	db_manager(db),
 	context(context),
 	file_name(file_name),
 	checksummer(checksummer),
+	page_image_cache(page_image_cache),
+	library_index(library_index),
+	document_handle_pool(document_handle_pool),
+	stext_page_cache(context, file_name, document_handle_pool),
+	page_data_cache(context),
 	doc(nullptr){
 	last_update_time = QDateTime::currentDateTime();
+	search_handle = std::make_shared<DocumentSearchHandle>();
+	search_handle->document = this;
 }
 
 void Document::count_chapter_pages(std::vector<int> &page_counts) {
@@ -366,6 +384,7 @@ float Document::get_page_height(int page_index) {
 }
 
 float Document::get_page_width(int page_index) {
+	std::lock_guard guard(page_dims_mutex);
 	if ((page_index >= 0) && (page_index < page_widths.size())) {
 		return page_widths[page_index];
 	}
@@ -431,10 +450,10 @@ float Document::get_page_size_smart(bool width, int page_index, float* left_rati
 
 	float standard_size;
 	if (width) {
-		standard_size = page_widths[page_index];
+		standard_size = get_page_width(page_index);
 	}
 	else {
-		standard_size = page_heights[page_index];
+		standard_size = get_page_height(page_index);
 	}
 
 	float ratio = static_cast<float>(end_index - start_index) / histogram.size();
@@ -449,7 +468,7 @@ float Document::get_accum_page_height(int page_index) {
 	if (page_index < 0 || (page_index >= accum_page_heights.size())) {
 		return 0.0f;
 	}
-	return accum_page_heights[page_index];
+	return accum_page_heights.prefix_sum(page_index);
 }
 
 
@@ -512,24 +531,27 @@ void Document::convert_toc_tree(fz_outline* root, std::vector<TocNode*>& output)
 }
 
 fz_link* Document::get_page_links(int page_number) {
-	if (cached_page_links.find(page_number) != cached_page_links.end()) {
-		return cached_page_links.at(page_number);
-	}
-	//std::cerr << "getting links .... for " << page_number << std::endl;
+	return page_data_cache.get(page_number, &PageData::links, [&]() {
+		//std::cerr << "getting links .... for " << page_number << std::endl;
 
-	fz_link* res = nullptr;
-	fz_try(context) {
-		fz_page* page = fz_load_page(context, doc, page_number);
-		res = fz_load_links(context, page);
-		cached_page_links[page_number] = res;
-		fz_drop_page(context, page);
-	}
+		fz_link* res = nullptr;
+		fz_var(res);
+		fz_try(context) {
+			fz_page* page = fz_load_page(context, doc, page_number);
+			res = fz_load_links(context, page);
+			fz_drop_page(context, page);
+		}
 
-	fz_catch(context) {
-		std::cerr << "Error: Could not load links" << std::endl;
-		res = nullptr;
-	}
-	return res;
+		fz_catch(context) {
+			std::cerr << "Error: Could not load links" << std::endl;
+			res = nullptr;
+		}
+		return res;
+		});
+}
+
+PageDataCacheStatistics Document::get_page_data_cache_statistics() {
+	return page_data_cache.get_statistics();
 }
 
 QDateTime Document::get_last_edit_time() {
@@ -550,11 +572,26 @@ unsigned int Document::get_milies_since_last_edit_time() {
 }
 
 Document::~Document() {
+	// stop the search thread's search of this document (if any) and wait for it to finish
+	search_handle->is_closed = true;
+	search_handle->mutex.lock();
+	search_handle->document = nullptr;
+	search_handle->mutex.unlock();
+
+	if (benchmark_thread.has_value()) {
+		// indexing benchmarks stop when indexing is stopped
+		is_benchmark_cancelled = true;
+		stop_indexing();
+		benchmark_thread.value().join();
+	}
+
 	if (document_indexing_thread.has_value()) {
 		stop_indexing();
 		document_indexing_thread.value().join();
 	}
 
+	stop_loading_page_dimensions();
+
 	if (doc != nullptr) {
 		fz_try(context) {
 			fz_drop_document(context, doc);
@@ -566,26 +603,20 @@ Document::~Document() {
 	}
 }
 void Document::reload(std::string password) {
+	stop_loading_page_dimensions();
 	fz_drop_document(context, doc);
+	// the pooled documents of the other threads are outdated too
+	document_handle_pool->invalidate(file_name);
 	cached_num_pages = {};
 	cached_fastread_highlights.clear();
-	cached_line_texts.clear();
-	cached_page_line_rects.clear();
+	page_data_cache.clear();
 
 	for (auto [_, cached_small_pixmap] : cached_small_pixmaps) {
 		fz_drop_pixmap(context, cached_small_pixmap);
 	}
 	cached_small_pixmaps.clear();
 
-	for (auto [_, cached_stext_page] : cached_stext_pages) {
-		fz_drop_stext_page(context, cached_stext_page);
-	}
-	cached_stext_pages.clear();
-
-	for (auto page_link_pair : cached_page_links) {
-		fz_drop_link(context, page_link_pair.second);
-	}
-	cached_page_links.clear();
+	stext_page_cache.clear();
 
 	delete cached_toc_model;
 	cached_toc_model = nullptr;
@@ -606,6 +637,7 @@ bool Document::open(bool* invalid_flag, bool force_load_dimensions, std::string
 				int auth_res = fz_authenticate_password(context, doc, password.c_str());
 				if (auth_res > 0) {
 					password_was_correct = true;
+					document_handle_pool->set_password(file_name, password);
 				}
 			}
 			//fz_layout_document(context, doc, 600, 800, 9);
@@ -647,9 +679,14 @@ void Document::get_visible_pages(float doc_y_range_begin, float doc_y_range_end,
 		return;
 	}
 
-	float page_begin = 0.0f;
+	// no page before the page containing doc_y_range_begin can be visible
+	int first_page = accum_page_heights.find_last_less(doc_y_range_begin);
+	float page_begin = accum_page_heights.prefix_sum(first_page);
 
-	for (size_t i = 0; i < page_heights.size(); i++) {
+	for (size_t i = first_page; i < page_heights.size(); i++) {
+		if (page_begin > doc_y_range_end) {
+			break;
+		}
 		float page_end = page_begin + page_heights[i];
 
 		if (range_intersects(doc_y_range_begin, doc_y_range_end, page_begin, page_end)) {
@@ -659,15 +696,138 @@ void Document::get_visible_pages(float doc_y_range_begin, float doc_y_range_end,
 	}
 }
 
+PageDimensionsJob::PageDimensionsJob(int num_pages, int focus_page) : is_claimed(num_pages, false) {
+	this->focus_page = std::max(0, std::min(focus_page, num_pages - 1));
+	lower_page = this->focus_page - 1;
+	upper_page = this->focus_page;
+}
+
+int PageDimensionsJob::claim_next_page(int new_focus_page) {
+	std::lock_guard<std::mutex> lock(mutex);
+	int num_pages = static_cast<int>(is_claimed.size());
+
+	new_focus_page = std::max(0, std::min(new_focus_page, num_pages - 1));
+	if (new_focus_page != focus_page) {
+		focus_page = new_focus_page;
+		lower_page = focus_page - 1;
+		upper_page = focus_page;
+	}
+
+	while ((upper_page < num_pages) && is_claimed[upper_page]) {
+		upper_page++;
+	}
+	while ((lower_page >= 0) && is_claimed[lower_page]) {
+		lower_page--;
+	}
+
+	int page = -1;
+	if ((upper_page < num_pages) && ((lower_page < 0) || (upper_page - focus_page <= focus_page - lower_page))) {
+		page = upper_page;
+	}
+	else if (lower_page >= 0) {
+		page = lower_page;
+	}
+
+	if (page >= 0) {
+		is_claimed[page] = true;
+	}
+	return page;
+}
+
+void Document::set_page_dimensions_focus_page(int page) {
+	page_dimensions_focus_page = page;
+}
+
+bool Document::are_all_page_dimensions_loaded() {
+	return are_page_dimensions_loaded;
+}
+
+int Document::get_page_dimensions_version() {
+	std::lock_guard guard(page_dims_mutex);
+	return page_dimensions_version;
+}
+
+bool Document::update_page_dimensions(int generation, const std::vector<LoadedPageDimensions>& dimensions) {
+	std::lock_guard guard(page_dims_mutex);
+	if (generation != page_dimensions_generation) {
+		return false;
+	}
+	if (dimensions.size() == 0) {
+		return true;
+	}
+
+	for (const auto& [page, width, height] : dimensions) {
+		// the sample page could not be loaded
+		if (static_cast<size_t>(page) >= page_heights.size()) {
+			continue;
+		}
+		// updates the accumulated heights of all the pages after `page` in O(log n)
+		accum_page_heights.add(page, height - page_heights[page]);
+		page_heights[page] = height;
+		page_widths[page] = width;
+	}
+	page_dimensions_version++;
+
+	if (invalid_flag_pointer) {
+		*invalid_flag_pointer = true;
+	}
+	return true;
+}
+
+void Document::load_page_dimensions_in_context(fz_context* context_, fz_document* doc_, PageDimensionsJob& job, int generation) {
+	std::vector<LoadedPageDimensions> loaded_dimensions;
+
+	int page_number;
+	while ((!should_stop_loading_page_dimensions) && ((page_number = job.claim_next_page(page_dimensions_focus_page)) >= 0)) {
+		fz_page* page = nullptr;
+		fz_var(page);
+		fz_try(context_) {
+			page = fz_load_page(context_, doc_, page_number);
+			fz_rect page_rect = fz_bound_page(context_, page);
+			loaded_dimensions.push_back(LoadedPageDimensions{ page_number, page_rect.x1 - page_rect.x0, page_rect.y1 - page_rect.y0 });
+		}
+		fz_always(context_) {
+			fz_drop_page(context_, page);
+		}
+		fz_catch(context_) {
+			// the page keeps the dimensions of the sample page
+			std::wcout << L"Error: could not load the dimensions of page " << page_number << L"\n";
+		}
+
+		if (static_cast<int>(loaded_dimensions.size()) >= PAGE_DIMENSIONS_BATCH_SIZE) {
+			if (!update_page_dimensions(generation, loaded_dimensions)) {
+				return;
+			}
+			loaded_dimensions.clear();
+		}
+	}
+	update_page_dimensions(generation, loaded_dimensions);
+}
+
+void Document::stop_loading_page_dimensions() {
+	if (page_dimensions_loading_thread.has_value()) {
+		should_stop_loading_page_dimensions = true;
+		page_dimensions_loading_thread.value().join();
+		page_dimensions_loading_thread = {};
+		should_stop_loading_page_dimensions = false;
+	}
+}
+
 void Document::load_page_dimensions(bool force_load_now) {
+	stop_loading_page_dimensions();
+
+	page_dims_mutex.lock();
 	page_heights.clear();
 	accum_page_heights.clear();
 	page_widths.clear();
+	int generation = ++page_dimensions_generation;
+	page_dimensions_version++;
+	are_page_dimensions_loaded = false;
+	page_dims_mutex.unlock();
 
 	int n = num_pages();
-	float acc_height = 0.0f;
-	// initially assume all pages have the same dimensions, correct these heights
-	// when the background thread is done
+	// initially assume all pages have the same dimensions, the dimensions of each page are corrected
+	// when the background threads load it
 	if (n > 0) {
 		fz_try(context) {
 			fz_page* page = fz_load_page(context, doc, n / 2);
@@ -676,65 +836,79 @@ void Document::load_page_dimensions(bool force_load_now) {
 			int height = bounds.y1 - bounds.y0;
 			int width = bounds.x1 - bounds.x0;
 
-			for (int i = 0; i < n; i++) {
-				page_heights.push_back(height);
-				accum_page_heights.push_back(acc_height);
-				page_widths.push_back(width);
-				acc_height += height;
-			}
+			std::lock_guard guard(page_dims_mutex);
+			page_heights.assign(n, height);
+			page_widths.assign(n, width);
+			accum_page_heights.assign(page_heights);
 		}
 		fz_catch(context) {
 			std::wcout << L"Error: could not load sample page dimensions\n";
 		}
 	}
 
-	auto load_page_dimensions_function = [this, n, force_load_now]() {
-		std::vector<float> accum_page_heights_;
-		std::vector<float> page_heights_;
-		std::vector<float> page_widths_;
+	auto load_page_dimensions_function = [this, n, generation]() {
+		/*
+		The pages are loaded in parallel, each thread uses its own clone of the main context and its own
+		fz_document from the document handle pool (so the indexing threads can reuse the documents opened
+		here). The current thread loads pages too and then loads the highlights.
+		*/
+		auto job = std::make_shared<PageDimensionsJob>(n, page_dimensions_focus_page);
+		int num_threads = PAGE_DIMENSION_THREADS > 0 ? PAGE_DIMENSION_THREADS : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / 2);
+
+		std::vector<std::thread> helper_threads;
+		for (int i = 1; (i < num_threads) && (i < n); i++) {
+			helper_threads.push_back(std::thread([this, job, generation]() {
+				fz_context* helper_context = fz_clone_context(context);
+				fz_document* helper_doc = document_handle_pool->acquire(helper_context, file_name);
+				if (helper_doc != nullptr) {
+					load_page_dimensions_in_context(helper_context, helper_doc, *job, generation);
+					document_handle_pool->release(helper_context, helper_doc);
+				}
+				fz_drop_context(helper_context);
+				}));
+		}
 
 		// clone the main context for use in the background thread
 		fz_context* context_ = fz_clone_context(context);
+		fz_document* doc_ = document_handle_pool->acquire(context_, file_name);
+		fz_var(doc_);
 		fz_try(context_) {
-			fz_document* doc_ = fz_open_document(context_, utf8_encode(file_name).c_str());
+			if (doc_ == nullptr) {
+				fz_throw(context_, FZ_ERROR_GENERIC, "could not open document");
+			}
 			//fz_layout_document(context_, doc, 600, 800, 20);
 			load_document_metadata_from_db();
 
-			float acc_height_ = 0.0f;
-			for (int i = 0; i < n; i++) {
-				fz_page* page = fz_load_page(context_, doc_, i);
-				fz_rect page_rect = fz_bound_page(context_, page);
-
-				float page_height = page_rect.y1 - page_rect.y0;
-				float page_width = page_rect.x1 - page_rect.x0;
-
-				accum_page_heights_.push_back(acc_height_);
-				page_heights_.push_back(page_height);
-				page_widths_.push_back(page_width);
-				acc_height_ += page_height;
-
-				fz_drop_page(context_, page);
+			load_page_dimensions_in_context(context_, doc_, *job, generation);
+			for (auto& thread : helper_threads) {
+				thread.join();
 			}
-
+			helper_threads.clear();
 
 			page_dims_mutex.lock();
-
-			page_heights = std::move(page_heights_);
-			accum_page_heights = std::move(accum_page_heights_);
-			page_widths = std::move(page_widths_);
-
-			if (invalid_flag_pointer) {
-				*invalid_flag_pointer = true;
+			if ((generation == page_dimensions_generation) && (!should_stop_loading_page_dimensions)) {
+				// views whose offsets were restored from a previous session move to their final position
+				are_page_dimensions_loaded = true;
+				page_dimensions_version++;
+				if (invalid_flag_pointer) {
+					*invalid_flag_pointer = true;
+				}
 			}
 			page_dims_mutex.unlock();
 
-			fill_highlight_rects(context_, doc_);
-
-			fz_drop_document(context_, doc_);
+			if (!should_stop_loading_page_dimensions) {
+				fill_highlight_rects(context_, doc_);
+			}
 		}
 		fz_catch(context_) {
 			std::wcout << L"Error: could not load page dimensions\n";
 		}
+		document_handle_pool->release(context_, doc_);
+
+		// the helpers still load the pages if we could not open the document in this thread
+		for (auto& thread : helper_threads) {
+			thread.join();
+		}
 
 		fz_drop_context(context_);
 
@@ -746,8 +920,7 @@ void Document::load_page_dimensions(bool force_load_now) {
 		load_page_dimensions_function();
 	}
 	else {
-		auto background_page_dimensions_loading_thread = std::thread(load_page_dimensions_function);
-		background_page_dimensions_loading_thread.detach();
+		page_dimensions_loading_thread = std::thread(load_page_dimensions_function);
 	}
 }
 
@@ -764,8 +937,8 @@ fz_rect Document::get_page_absolute_rect(int page) {
 	res.x0 = -page_widths[page] / 2;
 	res.x1 = page_widths[page] / 2;
 
-	res.y0 = accum_page_heights[page];
-	res.y1 = accum_page_heights[page] + page_heights[page];
+	res.y0 = accum_page_heights.prefix_sum(page);
+	res.y1 = res.y0 + page_heights[page];
 	return res;
 }
 
@@ -785,10 +958,13 @@ int Document::num_pages() {
 	return pages;
 }
 
-DocumentManager::DocumentManager(fz_context* mupdf_context, DatabaseManager* db, CachedChecksummer* checksummer) :
+DocumentManager::DocumentManager(fz_context* mupdf_context, DatabaseManager* db, CachedChecksummer* checksummer, PageImageCache* page_image_cache, LibraryIndex* library_index, DocumentHandlePool* document_handle_pool) :
 	mupdf_context(mupdf_context),
 	db_manager(db),
-	checksummer(checksummer)
+	checksummer(checksummer),
+	page_image_cache(page_image_cache),
+	library_index(library_index),
+	document_handle_pool(document_handle_pool)
 {
 	//get_prev_path_hash_pairs(database, const std::string& path, std::vector<std::pair<std::wstring, std::wstring>>& out_pairs);
 }
@@ -798,7 +974,7 @@ Document* DocumentManager::get_document(const std::wstring& path) {
 	if (cached_documents.find(path) != cached_documents.end()) {
 		return cached_documents.at(path);
 	}
-	Document* new_doc = new Document(mupdf_context, path, db_manager, checksummer);
+	Document* new_doc = new Document(mupdf_context, path, db_manager, checksummer, page_image_cache, library_index, document_handle_pool);
 	cached_documents[path] = new_doc;
 	return new_doc;
 }
@@ -807,6 +983,18 @@ const std::unordered_map<std::wstring, Document*>& DocumentManager::get_cached_d
 	return cached_documents;
 }
 
+PageImageCache* DocumentManager::get_page_image_cache() {
+	return page_image_cache;
+}
+
+LibraryIndex* DocumentManager::get_library_index() {
+	return library_index;
+}
+
+DocumentHandlePool* DocumentManager::get_document_handle_pool() {
+	return document_handle_pool;
+}
+
 void DocumentManager::delete_global_mark(char symbol) {
 	for (auto [path, doc] : cached_documents) {
 		doc->remove_mark(symbol);
@@ -830,13 +1018,10 @@ fz_stext_page* Document::get_stext_with_page_number(fz_context* ctx, int page_nu
 		nocache = true;
 	}
 
-	const int MAX_CACHED_STEXT_PAGES = 10;
-
 	if (!nocache) {
-		for (auto [page, cached_stext_page] : cached_stext_pages) {
-			if (page == page_number) {
-				return cached_stext_page;
-			}
+		fz_stext_page* cached_stext_page = stext_page_cache.find(page_number);
+		if (cached_stext_page != nullptr) {
+			return cached_stext_page;
 		}
 	}
 
@@ -856,11 +1041,7 @@ fz_stext_page* Document::get_stext_with_page_number(fz_context* ctx, int page_nu
 	if (stext_page != nullptr) {
 
 		if (!nocache) {
-			if (cached_stext_pages.size() == MAX_CACHED_STEXT_PAGES) {
-				fz_drop_stext_page(ctx, cached_stext_pages[0].second);
-				cached_stext_pages.erase(cached_stext_pages.begin());
-			}
-			cached_stext_pages.push_back(std::make_pair(page_number, stext_page));
+			stext_page_cache.insert(page_number, stext_page);
 		}
 		return stext_page;
 	}
@@ -868,6 +1049,30 @@ fz_stext_page* Document::get_stext_with_page_number(fz_context* ctx, int page_nu
 	return nullptr;
 }
 
+void Document::prefetch_stext_pages(const std::vector<int>& visible_pages) {
+	if (visible_pages.size() == 0) {
+		return;
+	}
+
+	// the visible pages first and then the pages right after and before them
+	std::vector<int> pages = visible_pages;
+	int first_page = *std::min_element(visible_pages.begin(), visible_pages.end());
+	int last_page = *std::max_element(visible_pages.begin(), visible_pages.end());
+	for (int i = 1; i <= STEXT_PREFETCH_PAGES; i++) {
+		if (last_page + i < num_pages()) {
+			pages.push_back(last_page + i);
+		}
+		if (first_page - i >= 0) {
+			pages.push_back(first_page - i);
+		}
+	}
+	stext_page_cache.prefetch(pages);
+}
+
+bool Document::request_stext_pages(const std::vector<int>& pages, QObject* receiver, std::function<void()> on_ready) {
+	return stext_page_cache.request(pages, receiver, on_ready);
+}
+
 int Document::get_page_offset() {
 	return page_offset;
 }
@@ -898,13 +1103,10 @@ DocumentPos Document::absolute_to_page_pos(AbsoluteDocumentPos absp){
 		return {0, 0.0f, 0.0f};
 	}
 
-	int i = (std::lower_bound(
-		accum_page_heights.begin(),
-		accum_page_heights.end(), absp.y) -  accum_page_heights.begin()) - 1;
-	i = std::max(0, i);
+	int i = accum_page_heights.find_last_less(absp.y);
 
 	if (i < accum_page_heights.size()) {
-		float acc_page_heights_i = accum_page_heights[i];
+		float acc_page_heights_i = accum_page_heights.prefix_sum(i);
 		float page_width = page_widths[i];
 		float remaining_y = absp.y - acc_page_heights_i;
 
@@ -930,102 +1132,259 @@ int Document::get_offset_page_number(float y_offset) {
 		return -1;
 	}
 
-	auto it = std::lower_bound(accum_page_heights.begin(), accum_page_heights.end(), y_offset);
+	// we are looking for the last page which begins before y_offset
+	return accum_page_heights.find_last_less(y_offset);
+}
+
+int Document::get_offset_page_anchor(float y_offset, float* out_page_offset, int* out_dimensions_version) {
+	std::lock_guard guard(page_dims_mutex);
 
-	// std::lower_bound returns an iterator pointing to the first element of the vector not less than y_offset,
-	// but we are looking for the last element of vector that is less than y_offset
-	if (it > accum_page_heights.begin()) {
-		it--;
+	*out_dimensions_version = page_dimensions_version;
+	if (accum_page_heights.size() == 0) {
+		*out_page_offset = y_offset;
+		return -1;
 	}
 
-	return (it - accum_page_heights.begin());
+	int page = accum_page_heights.find_last_less(y_offset);
+	*out_page_offset = y_offset - accum_page_heights.prefix_sum(page);
+	return page;
 }
 
-void Document::index_document(bool* invalid_flag) {
-	int n = num_pages();
-
-	if (this->document_indexing_thread.has_value()) {
-		// if we are already indexing figures, we should wait for the previous thread to finish
-		this->document_indexing_thread.value().join();
+int get_num_indexing_threads() {
+	if (INDEXING_THREADS > 0) {
+		return INDEXING_THREADS;
 	}
+	// by default we leave half of the cores for rendering
+	return std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / 2);
+}
 
-	is_document_indexing_required = true;
-	is_indexing = true;
+void Document::index_shard_pages(fz_context* context_, fz_document* doc_, DocumentIndexShard& shard, bool should_create_toc, bool should_index_text) {
+	// the text of each page is converted to the compact representation of the search index
+	std::wstring page_text;
+	std::vector<int> page_pages;
+	std::vector<fz_rect> page_rects;
 
-	this->document_indexing_thread = std::thread([this, n, invalid_flag]() {
-		std::vector<IndexedData> local_generic_data;
-		std::map<std::wstring, IndexedData> local_reference_data;
-		std::map<std::wstring, std::vector<IndexedData>> local_equation_data;
+	for (int i = shard.begin_page; i < shard.end_page; i++) {
+		// when we close a document before its indexing is finished, we should stop indexing as soon as posible
+		if (!is_document_indexing_required) {
+			break;
+		}
+
+		// we don't use get_stext_with_page_number here on purpose because it would lead to many unnecessary allocations
+		fz_stext_page* stext_page = nullptr;
+		fz_try(context_) {
+			stext_page = fz_new_stext_page_from_page_number(context_, doc_, i, nullptr);
+		}
+		fz_catch(context_) {
+			std::wcout << L"Error: could not index page " << i << L"\n";
+		}
+
+		shard.created_toc_candidates.push_back({});
+		if (stext_page == nullptr) {
+			continue;
+		}
+
+		std::vector<fz_stext_char*> flat_chars;
+		get_flat_chars_from_stext_page(stext_page, flat_chars);
+
+		if (should_index_text) {
+			page_text.clear();
+			page_pages.clear();
+			page_rects.clear();
+			flat_char_prism(flat_chars, i, page_text, page_pages, page_rects);
+			shard.super_fast_search_index.add_page(i, page_text, page_rects);
+		}
+
+		index_references(stext_page, i, shard.reference_data);
+		index_equations(flat_chars, i, shard.equation_data);
+		index_generic(flat_chars, i, shard.generic_data);
 
-		std::wstring local_super_fast_search_index;
-		std::vector<int> local_super_fast_search_pages;
-		std::vector<fz_rect> local_super_fast_search_rects;
+		if (should_create_toc) {
+			get_created_toc_candidates(stext_page, i, shard.created_toc_candidates.back());
+		}
 
-		std::vector<TocNode*> toc_stack;
-		std::vector<TocNode*> top_level_nodes;
-		int num_added_toc_entries = 0;
+		fz_drop_stext_page(context_, stext_page);
+	}
+}
+
+std::vector<DocumentIndexShard> Document::compute_index_shards(int num_pages, int num_threads, bool should_index_text) {
+	/*
+	Splits the document into shards of DOCUMENT_INDEXING_SHARD_PAGES consecutive pages which are indexed
+	by a pool of `num_threads` threads. Since the cost of indexing a page varies a lot, threads take the next
+	unindexed shard when they are done instead of indexing a fixed range of pages. Each thread uses its
+	own cloned context and a document from the document handle pool because mupdf documents can't be used by
+	multiple threads at the same time.
+	*/
+	int num_shards = (num_pages + DOCUMENT_INDEXING_SHARD_PAGES - 1) / DOCUMENT_INDEXING_SHARD_PAGES;
+	std::vector<DocumentIndexShard> shards(num_shards);
+	for (int i = 0; i < num_shards; i++) {
+		shards[i].begin_page = i * DOCUMENT_INDEXING_SHARD_PAGES;
+		shards[i].end_page = std::min(num_pages, (i + 1) * DOCUMENT_INDEXING_SHARD_PAGES);
+	}
 
+	// if the document doesn't have table of contents, try to create one
+	bool should_create_toc = CREATE_TABLE_OF_CONTENTS_IF_NOT_EXISTS && (top_level_toc_nodes.size() == 0);
+	std::atomic<int> next_shard = 0;
+
+	auto index_shards = [&]() {
 		fz_context* context_ = fz_clone_context(context);
-		fz_try(context_) {
+		// the documents which were opened to load the page dimensions are usually idle by now
+		fz_document* doc_ = document_handle_pool->acquire(context_, file_name);
+
+		if (doc_ != nullptr) {
+			int shard_index = next_shard++;
+			while ((shard_index < num_shards) && is_document_indexing_required) {
+				index_shard_pages(context_, doc_, shards[shard_index], should_create_toc, should_index_text);
+				shard_index = next_shard++;
+			}
+			document_handle_pool->release(context_, doc_);
+		}
+		else {
+			std::wcout << L"There was an error in indexing thread.\n";
+		}
+		fz_drop_context(context_);
+	};
+
+	num_threads = std::max(1, std::min(num_threads, num_shards));
+	std::vector<std::thread> helper_threads;
+	for (int i = 1; i < num_threads; i++) {
+		helper_threads.push_back(std::thread(index_shards));
+	}
+	index_shards();
+	for (auto& helper_thread : helper_threads) {
+		helper_thread.join();
+	}
+
+	return shards;
+}
+
+void Document::compute_document_index(int num_pages, DocumentIndex& index, bool should_index_text) {
+	std::vector<TocNode*> toc_stack;
+	int num_added_toc_entries = 0;
+
+	auto indexing_begin = std::chrono::steady_clock::now();
+	int num_threads = get_num_indexing_threads();
+	std::vector<DocumentIndexShard> shards = compute_index_shards(num_pages, num_threads, should_index_text);
+
+	// merge the shards in page order, so the result is the same as indexing the pages sequentially
+	for (auto& shard : shards) {
+		index.generic_indices.insert(index.generic_indices.end(), shard.generic_data.begin(), shard.generic_data.end());
+
+		// references of the later pages replace the references of the earlier pages with the same name
+		for (auto& [name, reference] : shard.reference_data) {
+			index.reference_indices[name] = std::move(reference);
+		}
+		for (auto& [name, equations] : shard.equation_data) {
+			std::vector<IndexedData>& merged_equations = index.equation_indices[name];
+			merged_equations.insert(merged_equations.end(), equations.begin(), equations.end());
+		}
 
-			fz_document* doc_ = fz_open_document(context_, utf8_encode(file_name).c_str());
+		index.super_fast_search_index.append(shard.super_fast_search_index);
+		shard.super_fast_search_index.clear();
 
-			if (document_needs_password) {
-				fz_authenticate_password(context_, doc_, correct_password.c_str());
+		for (const auto& candidates : shard.created_toc_candidates) {
+			if (num_added_toc_entries < MAX_CREATED_TABLE_OF_CONTENTS_SIZE) {
+				num_added_toc_entries += add_candidates_to_created_toc(candidates, toc_stack, index.created_toc_nodes);
 			}
-			for (int i = 0; i < n; i++) {
-				// when we close a document before its indexing is finished, we should stop indexing as soon as posible
-				if (!is_document_indexing_required) {
-					break;
+			else {
+				for (auto candidate : candidates) {
+					delete candidate;
 				}
+			}
+		}
+	}
 
-				// we don't use get_stext_with_page_number here on purpose because it would lead to many unnecessary allocations
-				fz_stext_page* stext_page = fz_new_stext_page_from_page_number(context_, doc_, i, nullptr);
+	if (DEBUG) {
+		long long indexing_millis = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - indexing_begin).count();
+		std::wcout << L"indexed " << num_pages << L" pages in " << indexing_millis << L" ms using " << num_threads << L" threads ("
+			<< (indexing_millis > 0 ? (1000 * num_pages / indexing_millis) : num_pages) << L" pages/second)\n";
+	}
+}
 
-				std::vector<fz_stext_char*> flat_chars;
-				get_flat_chars_from_stext_page(stext_page, flat_chars);
+int Document::get_document_index_flags() {
+	int flags = 0;
+	if (SUPER_FAST_SEARCH) {
+		flags |= DOCUMENT_INDEX_HAS_SUPER_FAST_SEARCH;
+	}
+	if (CREATE_TABLE_OF_CONTENTS_IF_NOT_EXISTS && (top_level_toc_nodes.size() == 0)) {
+		flags |= DOCUMENT_INDEX_HAS_CREATED_TOC;
+	}
+	return flags;
+}
 
-				if (SUPER_FAST_SEARCH) {
-					flat_char_prism(flat_chars, i, local_super_fast_search_index, local_super_fast_search_pages, local_super_fast_search_rects);
-				}
+void Document::index_document(bool* invalid_flag) {
+	int n = num_pages();
 
-				index_references(stext_page, i, local_reference_data);
-				index_equations(flat_chars, i, local_equation_data);
-				index_generic(flat_chars, i, local_generic_data);
+	if (this->document_indexing_thread.has_value()) {
+		// if we are already indexing figures, we should wait for the previous thread to finish
+		this->document_indexing_thread.value().join();
+	}
 
-				// if the document doesn't have table of contents, try to create one
-				if (CREATE_TABLE_OF_CONTENTS_IF_NOT_EXISTS && (top_level_toc_nodes.size() == 0)) {
-					if (num_added_toc_entries < MAX_CREATED_TABLE_OF_CONTENTS_SIZE) {
-						num_added_toc_entries += add_stext_page_to_created_toc(stext_page, i, toc_stack, top_level_nodes);
-					}
-				}
+	is_document_indexing_required = true;
+	is_indexing = true;
 
-				fz_drop_stext_page(context_, stext_page);
-			}
+	this->document_indexing_thread = std::thread([this, n, invalid_flag]() {
+		DocumentIndex index;
+
+		// documents which were indexed before are loaded from the index cache
+		int index_flags = get_document_index_flags();
+		std::optional<Path> index_file_path = {};
+		std::string checksum;
+		if (CACHE_DOCUMENT_INDICES || LIBRARY_SEARCH) {
+			checksum = checksummer->get_checksum(get_path());
+		}
+		if (CACHE_DOCUMENT_INDICES && (checksum.size() > 0)) {
+			index_file_path = get_document_index_file_path(checksum);
+		}
 
+		// the library index is created from the text of the super fast search index, so when super fast search is
+		// disabled we extract the text of documents which are not in the library index yet (the cached indices of
+		// these documents don't have the text)
+		bool should_add_to_library = LIBRARY_SEARCH && (checksum.size() > 0) && library_index && library_index->is_open() && (!library_index->has_document(checksum));
+		bool should_index_text = SUPER_FAST_SEARCH || should_add_to_library;
 
-			fz_drop_document(context_, doc_);
+		bool is_loaded = index_file_path.has_value() && (SUPER_FAST_SEARCH || !should_add_to_library) &&
+			load_document_index(index_file_path.value(), get_path(), index_flags, index);
+		if (!is_loaded) {
+			compute_document_index(n, index, should_index_text);
+
+			// don't add or save incomplete indices
+			if (should_add_to_library && is_document_indexing_required) {
+				library_index->add_document(checksum, index.super_fast_search_index);
+			}
+			if (!SUPER_FAST_SEARCH) {
+				index.super_fast_search_index.clear();
+			}
+			if (index_file_path && is_document_indexing_required) {
+				save_document_index(index_file_path.value(), get_path(), index_flags, index);
+			}
 		}
-		fz_catch(context_) {
-			std::wcout << L"There was an error in indexing thread.\n";
+		else if (should_add_to_library) {
+			library_index->add_document(checksum, index.super_fast_search_index);
 		}
 
-		fz_drop_context(context_);
+		WordIndex new_word_index;
+		if (SUPER_FAST_SEARCH) {
+			new_word_index.build(index.super_fast_search_index);
+		}
 
 		document_indexing_mutex.lock();
 
-		reference_indices = std::move(local_reference_data);
-		equation_indices = std::move(local_equation_data);
-		generic_indices = std::move(local_generic_data);
+		document_index_generation++;
+		reference_indices = std::move(index.reference_indices);
+		equation_indices = std::move(index.equation_indices);
+		generic_indices = std::move(index.generic_indices);
 
-		super_fast_search_index = std::move(local_super_fast_search_index);
-		super_fast_search_index_pages = std::move(local_super_fast_search_pages);
-		super_fast_search_rects = std::move(local_super_fast_search_rects);
+		super_fast_search_index = std::move(index.super_fast_search_index);
+		word_index = std::move(new_word_index);
+		last_search_matches_mutex.lock();
+		last_search_matches = {};
+		last_search_matches_mutex.unlock();
 		if (SUPER_FAST_SEARCH) {
 			super_fast_search_index_ready = true;
 		}
 
-		created_top_level_toc_nodes = std::move(top_level_nodes);
+		created_top_level_toc_nodes = std::move(index.created_toc_nodes);
 
 		document_indexing_mutex.unlock();
 		is_indexing = false;
@@ -1036,6 +1395,184 @@ void Document::index_document(bool* invalid_flag) {
 	//thread.detach();
 }
 
+std::wstring Document::benchmark_indexing() {
+	/*
+	Indexes the document with 1, 2, 4, ... threads (up to the number of cores) and reports the number of
+	indexed pages per second for each thread count. The indices are discarded.
+	*/
+	int n = num_pages();
+	int max_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+	std::vector<int> thread_counts;
+	for (int num_threads = 1; num_threads < max_threads; num_threads *= 2) {
+		thread_counts.push_back(num_threads);
+	}
+	thread_counts.push_back(max_threads);
+
+	std::wstringstream report;
+	report << L"indexing " << n << L" pages:";
+	for (int num_threads : thread_counts) {
+		if (is_benchmark_cancelled) {
+			break;
+		}
+		auto indexing_begin = std::chrono::steady_clock::now();
+		std::vector<DocumentIndexShard> shards = compute_index_shards(n, num_threads, SUPER_FAST_SEARCH);
+		long long indexing_millis = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - indexing_begin).count();
+
+		for (auto& shard : shards) {
+			for (auto& candidates : shard.created_toc_candidates) {
+				for (auto candidate : candidates) {
+					delete candidate;
+				}
+			}
+		}
+
+		report << L" " << num_threads << L" threads: " << (indexing_millis > 0 ? (1000 * n / indexing_millis) : n) << L" pages/second,";
+	}
+	std::wstring res = report.str();
+	res.pop_back();
+	return res;
+}
+
+bool Document::run_benchmark(std::function<std::wstring()> benchmark, QObject* receiver, std::function<void(const std::wstring&)> on_finished) {
+	if (is_benchmark_running) {
+		return false;
+	}
+	if (benchmark_thread.has_value()) {
+		// the previous benchmark is finished, so this doesn't block
+		benchmark_thread.value().join();
+	}
+
+	is_benchmark_running = true;
+	benchmark_thread = std::thread([this, benchmark, receiver, on_finished]() {
+		std::wstring report = benchmark();
+		if (!is_benchmark_cancelled) {
+			// queued calls to `receiver` are discarded if it is deleted before they are run
+			QMetaObject::invokeMethod(receiver, [on_finished, report]() {
+				on_finished(report);
+				}, Qt::QueuedConnection);
+		}
+		is_benchmark_running = false;
+		});
+	return true;
+}
+
+bool pred_case_insensitive(const wchar_t& c1, const wchar_t& c2) {
+	return std::tolower(c1) == std::tolower(c2);
+}
+
+std::wstring Document::benchmark_search_index() {
+	/*
+	Reports the memory used by the super fast search index per glyph (compared to the memory used by storing a
+	wchar_t, a page number and an fz_rect for each glyph) and the search throughput of a few typical queries.
+	This takes a while, so it should be run in a background thread (see run_benchmark). The search functions lock
+	document_indexing_mutex themselves and the searches which use the index directly lock it while they run, so
+	the index is not replaced while it is being benchmarked.
+	*/
+	if (!super_fast_search_index_ready) {
+		return L"super fast search index is not ready";
+	}
+
+	size_t num_glyphs = 1;
+	std::wstringstream report;
+	{
+		std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
+		num_glyphs = std::max<size_t>(super_fast_search_index.num_glyphs(), 1);
+		size_t uncompressed_bytes_per_glyph = sizeof(wchar_t) + sizeof(int) + sizeof(fz_rect);
+
+		report << super_fast_search_index.num_glyphs() << L" glyphs, "
+			<< static_cast<float>(super_fast_search_index.get_memory_bytes()) / num_glyphs << L" bytes/glyph (was "
+			<< uncompressed_bytes_per_glyph << L"), "
+			<< word_index.num_words() << L" words, word index " << static_cast<float>(word_index.get_memory_bytes()) / num_glyphs << L" bytes/glyph,";
+	}
+
+	auto report_throughput = [&](const std::wstring& name, auto search) {
+		if (is_benchmark_cancelled) {
+			return;
+		}
+		const int num_repeats = 5;
+		size_t num_results = 0;
+		auto search_begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < num_repeats; i++) {
+			num_results = search().size();
+		}
+		long long search_micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - search_begin).count();
+		float glyphs_per_second = static_cast<float>(num_glyphs) * num_repeats / (std::max(search_micros, 1LL) / 1000000.0f);
+
+		report << L" " << name << L": " << num_results << L" results, " << glyphs_per_second / 1000000 << L" Mglyphs/second,";
+	};
+
+	int n = num_pages();
+	report_throughput(L"text", [&]() { return search_text(L"the", true, 0, 0, n - 1); });
+	report_throughput(L"case insensitive text", [&]() { return search_text(L"The", false, 0, 0, n - 1); });
+
+	// the scalar std::search implementation which search_text used before, only finding the match positions
+	report_throughput(L"case insensitive text (std::search)", [&]() {
+		std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
+		const std::u16string& text = super_fast_search_index.get_text();
+		std::u16string query = u"The";
+		auto searcher = std::default_searcher(query.begin(), query.end(), pred_case_insensitive);
+		std::vector<int> positions;
+		for (auto it = std::search(text.begin(), text.end(), searcher); it != text.end(); it = std::search(it + 1, text.end(), searcher)) {
+			positions.push_back(it - text.begin());
+		}
+		return positions;
+		});
+	report_throughput(L"case sensitive text (simd)", [&]() {
+		std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
+		std::vector<std::pair<int, int>> matches;
+		super_fast_search_index.find_all(u"The", true, matches);
+		return matches;
+		});
+	// case insensitive search also ignores diacritics and ligatures
+	report_throughput(L"case insensitive text (simd)", [&]() {
+		std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
+		std::vector<std::pair<int, int>> matches;
+		super_fast_search_index.find_all(u"The", false, matches);
+		return matches;
+		});
+	report_throughput(L"regex", [&]() { return search_regex(L"[0-9]+\\.[0-9]+", true, 0, 0, n - 1); });
+	report_throughput(L"whole word", [&]() { return search_words(L"the", 0, 0, n - 1); });
+	report_throughput(L"word prefix", [&]() { return search_words(L"the*", 0, 0, n - 1); });
+	report_throughput(L"words", [&]() { return search_words(L"the and", 0, 0, n - 1); });
+
+	// the backtracking std::wregex which search_regex used before compared to LinearRegex, only finding the match positions
+	for (std::wstring pattern : { L"[0-9]+\\.[0-9]+", L"(the|a)\\s+\\w+ing", L"\\b\\w+tion\\b" }) {
+		report_throughput(L"regex " + pattern + L" (std::wregex)", [&]() {
+			std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
+			std::vector<std::pair<int, int>> matches;
+			std::wregex regex(pattern);
+			std::match_results<WideCharIterator> match;
+			const char16_t* text_begin = super_fast_search_index.get_text().data();
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+			WideCharIterator search_start = super_fast_search_index.begin();
+			// std::wregex can't be stopped during a search, so we can only give up between matches
+			while ((std::chrono::steady_clock::now() < deadline) && (!is_benchmark_cancelled) && std::regex_search(search_start, super_fast_search_index.end(), match, regex)) {
+				matches.push_back({ static_cast<int>(match[0].first.get() - text_begin), static_cast<int>(match[0].second.get() - text_begin) });
+				search_start = match[0].second;
+				if (match.length() == 0) {
+					if (search_start == super_fast_search_index.end()) break;
+					search_start++;
+				}
+			}
+			return matches;
+			});
+		report_throughput(L"regex " + pattern + L" (linear)", [&]() {
+			std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
+			std::vector<std::pair<int, int>> matches;
+			LinearRegex regex;
+			regex.compile(pattern, true);
+			const std::u16string& text = super_fast_search_index.get_text();
+			regex.find_all(text.data(), text.size(), matches);
+			return matches;
+			});
+	}
+
+	std::wstring res = report.str();
+	res.pop_back();
+	return res;
+}
+
 void Document::stop_indexing() {
 	is_document_indexing_required = false;
 }
@@ -1338,9 +1875,30 @@ fz_pixmap* Document::get_small_pixmap(int page) {
 		}
 	}
 
-	//fz_matrix ctm = fz_scale(0.5f, 0.5f);
-	fz_matrix ctm = fz_scale(SMALL_PIXMAP_SCALE, SMALL_PIXMAP_SCALE);
-	fz_pixmap* res = fz_new_pixmap_from_page_number(context, doc, page, ctm, fz_device_rgb(context), 0);
+	fz_pixmap* res = nullptr;
+
+	// small pixmaps of the previous sessions are cached on disk so that we don't have to render them again
+	std::optional<QImage> cached_image = {};
+	if (page_image_cache) {
+		cached_image = page_image_cache->find(get_path(), page, SMALL_PIXMAP_SCALE);
+	}
+	if (cached_image) {
+		fz_try(context) {
+			res = qimage_to_pixmap(context, cached_image.value());
+		}
+		fz_catch(context) {
+			res = nullptr;
+		}
+	}
+
+	if (res == nullptr) {
+		//fz_matrix ctm = fz_scale(0.5f, 0.5f);
+		fz_matrix ctm = fz_scale(SMALL_PIXMAP_SCALE, SMALL_PIXMAP_SCALE);
+		res = fz_new_pixmap_from_page_number(context, doc, page, ctm, fz_device_rgb(context), 0);
+		if (page_image_cache) {
+			page_image_cache->insert(get_path(), page, SMALL_PIXMAP_SCALE, pixmap_to_qimage(res));
+		}
+	}
 	cached_small_pixmaps.push_back(std::make_pair(page, res));
 	unsigned int SMALL_PIXMAP_CACHE_SIZE = 5;
 
@@ -1684,37 +2242,29 @@ std::optional<std::wstring> Document::get_regex_match_at_position(const std::wre
 }
 
 std::vector<std::vector<fz_rect>> Document::get_page_flat_word_chars(int page){
-	// warning: this function should only be called after get_page_flat_words has already cached the chars
-	if (cached_flat_word_chars.find(page) != cached_flat_word_chars.end()) {
-		return cached_flat_word_chars[page];
-	}
-	return {};
+	return get_page_words(page).word_char_rects;
 }
 
 std::vector<fz_rect> Document::get_page_flat_words(int page) {
-	if (cached_flat_words.find(page) != cached_flat_words.end()) {
-		return cached_flat_words[page];
-	}
+	return get_page_words(page).word_rects;
+}
 
-	fz_stext_page* stext_page = get_stext_with_page_number(page);
-	std::vector<fz_stext_char*> flat_chars;
-	std::vector<fz_rect> word_rects;
-	std::vector<std::vector<fz_rect>> word_char_rects;
-	std::vector<std::pair<fz_rect, int>> word_rects_with_page;
-	get_flat_chars_from_stext_page(stext_page, flat_chars);
-	get_flat_words_from_flat_chars(flat_chars, word_rects, &word_char_rects);
-	cached_flat_words[page] = word_rects;
-	cached_flat_word_chars[page] = word_char_rects;
-    return word_rects;
+const PageWords& Document::get_page_words(int page) {
+	return page_data_cache.get(page, &PageData::words, [&]() {
+		fz_stext_page* stext_page = get_stext_with_page_number(page);
+		std::vector<fz_stext_char*> flat_chars;
+		PageWords res;
+		get_flat_chars_from_stext_page(stext_page, flat_chars);
+		get_flat_words_from_flat_chars(flat_chars, res.word_rects, &res.word_char_rects);
+		return res;
+		});
 }
 
 void Document::rotate() {
+	std::lock_guard guard(page_dims_mutex);
 	std::swap(page_heights, page_widths);
-	float acc_height = 0;
-	for (size_t i = 0; i < page_heights.size(); i++) {
-		accum_page_heights[i] = acc_height;
-		acc_height += page_heights[i];
-	}
+	accum_page_heights.assign(page_heights);
+	page_dimensions_version++;
 }
 
 std::optional<Highlight> Document::get_next_highlight(float abs_y, char type, int offset) const {
@@ -1890,8 +2440,27 @@ std::optional<PdfLink> Document::get_link_in_pos(int page, float doc_x, float do
 	return {};
 }
 
-int Document::add_stext_page_to_created_toc(fz_stext_page* stext_page,
-	int page_number,
+void Document::get_created_toc_candidates(fz_stext_page* stext_page, int page_number, std::vector<TocNode*>& candidates) {
+	LL_ITER(block, stext_page->first_block) {
+		std::vector<fz_stext_char*> chars;
+		get_flat_chars_from_block(block, chars);
+		if (chars.size() > 0) {
+			std::wstring block_string;
+			std::vector<int> indices;
+			get_text_from_flat_chars(chars, block_string, indices);
+			if (is_string_titlish(block_string)) {
+				TocNode* new_node = new TocNode;
+				new_node->page = page_number;
+				new_node->title = block_string;
+				new_node->x = 0;
+				new_node->y = block->bbox.y0;
+				candidates.push_back(new_node);
+			}
+		}
+	}
+}
+
+int Document::add_candidates_to_created_toc(const std::vector<TocNode*>& candidates,
 	std::vector<TocNode*>& toc_node_stack,
 	std::vector<TocNode*>& top_level_nodes) {
 
@@ -1910,7 +2479,10 @@ int Document::add_stext_page_to_created_toc(fz_stext_page* stext_page,
 				toc_node_stack.pop_back();
 			}
 
-			if (are_same) return;
+			if (are_same) {
+				delete node;
+				return;
+			}
 			num_new_entries += 1;
 
 			if (toc_node_stack.size() > 0) {
@@ -1923,38 +2495,28 @@ int Document::add_stext_page_to_created_toc(fz_stext_page* stext_page,
 		}
 	};
 
-	LL_ITER(block, stext_page->first_block) {
-		std::vector<fz_stext_char*> chars;
-		get_flat_chars_from_block(block, chars);
-		if (chars.size() > 0) {
-			std::wstring block_string;
-			std::vector<int> indices;
-			get_text_from_flat_chars(chars, block_string, indices);
-			if (is_string_titlish(block_string)) {
-				TocNode* new_node = new TocNode;
-				new_node->page = page_number;
-				new_node->title = block_string;
-				new_node->x = 0;
-				new_node->y = block->bbox.y0;
-				add_toc_node(new_node);
-			}
-		}
+	for (auto candidate : candidates) {
+		add_toc_node(candidate);
 	}
 	return num_new_entries;
 }
 
 float Document::document_to_absolute_y(int page, float doc_y) {
+	std::lock_guard guard(page_dims_mutex);
 	if ((page < accum_page_heights.size()) && (page >= 0)) {
-		return doc_y + accum_page_heights[page];
+		return doc_y + accum_page_heights.prefix_sum(page);
 	}
 	return 0;
 }
 
 AbsoluteDocumentPos Document::document_to_absolute_pos(DocumentPos doc_pos, bool center_mid) {
-	float absolute_y = document_to_absolute_y(doc_pos.page, doc_pos.y);
-	AbsoluteDocumentPos res = {doc_pos.x, absolute_y};
-	if (center_mid && (doc_pos.page < page_widths.size())) {
-		res.x -= page_widths[doc_pos.page] / 2;
+	std::lock_guard guard(page_dims_mutex);
+	AbsoluteDocumentPos res = {doc_pos.x, 0};
+	if ((doc_pos.page < accum_page_heights.size()) && (doc_pos.page >= 0)) {
+		res.y = doc_pos.y + accum_page_heights.prefix_sum(doc_pos.page);
+		if (center_mid) {
+			res.x -= page_widths[doc_pos.page] / 2;
+		}
 	}
 	return res;
 }
@@ -2054,10 +2616,11 @@ fz_rect Document::get_ith_next_line_from_absolute_y(int page, int line_index, in
 				fz_rect res;
 				//*out_begin = accum_page_heights[page];
 				//*out_end = accum_page_heights[page];
-				res.y0 = accum_page_heights[page];
-				res.y1 = accum_page_heights[page];
+				fz_rect page_rect = get_page_absolute_rect(page);
+				res.y0 = page_rect.y0;
+				res.y1 = res.y0;
 				res.x0 = 0;
-				res.x1 = page_widths[page];
+				res.x1 = page_rect.x1 - page_rect.x0;
 
 				*out_index = 0;
 				*out_page = page;
@@ -2106,25 +2669,17 @@ fz_rect Document::get_ith_next_line_from_absolute_y(int page, int line_index, in
 
 }
 
-const std::vector<fz_rect>& Document::get_page_lines(int page, std::vector<std::wstring>* out_line_texts) {
+std::vector<fz_rect> Document::get_page_lines(int page, std::vector<std::wstring>* out_line_texts) {
 
-
-	if (cached_page_line_rects.find(page) != cached_page_line_rects.end()) {
-		if (out_line_texts != nullptr) {
-			*out_line_texts = cached_line_texts[page];
-		}
-		return cached_page_line_rects[page];
-	}
-	else {
+	// the lines are cached in page coordinates, because the absolute position of the page changes while the
+	// page dimensions are being loaded
+	const PageLines& lines = page_data_cache.get(page, &PageData::lines, [&]() {
+		PageLines res;
 		fz_stext_page* stext_page = get_stext_with_page_number(page);
 		if (stext_page && stext_page->first_block && (!FORCE_CUSTOM_LINE_ALGORITHM)) {
 
 			fz_page* mupdf_page = fz_load_page(context, doc, page);
 			fz_rect bound = fz_bound_page(context, mupdf_page);
-			bound = document_to_absolute_rect(page, bound);
-			int halfwidth = (bound.x1 - bound.x0) / 2;
-			bound.x0 -= halfwidth;
-			bound.x1 -= halfwidth;
 			fz_drop_page(context, mupdf_page);
 
 			std::vector<fz_rect> line_rects;
@@ -2139,31 +2694,13 @@ const std::vector<fz_rect>& Document::get_page_lines(int page, std::vector<std::
 				}
 			}
 			merge_lines(flat_lines, line_rects, line_texts);
-			for (size_t i = 0; i < line_rects.size(); i++) {
-				line_rects[i].x0 = line_rects[i].x0 - page_widths[page] / 2;
-				line_rects[i].x1 = line_rects[i].x1 - page_widths[page] / 2;
-				line_rects[i].y0 = document_to_absolute_y(page, line_rects[i].y0);
-				line_rects[i].y1 = document_to_absolute_y(page, line_rects[i].y1);
-			}
-
-			std::vector<fz_rect> line_rects_;
-			std::vector<std::wstring> line_texts_;
 
 			for (int i = 0; i < line_rects.size(); i++) {
 				if (fz_contains_rect(bound, line_rects[i])) {
-					line_rects_.push_back(line_rects[i]);
-					line_texts_.push_back(line_texts[i]);
+					res.line_rects.push_back(line_rects[i]);
+					res.line_texts.push_back(line_texts[i]);
 				}
 			}
-
-
-			cached_page_line_rects[page] = line_rects_;
-			cached_line_texts[page] = line_texts_;
-
-			if (out_line_texts != nullptr) {
-				*out_line_texts = line_texts_;
-			}
-			
 		}
 		else {
 			fz_pixmap* pixmap = get_small_pixmap(page);
@@ -2172,19 +2709,34 @@ const std::vector<fz_rect>& Document::get_page_lines(int page, std::vector<std::
 			std::vector<unsigned int> line_locations_begins;
 			get_line_begins_and_ends_from_histogram(hist, line_locations_begins, line_locations);
 
-			std::vector<fz_rect> line_rects;
 			for (size_t i = 0; i < line_locations_begins.size(); i++) {
 				fz_rect line_rect;
-				line_rect.x0 = 0 - page_widths[page] / 2;
-				line_rect.x1 = static_cast<float>(pixmap->w) / SMALL_PIXMAP_SCALE - page_widths[page] / 2;
-				line_rect.y0 = document_to_absolute_y(page, static_cast<float>(line_locations_begins[i]) / SMALL_PIXMAP_SCALE);
-				line_rect.y1 = document_to_absolute_y(page, static_cast<float>(line_locations[i]) / SMALL_PIXMAP_SCALE);
-				line_rects.push_back(line_rect);
+				line_rect.x0 = 0;
+				line_rect.x1 = static_cast<float>(pixmap->w) / SMALL_PIXMAP_SCALE;
+				line_rect.y0 = static_cast<float>(line_locations_begins[i]) / SMALL_PIXMAP_SCALE;
+				line_rect.y1 = static_cast<float>(line_locations[i]) / SMALL_PIXMAP_SCALE;
+				res.line_rects.push_back(line_rect);
 			}
-			cached_page_line_rects[page] = line_rects;
 		}
-		return cached_page_line_rects[page];
+		return res;
+		});
+
+	if (out_line_texts != nullptr) {
+		*out_line_texts = lines.line_texts;
+	}
+
+	// all the lines are converted with the same snapshot of the page dimensions
+	fz_rect page_rect = get_page_absolute_rect(page);
+	std::vector<fz_rect> absolute_line_rects;
+	absolute_line_rects.reserve(lines.line_rects.size());
+	for (fz_rect line_rect : lines.line_rects) {
+		line_rect.x0 += page_rect.x0;
+		line_rect.x1 += page_rect.x0;
+		line_rect.y0 += page_rect.y0;
+		line_rect.y1 += page_rect.y0;
+		absolute_line_rects.push_back(line_rect);
 	}
+	return absolute_line_rects;
 }
 void Document::clear_toc_nodes() {
 	for (auto node : top_level_toc_nodes) {
@@ -2211,134 +2763,225 @@ bool Document::is_super_fast_index_ready() {
 	return super_fast_search_index_ready;
 }
 
-bool pred_case_sensitive(const wchar_t& c1, const wchar_t& c2) {
-	return c1 == c2;
-}
+bool Document::search_incremental(const std::wstring& query, bool is_regex, bool case_sensitive, int begin_page, int min_page, int max_page,
+	const std::function<bool()>& should_stop, const SearchResultsCallback& on_results) {
+	/*
+	Searches the super fast index from the beginning of `begin_page` to the end of the document and then from the
+	beginning of the document to `begin_page`, which is the order in which the results are shown. The text is searched
+	in chunks of SUPER_FAST_SEARCH_CHUNK_SIZE characters and the results are reported after each chunk, so the first
+	results can be shown before the whole document is searched.
+	*/
+	if (query.size() == 0) {
+		return true;
+	}
 
-bool pred_case_insensitive(const wchar_t& c1, const wchar_t& c2) {
-	return std::tolower(c1) == std::tolower(c2);
-}
+	// the search runs on the search thread, so we make sure the index is not replaced (e.g. when the document is reloaded) while it is being searched
+	std::unique_lock<std::mutex> indexing_lock(document_indexing_mutex);
+	int index_generation = document_index_generation;
+	bool is_index_replaced = false;
 
-std::vector<SearchResult> Document::search_text(std::wstring query, bool case_sensitive, int begin_page, int min_page, int max_page) {
-	std::vector<SearchResult> output;
+	int text_size = static_cast<int>(super_fast_search_index.size());
+	int begin_position = super_fast_search_index.get_page_begin_position(begin_page);
+	std::vector<std::pair<int, int>> ranges = { {begin_position, text_size}, {0, begin_position} };
 
-	std::vector<SearchResult> before_results;
-	bool is_before = true;
+	int num_searched_characters = 0;
+	auto get_percent_done = [&]() {
+		return text_size > 0 ? static_cast<float>(num_searched_characters) / text_size : 1.0f;
+	};
 
-        auto pred = case_sensitive ? pred_case_sensitive : pred_case_insensitive;
-        auto searcher = std::default_searcher(query.begin(), query.end(), pred);
-        auto it = std::search(
-		super_fast_search_index.begin(),
-		super_fast_search_index.end(),
-                searcher);
+	auto add_search_result = [&](int start_index, int end_index, std::vector<SearchResult>& results) {
+		if (start_index >= end_index) {
+			return;
+		}
+		int match_page = super_fast_search_index.get_position_page(start_index);
+		if ((match_page < min_page) || (match_page > max_page)) {
+			return;
+		}
 
-	for ( ; it != super_fast_search_index.end(); it = std::search(it+1, super_fast_search_index.end(), searcher)) {
-		int start_index = it - super_fast_search_index.begin();
+		// the rects are only decoded for the matched characters
 		std::vector<fz_rect> match_rects;
 		std::vector<fz_rect> compressed_match_rects;
+		super_fast_search_index.get_range_rects(start_index, end_index, match_rects);
+		merge_selected_character_rects(match_rects, compressed_match_rects);
+		results.push_back(SearchResult{ compressed_match_rects, match_page });
+	};
 
-		int match_page = super_fast_search_index_pages[start_index];
+	// the callbacks are called without holding the lock, so they can take the locks of the caller without blocking the
+	// indexing thread, returns false if the index was replaced in the meantime
+	auto report_results = [&](std::vector<SearchResult>&& results) {
+		indexing_lock.unlock();
+		on_results(std::move(results), get_percent_done());
+		indexing_lock.lock();
+		if (document_index_generation != index_generation) {
+			is_index_replaced = true;
+		}
+		return !is_index_replaced;
+	};
 
-		if (match_page >= begin_page) {
-			is_before = false;
+	if (is_regex) {
+		LinearRegex regex;
+		if (!regex.compile(query, case_sensitive)) {
+			return true;
 		}
 
-		int end_index = start_index + query.size();
+		// we give up on patterns which take too long and keep the results found so far
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REGEX_SEARCH_TIMEOUT_MILLISECONDS);
+		const std::u16string& text = super_fast_search_index.get_text();
 
+		for (auto [range_begin, range_end] : ranges) {
+			std::vector<std::pair<int, int>> matches;
+			size_t num_reported_matches = 0;
+			int last_reported_position = range_begin;
 
-		for (int j = start_index; j < end_index; j++) {
-			fz_rect rect = super_fast_search_rects[j];
-			match_rects.push_back(rect);
+			auto report_matches = [&](int position) {
+				position = std::min(position, range_end);
+				if (position > last_reported_position) {
+					num_searched_characters += position - last_reported_position;
+					last_reported_position = position;
+				}
+				std::vector<SearchResult> results;
+				for (; num_reported_matches < matches.size(); num_reported_matches++) {
+					add_search_result(matches[num_reported_matches].first, matches[num_reported_matches].second, results);
+				}
+				return report_results(std::move(results));
+			};
+
+			bool is_finished = regex.find_all(text.data(), text.size(), matches, [&](size_t position) {
+				if (static_cast<int>(position) >= last_reported_position + SUPER_FAST_SEARCH_CHUNK_SIZE) {
+					// `text` is no longer valid when the index is replaced, so we stop immediately
+					if (!report_matches(static_cast<int>(position))) {
+						return true;
+					}
+				}
+				bool is_timed_out = (REGEX_SEARCH_TIMEOUT_MILLISECONDS > 0) && (std::chrono::steady_clock::now() > deadline);
+				return is_timed_out || should_stop();
+				}, range_begin, range_end);
+
+			if (is_index_replaced || (!report_matches(range_end)) || (!is_finished)) {
+				return false;
+			}
 		}
+		return true;
+	}
 
-		merge_selected_character_rects(match_rects, compressed_match_rects);
-		SearchResult res { compressed_match_rects, match_page };
+	std::u16string utf16_query = wstring_to_utf16(query);
+	// matches_at expects a normalized query for case insensitive search, we normalize it once instead of at every position
+	std::u16string refine_query = case_sensitive ? utf16_query : normalize_utf16(utf16_query);
 
-		if (!((match_page < min_page) || (match_page > max_page))) {
-			if (is_before) {
-				before_results.push_back(res);
+	// when the query extends the previous query, its matches are a subset of the matches of the previous query
+	std::optional<std::vector<int>> previous_positions;
+	last_search_matches_mutex.lock();
+	if (last_search_matches &&
+		(last_search_matches->case_sensitive == case_sensitive) &&
+		(query.size() > last_search_matches->query.size()) &&
+		(query.compare(0, last_search_matches->query.size(), last_search_matches->query) == 0)) {
+		previous_positions = last_search_matches->positions;
+	}
+	last_search_matches_mutex.unlock();
+
+	std::vector<int> all_positions;
+	for (auto [range_begin, range_end] : ranges) {
+		for (int chunk_begin = range_begin; chunk_begin < range_end; chunk_begin += SUPER_FAST_SEARCH_CHUNK_SIZE) {
+			if (should_stop()) {
+				return false;
+			}
+
+			int chunk_end = std::min(chunk_begin + SUPER_FAST_SEARCH_CHUNK_SIZE, range_end);
+			std::vector<std::pair<int, int>> matches;
+			if (previous_positions) {
+				auto it = std::lower_bound(previous_positions->begin(), previous_positions->end(), chunk_begin);
+				for (; (it != previous_positions->end()) && (*it < chunk_end); it++) {
+					int match_end = 0;
+					if (super_fast_search_index.matches_at(*it, refine_query, case_sensitive, &match_end)) {
+						matches.push_back(std::make_pair(*it, match_end));
+					}
+				}
 			}
 			else {
-				output.push_back(res);
+				// the matches which begin in this chunk (they can end in the next chunk)
+				super_fast_search_index.find_all(utf16_query, case_sensitive, matches, chunk_begin, chunk_end);
+			}
+
+			std::vector<SearchResult> results;
+			for (auto [match_begin, match_end] : matches) {
+				add_search_result(match_begin, match_end, results);
+				all_positions.push_back(match_begin);
+			}
+
+			num_searched_characters += chunk_end - chunk_begin;
+			if (!report_results(std::move(results))) {
+				return false;
 			}
 		}
 	}
-	output.insert(output.end(), before_results.begin(), before_results.end());
+
+	std::sort(all_positions.begin(), all_positions.end());
+	all_positions.erase(std::unique(all_positions.begin(), all_positions.end()), all_positions.end());
+	last_search_matches_mutex.lock();
+	last_search_matches = SuperFastSearchMatches{ query, case_sensitive, std::move(all_positions) };
+	last_search_matches_mutex.unlock();
+	return true;
+}
+
+IncrementalSearchFunction Document::make_incremental_search(const std::wstring& query, bool is_regex, bool case_sensitive, int begin_page, int min_page, int max_page) {
+	std::shared_ptr<DocumentSearchHandle> handle = search_handle;
+	return [handle, query, is_regex, case_sensitive, begin_page, min_page, max_page](const std::function<bool()>& should_stop, const SearchResultsCallback& on_results) {
+		std::lock_guard<std::mutex> handle_lock(handle->mutex);
+		if (handle->document == nullptr) {
+			return false;
+		}
+		return handle->document->search_incremental(query, is_regex, case_sensitive, begin_page, min_page, max_page, [&]() {
+			return handle->is_closed || should_stop();
+			}, on_results);
+	};
+}
+
+std::vector<SearchResult> Document::search_text(std::wstring query, bool case_sensitive, int begin_page, int min_page, int max_page) {
+	std::vector<SearchResult> output;
+	search_incremental(query, false, case_sensitive, begin_page, min_page, max_page, []() { return false; }, [&](std::vector<SearchResult>&& results, float percent_done) {
+		output.insert(output.end(), results.begin(), results.end());
+		});
 	return output;
 }
 
 std::vector<SearchResult> Document::search_regex(std::wstring query, bool case_sensitive, int begin_page, int min_page, int max_page)
 {
 	std::vector<SearchResult> output;
+	search_incremental(query, true, case_sensitive, begin_page, min_page, max_page, []() { return false; }, [&](std::vector<SearchResult>&& results, float percent_done) {
+		output.insert(output.end(), results.begin(), results.end());
+		});
+	return output;
+}
 
-	std::wregex regex;
-	try {
-		if (case_sensitive) {
-			regex = std::wregex(query);
-		} else {
-			regex = std::wregex(query, std::regex_constants::icase);
-		}
-	}
-	catch (const std::regex_error&) {
-		return output;
-	}
-
-
+std::vector<SearchResult> Document::search_words(std::wstring query, int begin_page, int min_page, int max_page) {
+	std::vector<SearchResult> output;
 	std::vector<SearchResult> before_results;
-	bool is_before = true;
 
-	int offset = 0;
+	std::lock_guard<std::mutex> indexing_lock(document_indexing_mutex);
 
-	std::wstring::const_iterator search_start(super_fast_search_index.begin());
-	std::wsmatch match;
-	int empty_tolerance = 1000;
+	std::vector<std::pair<int, int>> matches;
+	word_index.search(query, super_fast_search_index, matches);
 
+	for (auto [start_index, end_index] : matches) {
+		int match_page = super_fast_search_index.get_position_page(start_index);
+		if ((match_page < min_page) || (match_page > max_page)) {
+			continue;
+		}
 
-	while (std::regex_search(search_start, super_fast_search_index.cend(), match, regex)) {
 		std::vector<fz_rect> match_rects;
 		std::vector<fz_rect> compressed_match_rects;
+		super_fast_search_index.get_range_rects(start_index, end_index, match_rects);
+		merge_selected_character_rects(match_rects, compressed_match_rects);
 
-		int match_page = super_fast_search_index_pages[offset + match.position()];
-
-		if (match_page >= begin_page) {
-			is_before = false;
-		}
-
-		int start_index = offset + match.position();
-		int end_index = offset + match.position() + match.length();
-		if (start_index < end_index) {
-
-
-			for (int j = start_index; j < end_index; j++) {
-				fz_rect rect = super_fast_search_rects[j];
-				match_rects.push_back(rect);
-			}
-
-			merge_selected_character_rects(match_rects, compressed_match_rects);
-			SearchResult res { compressed_match_rects, match_page };
-
-			if (!((match_page < min_page) || (match_page > max_page))) {
-				if (is_before) {
-					before_results.push_back(res);
-				}
-				else {
-					output.push_back(res);
-				}
-			}
+		if (match_page < begin_page) {
+			before_results.push_back(SearchResult{ compressed_match_rects, match_page });
 		}
 		else {
-			empty_tolerance--;
-			if (empty_tolerance == 0) {
-				break;
-			}
+			output.push_back(SearchResult{ compressed_match_rects, match_page });
 		}
-
-		offset = end_index;
-		search_start = match.suffix().first;
 	}
 	output.insert(output.end(), before_results.begin(), before_results.end());
 	return output;
-
 }
 
 float Document::max_y_offset() {
@@ -4,6 +4,8 @@
 #include <optional>
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <memory>
 #include <map>
 #include <unordered_map>
 
@@ -23,7 +25,82 @@
 #include "utils.h"
 #include "book.h"
 #include "checksum.h"
+#include "page_image_cache.h"
+#include "library_index.h"
+#include "document_handle_pool.h"
+#include "stext_page_cache.h"
+#include "page_data_cache.h"
+#include "document_index_cache.h"
+#include "search_index.h"
+#include "prefix_sum_tree.h"
+
+extern const int DOCUMENT_INDEXING_SHARD_PAGES;
+extern const int SUPER_FAST_SEARCH_CHUNK_SIZE;
+extern const int PAGE_DIMENSIONS_BATCH_SIZE;
+
+/*
+	The indices computed from a consecutive range of pages [begin_page, end_page). Documents are indexed by
+	multiple threads, each indexing a different range of pages, and then the shards are merged in page order.
+*/
+struct DocumentIndexShard {
+	int begin_page = 0;
+	int end_page = 0;
+
+	std::vector<IndexedData> generic_data;
+	std::map<std::wstring, IndexedData> reference_data;
+	std::map<std::wstring, std::vector<IndexedData>> equation_data;
+
+	SearchIndex super_fast_search_index;
+
+	// the title-like blocks of each page in the range, which are used to create a table of contents for
+	// documents that don't have one (this has to be done sequentially, so it is done when merging the shards)
+	std::vector<std::vector<TocNode*>> created_toc_candidates;
+};
+
+// the positions of the matches of a text query in the super fast search index
+struct SuperFastSearchMatches {
+	std::wstring query;
+	bool case_sensitive = true;
+	std::vector<int> positions;
+};
+
+/*
+	The pages whose dimensions are being loaded by the page dimension loading threads. Pages are handed out in the
+	order of their distance from the focus page (the page the user is looking at), so the pages near the view get
+	their real dimensions first.
+*/
+struct PageDimensionsJob {
+	std::mutex mutex;
+	std::vector<bool> is_claimed;
+	int focus_page = 0;
+	// all the pages in (lower_page, upper_page) are claimed
+	int lower_page = -1;
+	int upper_page = 0;
+
+	PageDimensionsJob(int num_pages, int focus_page);
+	// the next page whose dimensions should be loaded, or -1 if all the pages are claimed
+	int claim_next_page(int new_focus_page);
+};
 
+struct LoadedPageDimensions {
+	int page;
+	float width;
+	float height;
+};
+
+class Document;
+
+/*
+	The searches which run in the search thread access their document through this handle instead of a raw pointer,
+	so that the document can be closed while they are running. Closing the document waits for the running search
+	(which is stopped as soon as possible) and the later searches do nothing.
+*/
+struct DocumentSearchHandle {
+	std::mutex mutex;
+	// null after the document is closed, guarded by `mutex`
+	Document* document = nullptr;
+	std::atomic<bool> is_closed = false;
+};
 
 class Document {
 
@@ -38,13 +115,15 @@ private:
 	std::vector<TocNode*> created_top_level_toc_nodes;
 	std::vector<std::wstring> flat_toc_names;
 	std::vector<int> flat_toc_pages;
-	std::map<int, std::vector<fz_rect>> cached_page_line_rects;
-	std::map<int, std::vector<std::wstring>> cached_line_texts;
 
 	bool super_fast_search_index_ready = false;
-	std::wstring super_fast_search_index;
-	std::vector<int> super_fast_search_index_pages;
-	std::vector<fz_rect> super_fast_search_rects;
+	SearchIndex super_fast_search_index;
+	// the matches of the last text search, when the next query extends it we only check these positions instead of
+	// searching the whole index again
+	std::mutex last_search_matches_mutex;
+	std::optional<SuperFastSearchMatches> last_search_matches;
+	// inverted index of the words of super_fast_search_index
+	WordIndex word_index;
 
 	int page_offset = 0;
 
@@ -52,21 +131,27 @@ private:
 	// number of pages in the document
 	std::optional<int> cached_num_pages = {};
 
-	std::vector<std::pair<int, fz_stext_page*>> cached_stext_pages;
 	std::vector<std::pair<int, fz_pixmap*>> cached_small_pixmaps;
 	std::map<int, std::optional<std::string>> cached_fastread_highlights;
 
 	fz_context* context = nullptr;
 	std::wstring file_name;
-	std::unordered_map<int, fz_link*> cached_page_links;
-	std::unordered_map<int, std::vector<fz_rect>> cached_flat_words;
-	std::unordered_map<int, std::vector<std::vector<fz_rect>>> cached_flat_word_chars;
 	QStandardItemModel* cached_toc_model = nullptr;
 
-	std::vector<float> accum_page_heights;
+	PrefixSumTree accum_page_heights;
 	std::vector<float> page_heights;
 	std::vector<float> page_widths;
 	std::mutex page_dims_mutex;
+	// incremented (under page_dims_mutex) when the dimensions are reloaded, so that the threads which were loading
+	// the previous dimensions stop, and when the dimensions of some pages change
+	int page_dimensions_generation = 0;
+	int page_dimensions_version = 0;
+	std::atomic<int> page_dimensions_focus_page = 0;
+	std::atomic<bool> are_page_dimensions_loaded = false;
+	// the dimensions are loaded in this thread (and the helper threads it starts), which uses the document handle pool
+	// and clones of the context, so it is joined before the document is destroyed or its dimensions are reloaded
+	std::optional<std::thread> page_dimensions_loading_thread = {};
+	std::atomic<bool> should_stop_loading_page_dimensions = false;
 	std::string correct_password = "";
 	bool password_was_correct = false;
 	bool document_needs_password = false;
@@ -81,13 +166,27 @@ private:
 	std::map<std::wstring, std::vector<IndexedData>> equation_indices;
 
 	std::mutex document_indexing_mutex;
+	// incremented (under document_indexing_mutex) when the indices are replaced, so that the searches which release
+	// the lock while reporting their results notice that the index they were searching is gone
+	int document_index_generation = 0;
 	std::optional<std::thread> document_indexing_thread = {};
+	std::shared_ptr<DocumentSearchHandle> search_handle;
 	bool is_document_indexing_required = true;
 	bool is_indexing = false;
+	// benchmarks run in this thread so that they don't block the user interface (see run_benchmark)
+	std::optional<std::thread> benchmark_thread = {};
+	std::atomic<bool> is_benchmark_running = false;
+	std::atomic<bool> is_benchmark_cancelled = false;
 	bool are_highlights_loaded = false;
 
 	QDateTime last_update_time;
 	CachedChecksummer* checksummer;
+	PageImageCache* page_image_cache = nullptr;
+	LibraryIndex* library_index = nullptr;
+	DocumentHandlePool* document_handle_pool = nullptr;
+	StextPageCache stext_page_cache;
+	// the lines, words and links of the recently used pages
+	PageDataCache page_data_cache;
 
 	// we do some of the document processing in a background thread (for example indexing all the
 	// figures/indices and computing page heights. we use this pointer to notify the main thread when
@@ -100,10 +199,16 @@ private:
 	// load marks, bookmarks, links, etc.
 	void load_document_metadata_from_db();
 
+	void load_page_dimensions_in_context(fz_context* context_, fz_document* doc_, PageDimensionsJob& job, int generation);
+	// returns false if the dimensions were reloaded since `generation` was started
+	bool update_page_dimensions(int generation, const std::vector<LoadedPageDimensions>& dimensions);
+	// stops the page dimension loading thread (if any) and waits for it to finish
+	void stop_loading_page_dimensions();
+
 	// convetr the fz_outline structure to our own TocNode structure
 	void create_toc_tree(std::vector<TocNode*>& toc);
 
-	Document(fz_context* context, std::wstring file_name, DatabaseManager* db_manager, CachedChecksummer* checksummer);
+	Document(fz_context* context, std::wstring file_name, DatabaseManager* db_manager, CachedChecksummer* checksummer, PageImageCache* page_image_cache, LibraryIndex* library_index, DocumentHandlePool* document_handle_pool);
 	void clear_toc_nodes();
 	void clear_toc_node(TocNode* node);
 public:
@@ -125,6 +230,11 @@ public:
 	bool get_is_indexing();
 	fz_stext_page* get_stext_with_page_number(fz_context* ctx, int page_number, fz_document* doc=nullptr);
 	fz_stext_page* get_stext_with_page_number(int page_number);
+	// extracts the text of the visible pages and the pages around them in the background
+	void prefetch_stext_pages(const std::vector<int>& visible_pages);
+	// returns true if the text of `pages` is extracted, otherwise extracts it in the background and calls `on_ready` in
+	// the main thread when it is done, unless `receiver` was deleted (see StextPageCache::request)
+	bool request_stext_pages(const std::vector<int>& pages, QObject* receiver, std::function<void()> on_ready);
 	void add_portal(Portal link, bool insert_into_database = true);
 	std::wstring get_path();
 	std::string get_checksum();
@@ -148,6 +258,7 @@ public:
 	std::optional<Highlight> get_prev_highlight(float abs_y, char type=0, int offset=0) const;
 
 	fz_link* get_page_links(int page_number);
+	PageDataCacheStatistics get_page_data_cache_statistics();
 	void add_mark(char symbol, float y_offset);
 	bool remove_mark(char symbol);
 	bool get_mark_location_if_exists(char symbol, float* y_offset);
@@ -170,6 +281,14 @@ public:
 	void rotate();
 	void get_visible_pages(float doc_y_range_begin, float doc_y_range_end, std::vector<int>& visible_pages);
 	void load_page_dimensions(bool force_load_now);
+	// pages near `page` are loaded first by the background page dimension loading threads
+	void set_page_dimensions_focus_page(int page);
+	bool are_all_page_dimensions_loaded();
+	// changes whenever the dimensions of some pages change
+	int get_page_dimensions_version();
+	// the page containing `y_offset` (or -1), the offset of y_offset from the beginning of that page and the version
+	// of the page dimensions they were computed with, all read in one snapshot
+	int get_offset_page_anchor(float y_offset, float* out_page_offset, int* out_dimensions_version);
 	int num_pages();
 	fz_rect get_page_absolute_rect(int page);
 	DocumentPos absolute_to_page_pos(AbsoluteDocumentPos absolute_pos);
@@ -213,6 +332,7 @@ public:
 	void embed_annotations(std::wstring new_file_path);
 	std::vector<fz_rect> get_page_flat_words(int page);
 	std::vector<std::vector<fz_rect>> get_page_flat_word_chars(int page);
+	const PageWords& get_page_words(int page);
 
 	bool needs_password();
 	bool needs_authentication();
@@ -225,22 +345,45 @@ public:
 	std::optional<PdfLink> get_link_in_page_rect(int page, fz_rect rect);
 
 	//void create_table_of_contents(std::vector<TocNode*>& top_nodes);
-	int add_stext_page_to_created_toc(fz_stext_page* stext_page,
-		int page_number,
+	void get_created_toc_candidates(fz_stext_page* stext_page, int page_number, std::vector<TocNode*>& candidates);
+	int add_candidates_to_created_toc(const std::vector<TocNode*>& candidates,
 		std::vector<TocNode*>& toc_node_stack,
 		std::vector<TocNode*>& top_level_node);
 
+	// indexes the document and merges the shards into `index`
+	// `should_index_text` determines whether the text of the pages is added to the super fast search index
+	void compute_document_index(int num_pages, DocumentIndex& index, bool should_index_text);
+	int get_document_index_flags();
+	// indexes all the pages of the document using `num_threads` threads and returns the shards in page order
+	std::vector<DocumentIndexShard> compute_index_shards(int num_pages, int num_threads, bool should_index_text);
+	void index_shard_pages(fz_context* context_, fz_document* doc_, DocumentIndexShard& shard, bool should_create_toc, bool should_index_text);
+	// indexes the document with different numbers of threads and returns a report of the indexing speeds
+	std::wstring benchmark_indexing();
+	// runs `benchmark` (e.g. benchmark_indexing) in a background thread and then calls `on_finished` with its report
+	// in the thread of `receiver` (unless `receiver` is deleted), returns false if another benchmark is still running
+	bool run_benchmark(std::function<std::wstring()> benchmark, QObject* receiver, std::function<void(const std::wstring&)> on_finished);
+	std::wstring benchmark_search_index();
+
 	float document_to_absolute_y(int page, float doc_y);
 	AbsoluteDocumentPos document_to_absolute_pos(DocumentPos, bool center_mid=false);
 	fz_rect document_to_absolute_rect(int page, fz_rect doc_rect, bool center_mid=false);
 
 	//void get_ith_next_line_from_absolute_y(float absolute_y, int i, bool cont, float* out_begin, float* out_end);
 	fz_rect get_ith_next_line_from_absolute_y(int page, int line_index, int i, bool cont, int* out_index, int* out_page);
-	const std::vector<fz_rect>& get_page_lines(int page, std::vector<std::wstring>* line_texts=nullptr);
+	// the absolute rects of the lines of the page (and their texts, when they were detected from the text of the page)
+	std::vector<fz_rect> get_page_lines(int page, std::vector<std::wstring>* line_texts=nullptr);
 
 	bool is_super_fast_index_ready();
+	// searches the super fast index and reports the results in the order of pages starting from `begin_page` as they are found,
+	// returns false if the search was stopped because `should_stop` returned true (or the regex search timed out)
+	bool search_incremental(const std::wstring& query, bool is_regex, bool case_sensitive, int begin_page, int min_page, int max_page,
+		const std::function<bool()>& should_stop, const SearchResultsCallback& on_results);
+	// returns a function which runs search_incremental in the search thread, it does nothing if the document is closed by then
+	IncrementalSearchFunction make_incremental_search(const std::wstring& query, bool is_regex, bool case_sensitive, int begin_page, int min_page, int max_page);
 	std::vector<SearchResult> search_text(std::wstring query, bool case_sensitive, int begin_page, int min_page, int max_page);
 	std::vector<SearchResult> search_regex(std::wstring query, bool case_sensitive, int begin_page, int min_page, int max_page);
+	// searches the word index for the pages which contain all the (case-insensitive) words of `query`, see WordIndex::search
+	std::vector<SearchResult> search_words(std::wstring query, int begin_page, int min_page, int max_page);
 	float max_y_offset();
 
 	friend class DocumentManager;
@@ -251,15 +394,21 @@ private:
 	fz_context* mupdf_context = nullptr;
 	DatabaseManager* db_manager = nullptr;
 	CachedChecksummer* checksummer;
+	PageImageCache* page_image_cache;
+	LibraryIndex* library_index;
+	DocumentHandlePool* document_handle_pool;
 	std::unordered_map<std::wstring, Document*> cached_documents;
 	std::unordered_map<std::string, std::wstring> hash_to_path;
 public:
 
-	DocumentManager(fz_context* mupdf_context, DatabaseManager* db_manager, CachedChecksummer* checksummer);
+	DocumentManager(fz_context* mupdf_context, DatabaseManager* db_manager, CachedChecksummer* checksummer, PageImageCache* page_image_cache, LibraryIndex* library_index, DocumentHandlePool* document_handle_pool);
 
 	Document* get_document(const std::wstring& path);
 	void free_document(Document* document);
 	const std::unordered_map<std::wstring, Document*>& get_cached_documents();
+	PageImageCache* get_page_image_cache();
+	LibraryIndex* get_library_index();
+	DocumentHandlePool* get_document_handle_pool();
 	void delete_global_mark(char symbol);
 	~DocumentManager();
 };
@@ -0,0 +1,137 @@
+#include "document_handle_pool.h"
+
+#include <iostream>
+#include <algorithm>
+
+#include "utils.h"
+
+DocumentHandlePool::DocumentHandlePool(fz_context* context) : context(context) {
+}
+
+DocumentHandlePool::~DocumentHandlePool() {
+	for (auto& pooled_document : documents) {
+		if (!pooled_document.is_in_use) {
+			fz_drop_document(context, pooled_document.doc);
+		}
+	}
+}
+
+void DocumentHandlePool::remove_dropped_documents(std::vector<fz_document*>& dropped_documents) {
+	auto is_outdated = [&](const PooledDocument& pooled_document) {
+		return (!pooled_document.is_in_use) && (pooled_document.generation != path_generations[pooled_document.path]);
+	};
+	for (const auto& pooled_document : documents) {
+		if (is_outdated(pooled_document)) {
+			dropped_documents.push_back(pooled_document.doc);
+		}
+	}
+	documents.erase(std::remove_if(documents.begin(), documents.end(), is_outdated), documents.end());
+
+	int num_idle_documents = static_cast<int>(std::count_if(documents.begin(), documents.end(), [](const PooledDocument& pooled_document) {
+		return !pooled_document.is_in_use;
+		}));
+	while (num_idle_documents > MAX_IDLE_POOLED_DOCUMENTS) {
+		auto least_recent = documents.end();
+		for (auto it = documents.begin(); it != documents.end(); it++) {
+			if ((!it->is_in_use) && ((least_recent == documents.end()) || (it->last_release < least_recent->last_release))) {
+				least_recent = it;
+			}
+		}
+		dropped_documents.push_back(least_recent->doc);
+		documents.erase(least_recent);
+		num_idle_documents--;
+	}
+}
+
+void DocumentHandlePool::drop_documents(fz_context* ctx, const std::vector<fz_document*>& dropped_documents) {
+	for (fz_document* doc : dropped_documents) {
+		fz_try(ctx) {
+			fz_drop_document(ctx, doc);
+		}
+		fz_catch(ctx) {
+			std::cerr << "Error: could not drop pooled document" << std::endl;
+		}
+	}
+}
+
+fz_document* DocumentHandlePool::acquire(fz_context* ctx, const std::wstring& path) {
+	std::vector<fz_document*> dropped_documents;
+	int generation = 0;
+	std::string password = "";
+
+	pool_mutex.lock();
+	remove_dropped_documents(dropped_documents);
+	generation = path_generations[path];
+	for (auto& pooled_document : documents) {
+		if ((!pooled_document.is_in_use) && (pooled_document.path == path)) {
+			pooled_document.is_in_use = true;
+			pool_mutex.unlock();
+			drop_documents(ctx, dropped_documents);
+			return pooled_document.doc;
+		}
+	}
+	if (passwords.find(path) != passwords.end()) {
+		password = passwords[path];
+	}
+	num_opened_documents++;
+	pool_mutex.unlock();
+	drop_documents(ctx, dropped_documents);
+
+	// there is no idle document of `path`, so we open a new one without holding the lock
+	fz_document* doc = nullptr;
+	fz_var(doc);
+	fz_try(ctx) {
+		doc = fz_open_document(ctx, utf8_encode(path).c_str());
+		if (fz_needs_password(ctx, doc) && (password.size() > 0)) {
+			fz_authenticate_password(ctx, doc, password.c_str());
+		}
+	}
+	fz_catch(ctx) {
+		std::wcerr << L"Error: could not open " << path << std::endl;
+		fz_drop_document(ctx, doc);
+		doc = nullptr;
+	}
+
+	if (doc != nullptr) {
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		PooledDocument pooled_document;
+		pooled_document.path = path;
+		pooled_document.doc = doc;
+		pooled_document.generation = generation;
+		pooled_document.is_in_use = true;
+		documents.push_back(pooled_document);
+	}
+	return doc;
+}
+
+void DocumentHandlePool::release(fz_context* ctx, fz_document* doc) {
+	if (doc == nullptr) return;
+
+	std::vector<fz_document*> dropped_documents;
+	pool_mutex.lock();
+	for (auto& pooled_document : documents) {
+		if (pooled_document.doc == doc) {
+			pooled_document.is_in_use = false;
+			pooled_document.last_release = ++num_releases;
+		}
+	}
+	remove_dropped_documents(dropped_documents);
+	pool_mutex.unlock();
+
+	drop_documents(ctx, dropped_documents);
+}
+
+void DocumentHandlePool::invalidate(const std::wstring& path) {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	path_generations[path]++;
+}
+
+void DocumentHandlePool::set_password(const std::wstring& path, const std::string& password) {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	passwords[path] = password;
+}
+
+int DocumentHandlePool::get_num_opened_documents() {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	return num_opened_documents;
+}
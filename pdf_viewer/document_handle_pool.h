@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include <mupdf/fitz.h>
+
+extern const int MAX_IDLE_POOLED_DOCUMENTS;
+
+/*
+	A pool of opened mupdf documents which is shared by all the threads which read documents (renderer workers,
+	search threads, page dimension loading threads and indexing threads). Opening a document parses its xref and
+	object streams which is slow for huge documents, so instead of opening (and dropping) a document for each task,
+	threads acquire an opened document which no other thread is using and release it back to the pool when they are
+	done. A document can be used with any context cloned from the same base context, but only by one thread at a time.
+	Documents of a path are dropped when the path is invalidated (e.g. because the file has changed) and the least
+	recently released idle documents are dropped when there are more than MAX_IDLE_POOLED_DOCUMENTS of them.
+	All public methods are thread-safe.
+*/
+class DocumentHandlePool {
+private:
+	struct PooledDocument {
+		std::wstring path;
+		fz_document* doc = nullptr;
+		// the generation of the path when the document was opened, documents of older generations are outdated
+		int generation = 0;
+		bool is_in_use = false;
+		long long last_release = 0;
+	};
+
+	fz_context* context = nullptr;
+	std::mutex pool_mutex;
+	std::vector<PooledDocument> documents;
+	std::map<std::wstring, int> path_generations;
+	std::map<std::wstring, std::string> passwords;
+	long long num_releases = 0;
+	int num_opened_documents = 0;
+
+	// removes the outdated idle documents and the least recently released idle documents if there are too many of
+	// them from the pool, the caller should drop them after unlocking pool_mutex
+	void remove_dropped_documents(std::vector<fz_document*>& dropped_documents);
+	void drop_documents(fz_context* ctx, const std::vector<fz_document*>& dropped_documents);
+
+public:
+	DocumentHandlePool(fz_context* context);
+	~DocumentHandlePool();
+
+	// returns an opened document of `path` which is not used by any other thread, or nullptr if it can't be opened
+	fz_document* acquire(fz_context* ctx, const std::wstring& path);
+	// returns a document which was acquired from the pool, `ctx` is used to drop it if it is no longer needed
+	void release(fz_context* ctx, fz_document* doc);
+
+	// documents of `path` which are currently opened are not reused
+	void invalidate(const std::wstring& path);
+	// documents of `path` which need a password are authenticated with `password` when they are opened
+	void set_password(const std::wstring& path, const std::string& password);
+
+	// the number of times a document had to be opened because there was no idle document of its path
+	int get_num_opened_documents();
+};
@@ -0,0 +1,350 @@
+#include "document_index_cache.h"
+
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <algorithm>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qdir.h>
+#include <qdatetime.h>
+#include <qbytearray.h>
+
+extern Path document_index_cache_path;
+extern int DOCUMENT_INDEX_CACHE_MEGABYTES;
+
+// documents are indexed in their own threads, so they may save (and evict) their index files at the same time
+static std::mutex document_index_eviction_mutex;
+
+// should be incremented whenever the file format or the indexing algorithms change
+const uint32_t DOCUMENT_INDEX_VERSION = 3;
+const char DOCUMENT_INDEX_MAGIC[4] = { 'S', 'I', 'D', 'X' };
+
+struct DocumentIndexHeader {
+	char magic[4];
+	uint32_t version;
+	// std::wstring is not portable (wchar_t is 2 bytes on windows and 4 bytes elsewhere)
+	uint32_t wchar_size;
+	uint32_t flags;
+	int64_t document_size;
+	int64_t document_last_edit_time;
+};
+
+/*
+	The index file consists of a DocumentIndexHeader followed by the sections of the index in the order of the
+	fields of DocumentIndex. Arrays are stored as a uint64_t size followed by the raw elements, which allows the
+	large arrays of the super fast search index to be copied with a single memcpy each.
+*/
+class DocumentIndexWriter {
+private:
+	QByteArray data;
+
+public:
+	void write_bytes(const void* bytes, size_t num_bytes) {
+		data.append(static_cast<const char*>(bytes), static_cast<int>(num_bytes));
+	}
+
+	template<typename T>
+	void write(const T& value) {
+		write_bytes(&value, sizeof(T));
+	}
+
+	template<typename T>
+	void write_array(const T* values, size_t size) {
+		write<uint64_t>(size);
+		write_bytes(values, size * sizeof(T));
+	}
+
+	void write_string(const std::wstring& str) {
+		write_array(str.data(), str.size());
+	}
+
+	void write_indexed_data(const IndexedData& indexed_data) {
+		write<int32_t>(indexed_data.page);
+		write<float>(indexed_data.y_offset);
+		write_string(indexed_data.text);
+	}
+
+	void write_toc_node(const TocNode* node) {
+		write_string(node->title);
+		write<int32_t>(node->page);
+		write<float>(node->x);
+		write<float>(node->y);
+		write<uint64_t>(node->children.size());
+		for (const auto child : node->children) {
+			write_toc_node(child);
+		}
+	}
+
+	const QByteArray& get_data() {
+		return data;
+	}
+};
+
+class DocumentIndexReader {
+private:
+	const unsigned char* data;
+	size_t size;
+	size_t position = 0;
+
+public:
+	DocumentIndexReader(const unsigned char* data, size_t size) : data(data), size(size) {}
+
+	// all the read functions return false if the file is truncated
+	bool read_bytes(void* bytes, size_t num_bytes) {
+		if ((num_bytes > size) || (position > size - num_bytes)) {
+			return false;
+		}
+		memcpy(bytes, data + position, num_bytes);
+		position += num_bytes;
+		return true;
+	}
+
+	template<typename T>
+	bool read(T& value) {
+		return read_bytes(&value, sizeof(T));
+	}
+
+	template<typename T, typename Container>
+	bool read_array(Container& values) {
+		uint64_t array_size;
+		if (!read(array_size)) return false;
+		if (array_size > (size - position) / sizeof(T)) return false;
+
+		values.resize(array_size);
+		return read_bytes(values.data(), array_size * sizeof(T));
+	}
+
+	bool read_string(std::wstring& str) {
+		return read_array<wchar_t>(str);
+	}
+
+	bool read_indexed_data(IndexedData& indexed_data) {
+		int32_t page;
+		if (!read(page)) return false;
+		indexed_data.page = page;
+		return read(indexed_data.y_offset) && read_string(indexed_data.text);
+	}
+
+	TocNode* read_toc_node() {
+		TocNode* node = new TocNode;
+		int32_t page;
+		uint64_t num_children;
+		if (!(read_string(node->title) && read(page) && read(node->x) && read(node->y) && read(num_children))) {
+			delete node;
+			return nullptr;
+		}
+		node->page = page;
+		for (uint64_t i = 0; i < num_children; i++) {
+			TocNode* child = read_toc_node();
+			if (child == nullptr) {
+				free_toc_nodes(node->children);
+				delete node;
+				return nullptr;
+			}
+			node->children.push_back(child);
+		}
+		return node;
+	}
+
+	static void free_toc_nodes(std::vector<TocNode*>& nodes) {
+		for (auto node : nodes) {
+			free_toc_nodes(node->children);
+			delete node;
+		}
+		nodes.clear();
+	}
+};
+
+static DocumentIndexHeader get_document_index_header(const std::wstring& document_path, int flags) {
+	QFileInfo document_info(QString::fromStdWString(document_path));
+
+	DocumentIndexHeader header;
+	memcpy(header.magic, DOCUMENT_INDEX_MAGIC, sizeof(header.magic));
+	header.version = DOCUMENT_INDEX_VERSION;
+	header.wchar_size = sizeof(wchar_t);
+	header.flags = flags;
+	header.document_size = document_info.size();
+	header.document_last_edit_time = document_info.lastModified().toMSecsSinceEpoch();
+	return header;
+}
+
+Path get_document_index_file_path(const std::string& checksum) {
+	return document_index_cache_path.slash(utf8_decode(checksum) + L".index");
+}
+
+static void evict_document_indices(const QString& kept_file_path) {
+	/*
+	Deletes the least recently used index files until the cache fits in DOCUMENT_INDEX_CACHE_MEGABYTES. The modification
+	time of the index files is their last access time (see load_document_index). The file at `kept_file_path`
+	was just saved, so it is never deleted. This also deletes the files of the older versions of edited documents
+	(which have a different checksum) and of deleted documents, since they are never used again.
+	*/
+	std::lock_guard guard(document_index_eviction_mutex);
+
+	size_t budget_bytes = static_cast<size_t>(std::max(DOCUMENT_INDEX_CACHE_MEGABYTES, 0)) * 1024 * 1024;
+	QDir dir(QString::fromStdWString(document_index_cache_path.get_path()));
+	// least recently used files first
+	QFileInfoList files = dir.entryInfoList(QStringList() << "*.index", QDir::Files, QDir::Time | QDir::Reversed);
+
+	size_t total_bytes = 0;
+	for (const auto& file : files) {
+		total_bytes += file.size();
+	}
+
+	for (const auto& file : files) {
+		if (total_bytes <= budget_bytes) {
+			break;
+		}
+		if (file.absoluteFilePath() == QFileInfo(kept_file_path).absoluteFilePath()) {
+			continue;
+		}
+		if (QFile::remove(file.absoluteFilePath())) {
+			total_bytes -= file.size();
+		}
+	}
+}
+
+bool save_document_index(const Path& index_file_path, const std::wstring& document_path, int flags, const DocumentIndex& index) {
+	DocumentIndexWriter writer;
+	writer.write(get_document_index_header(document_path, flags));
+
+	const SearchIndex& search_index = index.super_fast_search_index;
+	writer.write_array(search_index.text.data(), search_index.text.size());
+	writer.write_array(search_index.surrogate_positions.data(), search_index.surrogate_positions.size());
+	writer.write_array(search_index.page_numbers.data(), search_index.page_numbers.size());
+	writer.write_array(search_index.page_first_glyphs.data(), search_index.page_first_glyphs.size());
+	writer.write_array(search_index.page_origins.data(), search_index.page_origins.size());
+	writer.write_array(search_index.glyph_rects.data(), search_index.glyph_rects.size());
+
+	writer.write<uint64_t>(index.generic_indices.size());
+	for (const auto& indexed_data : index.generic_indices) {
+		writer.write_indexed_data(indexed_data);
+	}
+
+	writer.write<uint64_t>(index.reference_indices.size());
+	for (const auto& [name, indexed_data] : index.reference_indices) {
+		writer.write_string(name);
+		writer.write_indexed_data(indexed_data);
+	}
+
+	writer.write<uint64_t>(index.equation_indices.size());
+	for (const auto& [name, equations] : index.equation_indices) {
+		writer.write_string(name);
+		writer.write<uint64_t>(equations.size());
+		for (const auto& indexed_data : equations) {
+			writer.write_indexed_data(indexed_data);
+		}
+	}
+
+	writer.write<uint64_t>(index.created_toc_nodes.size());
+	for (const auto node : index.created_toc_nodes) {
+		writer.write_toc_node(node);
+	}
+
+	// write to a temporary file first so that other instances of sioyek never see a partially written index
+	QString file_path = QString::fromStdWString(index_file_path.get_path());
+	QString temp_file_path = file_path + ".tmp";
+	QFile file(temp_file_path);
+	if (!file.open(QIODevice::WriteOnly)) {
+		return false;
+	}
+	bool is_written = file.write(writer.get_data()) == writer.get_data().size();
+	file.close();
+
+	QFile::remove(file_path);
+	if ((!is_written) || (!QFile::rename(temp_file_path, file_path))) {
+		QFile::remove(temp_file_path);
+		return false;
+	}
+
+	evict_document_indices(file_path);
+	return true;
+}
+
+bool load_document_index(const Path& index_file_path, const std::wstring& document_path, int flags, DocumentIndex& index) {
+	QFile file(QString::fromStdWString(index_file_path.get_path()));
+	if (!file.open(QIODevice::ReadOnly)) {
+		return false;
+	}
+
+	// the arrays are copied out of the file contents anyway, so we simply read the whole file
+	QByteArray data = file.readAll();
+
+	DocumentIndexReader reader(reinterpret_cast<const unsigned char*>(data.constData()), static_cast<size_t>(data.size()));
+	DocumentIndexHeader expected_header = get_document_index_header(document_path, flags);
+	DocumentIndexHeader header;
+
+	if ((!reader.read(header)) || (memcmp(&header, &expected_header, sizeof(header)) != 0)) {
+		return false;
+	}
+
+	DocumentIndex res;
+	SearchIndex& search_index = res.super_fast_search_index;
+	bool is_valid = reader.read_array<char16_t>(search_index.text) &&
+		reader.read_array<int>(search_index.surrogate_positions) &&
+		reader.read_array<int>(search_index.page_numbers) &&
+		reader.read_array<int>(search_index.page_first_glyphs) &&
+		reader.read_array<fz_point>(search_index.page_origins) &&
+		reader.read_array<PackedGlyphRect>(search_index.glyph_rects);
+	// the normalized text is not stored in the file because it is cheap to recompute
+	if (is_valid) {
+		search_index.update_normalized_text();
+	}
+
+	uint64_t num_generic_indices = 0;
+	is_valid = is_valid && reader.read(num_generic_indices);
+	for (uint64_t i = 0; is_valid && (i < num_generic_indices); i++) {
+		IndexedData indexed_data;
+		is_valid = reader.read_indexed_data(indexed_data);
+		res.generic_indices.push_back(indexed_data);
+	}
+
+	uint64_t num_references = 0;
+	is_valid = is_valid && reader.read(num_references);
+	for (uint64_t i = 0; is_valid && (i < num_references); i++) {
+		std::wstring name;
+		IndexedData indexed_data;
+		is_valid = reader.read_string(name) && reader.read_indexed_data(indexed_data);
+		res.reference_indices[name] = indexed_data;
+	}
+
+	uint64_t num_equation_names = 0;
+	is_valid = is_valid && reader.read(num_equation_names);
+	for (uint64_t i = 0; is_valid && (i < num_equation_names); i++) {
+		std::wstring name;
+		uint64_t num_equations = 0;
+		is_valid = reader.read_string(name) && reader.read(num_equations);
+		std::vector<IndexedData>& equations = res.equation_indices[name];
+		for (uint64_t j = 0; is_valid && (j < num_equations); j++) {
+			IndexedData indexed_data;
+			is_valid = reader.read_indexed_data(indexed_data);
+			equations.push_back(indexed_data);
+		}
+	}
+
+	uint64_t num_toc_nodes = 0;
+	is_valid = is_valid && reader.read(num_toc_nodes);
+	for (uint64_t i = 0; is_valid && (i < num_toc_nodes); i++) {
+		TocNode* node = reader.read_toc_node();
+		is_valid = node != nullptr;
+		if (node) {
+			res.created_toc_nodes.push_back(node);
+		}
+	}
+
+	if (!is_valid) {
+		DocumentIndexReader::free_toc_nodes(res.created_toc_nodes);
+		return false;
+	}
+
+	// the modification time of the index file is used as its last access time when evicting index files
+	// (changing the file times requires write access on some platforms)
+	file.close();
+	if (file.open(QIODevice::ReadWrite)) {
+		file.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+	}
+
+	index = std::move(res);
+	return true;
+}
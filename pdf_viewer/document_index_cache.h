@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+
+#include <mupdf/fitz.h>
+
+#include "book.h"
+#include "path.h"
+#include "search_index.h"
+
+/*
+	The indices computed by Document::index_document. Computing them requires extracting the text of every
+	page of the document, so we save them in a binary file (one file per document checksum) and load them
+	when the document is reopened instead of indexing it again. The files of the least recently used documents
+	are deleted when the total size of the files exceeds DOCUMENT_INDEX_CACHE_MEGABYTES.
+*/
+struct DocumentIndex {
+	std::vector<IndexedData> generic_indices;
+	std::map<std::wstring, IndexedData> reference_indices;
+	std::map<std::wstring, std::vector<IndexedData>> equation_indices;
+
+	SearchIndex super_fast_search_index;
+
+	std::vector<TocNode*> created_toc_nodes;
+};
+
+// options that affect the computed index, an index file computed with different options is not used
+enum DocumentIndexFlags {
+	DOCUMENT_INDEX_HAS_SUPER_FAST_SEARCH = 1,
+	DOCUMENT_INDEX_HAS_CREATED_TOC = 2
+};
+
+// the index file of the document with the given checksum
+Path get_document_index_file_path(const std::string& checksum);
+
+// saves the index file and then deletes the least recently used index files which don't fit in the cache
+bool save_document_index(const Path& index_file_path, const std::wstring& document_path, int flags, const DocumentIndex& index);
+
+// loads the index file if it was created for the current version of the document (the size and the modification time
+// of the document are stored in the index file) using the same `flags`, returns false otherwise. The file is marked
+// as recently used, so it is evicted after the index files of the documents which were opened before.
+bool load_document_index(const Path& index_file_path, const std::wstring& document_path, int flags, DocumentIndex& index);
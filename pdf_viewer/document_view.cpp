@@ -107,6 +107,30 @@ void DocumentView::set_offsets(float new_offset_x, float new_offset_y) {
 
 	offset_x = new_offset_x;
 	offset_y = new_offset_y;
+	update_offset_anchor();
+}
+
+void DocumentView::update_offset_anchor() {
+	offset_anchor_page = current_document->get_offset_page_anchor(offset_y, &offset_anchor_page_offset, &offset_anchor_dimensions_version);
+
+	if (!current_document->are_all_page_dimensions_loaded()) {
+		current_document->set_page_dimensions_focus_page(offset_anchor_page);
+	}
+}
+
+void DocumentView::update_offset_for_page_dimension_changes() {
+	if (current_document == nullptr) return;
+
+	if (current_document->get_page_dimensions_version() == offset_anchor_dimensions_version) {
+		return;
+	}
+
+	if (offset_anchor_page >= 0) {
+		set_offsets(offset_x, current_document->get_accum_page_height(offset_anchor_page) + offset_anchor_page_offset);
+	}
+	else if (current_document->are_all_page_dimensions_loaded()) {
+		set_offsets(offset_x, offset_y);
+	}
 }
 
 Document* DocumentView::get_document() {
@@ -618,15 +642,23 @@ void DocumentView::move_pages(int num_pages) {
 	if (current_page == -1) {
 		current_page = 0;
 	}
-	move_absolute(0, num_pages * (current_document->get_page_height(current_page) + PAGE_PADDINGS));
+	last_jump_amount = num_pages * (current_document->get_page_height(current_page) + PAGE_PADDINGS);
+	move_absolute(0, last_jump_amount);
 }
 
 void DocumentView::move_screens(int num_screens) {
 	float screen_height_in_doc_space = view_height / zoom_level;
-	set_offset_y(get_offset_y() + num_screens * screen_height_in_doc_space * MOVE_SCREEN_PERCENTAGE);
+	last_jump_amount = num_screens * screen_height_in_doc_space * MOVE_SCREEN_PERCENTAGE;
+	set_offset_y(get_offset_y() + last_jump_amount);
 	//return move_amount;
 }
 
+float DocumentView::take_last_jump_amount() {
+	float res = last_jump_amount;
+	last_jump_amount = 0;
+	return res;
+}
+
 void DocumentView::reset_doc_state() {
 	zoom_level = 1.0f;
 	set_offsets(0.0f, 0.0f);
@@ -668,6 +700,7 @@ void DocumentView::open_document(const std::wstring& doc_path,
 		offset_x = prev_state.value().offset_x;
 		offset_y = prev_state.value().offset_y;
 		set_offsets(offset_x, offset_y);
+		offset_anchor_page = -1;
 		is_auto_resize_mode = false;
 	}
 	else if (load_prev_state) {
@@ -685,6 +718,8 @@ void DocumentView::open_document(const std::wstring& doc_path,
 			offset_x = previous_state.offset_x;
 			offset_y = previous_state.offset_y;
 			set_offsets(previous_state.offset_x, previous_state.offset_y);
+			// the offset was saved when the dimensions of all the pages were known
+			offset_anchor_page = -1;
 			is_auto_resize_mode = false;
 		}
 		else {
@@ -988,16 +1023,32 @@ void DocumentView::goto_vertical_line_pos() {
 	}
 }
 
-void DocumentView::get_text_selection(AbsoluteDocumentPos selection_begin,
+bool DocumentView::get_text_selection(AbsoluteDocumentPos selection_begin,
 	AbsoluteDocumentPos selection_end,
 	bool is_word_selection, // when in word select mode, we select entire words even if the range only partially includes the word
 	std::vector<fz_rect>& selected_characters,
-	std::wstring& selected_text) {
+	std::wstring& selected_text,
+	QObject* receiver,
+	std::function<void()> on_text_ready) {
 
 	if (current_document) {
+		if (on_text_ready) {
+			int begin_page = current_document->absolute_to_page_pos(selection_begin).page;
+			int end_page = current_document->absolute_to_page_pos(selection_end).page;
+			if (begin_page > end_page) {
+				std::swap(begin_page, end_page);
+			}
+			std::vector<int> pages;
+			for (int page = std::max(begin_page, 0); page <= end_page; page++) {
+				pages.push_back(page);
+			}
+			if (!current_document->request_stext_pages(pages, receiver, on_text_ready)) {
+				return false;
+			}
+		}
 		current_document->get_text_selection(selection_begin, selection_end, is_word_selection, selected_characters, selected_text);
 	}
-
+	return true;
 }
 
 int DocumentView::get_page_offset() {
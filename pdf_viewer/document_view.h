@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <thread>
 #include <optional>
+#include <functional>
 
 #include <qapplication.h>
 #include <qpushbutton.h>
@@ -53,6 +54,21 @@ private:
 	int view_height = 0;
 	bool is_auto_resize_mode = true;
 
+	// the (signed) amount of the last move_pages/move_screens jump in absolute document units which was not yet taken
+	float last_jump_amount = 0;
+
+	/*
+	The page containing offset_y and the offset of offset_y in that page, so that the view stays on the same content
+	when the dimensions of the pages before it change while they are being loaded in the background. A negative
+	offset_anchor_page means that offset_y was restored from a previous session, so it is already an offset in the
+	final dimensions.
+	*/
+	int offset_anchor_page = -1;
+	float offset_anchor_page_offset = 0;
+	int offset_anchor_dimensions_version = -1;
+
+	void update_offset_anchor();
+
 
 public:
 	std::vector<fz_rect> selected_character_rects;
@@ -68,6 +84,8 @@ public:
 	void handle_escape();
 	void set_book_state(OpenedBookState state);
 	void set_offsets(float new_offset_x, float new_offset_y);
+	// keeps the view on the same content if the dimensions of the pages of the document changed
+	void update_offset_for_page_dimension_changes();
 	Document* get_document();
 	std::optional<Portal> find_closest_portal(bool limit=false);
 	std::optional<BookMark> find_closest_bookmark();
@@ -88,7 +106,10 @@ public:
 	void set_offset_y(float new_offset_y);
 	std::optional<PdfLink> get_link_in_pos(WindowPos pos);
 	int get_highlight_index_in_pos(WindowPos pos);
-	void get_text_selection(AbsoluteDocumentPos selection_begin, AbsoluteDocumentPos selection_end, bool is_word_selection, std::vector<fz_rect>& selected_characters, std::wstring& text_selection);
+	// when `on_text_ready` is set and the text of the selected pages is not extracted yet, returns false without changing
+	// the selection and calls `on_text_ready` when the text is extracted (unless `receiver` was deleted)
+	bool get_text_selection(AbsoluteDocumentPos selection_begin, AbsoluteDocumentPos selection_end, bool is_word_selection, std::vector<fz_rect>& selected_characters, std::wstring& text_selection,
+		QObject* receiver = nullptr, std::function<void()> on_text_ready = nullptr);
 	void add_mark(char symbol);
 	void add_bookmark(std::wstring desc);
 	void add_highlight(AbsoluteDocumentPos selection_begin, AbsoluteDocumentPos selection_end, char type);
@@ -128,6 +149,8 @@ public:
 	void get_visible_pages(int window_height, std::vector<int>& visible_pages);
 	void move_pages(int num_pages);
 	void move_screens(int num_screens);
+	// the last move_pages/move_screens jump amount, which is reset so that it is only reported once
+	float take_last_jump_amount();
 	void reset_doc_state();
 	void open_document(const std::wstring& doc_path, bool* invalid_flag, bool load_prev_state = true, std::optional<OpenedBookState> prev_state = {}, bool foce_load_dimensions=false);
 	float get_page_offset(int page);
@@ -188,6 +188,40 @@ class RegexSearchCommand : public TextCommand {
 	}
 };
 
+class SearchWordsCommand : public TextCommand {
+
+	void perform(MainWidget* widget) {
+		widget->perform_word_search(this->text.value());
+	}
+
+	std::string get_name() {
+		return "search_words";
+	}
+
+	bool pushes_state() {
+		return true;
+	}
+
+	std::string text_requirement_name() {
+		return "Words";
+	}
+};
+
+class SearchLibraryCommand : public TextCommand {
+
+	void perform(MainWidget* widget) {
+		widget->handle_search_library(this->text.value());
+	}
+
+	std::string get_name() {
+		return "search_library";
+	}
+
+	std::string text_requirement_name() {
+		return "Search Library";
+	}
+};
+
 class AddBookmarkCommand : public TextCommand {
 	void perform(MainWidget* widget) {
 		widget->main_document_view->add_bookmark(text.value());
@@ -784,6 +818,35 @@ class ToggleFullscreenCommand : public Command {
 	bool requires_document() { return false; }
 };
 
+class ShowCacheStatisticsCommand : public Command {
+	void perform(MainWidget* widget) {
+		widget->show_cache_statistics();
+	}
+	std::string get_name() {
+		return "show_cache_statistics";
+	}
+
+	bool requires_document() { return false; }
+};
+
+class BenchmarkIndexingCommand : public Command {
+	void perform(MainWidget* widget) {
+		widget->benchmark_indexing();
+	}
+	std::string get_name() {
+		return "benchmark_indexing";
+	}
+};
+
+class BenchmarkSearchIndexCommand : public Command {
+	void perform(MainWidget* widget) {
+		widget->benchmark_search_index();
+	}
+	std::string get_name() {
+		return "benchmark_search_index";
+	}
+};
+
 class ToggleOneWindowCommand : public Command {
 	void perform(MainWidget* widget) {
 		widget->toggle_two_window_mode();
@@ -2196,6 +2259,8 @@ CommandManager::CommandManager(ConfigManager* config_manager) {
 	new_commands["goto_page_with_page_number"] = []() {return std::make_unique< GotoPageWithPageNumberCommand>(); };
 	new_commands["search"] = []() {return std::make_unique< SearchCommand>(); };
 	new_commands["regex_search"] = []() {return std::make_unique< RegexSearchCommand>(); };
+	new_commands["search_words"] = []() {return std::make_unique< SearchWordsCommand>(); };
+	new_commands["search_library"] = []() {return std::make_unique< SearchLibraryCommand>(); };
 	new_commands["chapter_search"] = []() {return std::make_unique< ChapterSearchCommand>(); };
 	new_commands["move_down"] = []() {return std::make_unique< MoveDownCommand>(); };
 	new_commands["move_up"] = []() {return std::make_unique< MoveUpCommand>(); };
@@ -2234,6 +2299,9 @@ CommandManager::CommandManager(ConfigManager* config_manager) {
 	new_commands["open_document_embedded_from_current_path"] = []() {return std::make_unique< OpenDocumentEmbeddedFromCurrentPathCommand>(); };
 	new_commands["copy"] = []() {return std::make_unique< CopyCommand>(); };
 	new_commands["toggle_fullscreen"] = []() {return std::make_unique< ToggleFullscreenCommand>(); };
+	new_commands["show_cache_statistics"] = []() {return std::make_unique< ShowCacheStatisticsCommand>(); };
+	new_commands["benchmark_indexing"] = []() {return std::make_unique< BenchmarkIndexingCommand>(); };
+	new_commands["benchmark_search_index"] = []() {return std::make_unique< BenchmarkSearchIndexCommand>(); };
 	new_commands["toggle_one_window"] = []() {return std::make_unique< ToggleOneWindowCommand>(); };
 	new_commands["toggle_highlight"] = []() {return std::make_unique< ToggleHighlightCommand>(); };
 	new_commands["toggle_synctex"] = []() {return std::make_unique< ToggleSynctexCommand>(); };
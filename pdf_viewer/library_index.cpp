@@ -0,0 +1,202 @@
+#include "library_index.h"
+
+#include <iostream>
+#include <sstream>
+
+#include "utils.h"
+
+// the rowid of the text of a page is (document id << LIBRARY_INDEX_PAGE_BITS) | page, so all the pages of a
+// document can be found (or deleted) using a range of rowids
+const int LIBRARY_INDEX_PAGE_BITS = 20;
+
+static bool handle_library_index_error(sqlite3* db, int error_code) {
+	if ((error_code != SQLITE_OK) && (error_code != SQLITE_DONE) && (error_code != SQLITE_ROW)) {
+		std::cerr << "Library index SQL Error: " << sqlite3_errmsg(db) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// converts the query to an FTS5 query where each word is quoted (so that the user doesn't have to know
+// the FTS5 query syntax) and the words are ANDed together
+static std::string get_fts_query(const std::wstring& query) {
+	std::wstringstream ss(query);
+	std::wstringstream res;
+	std::wstring word;
+	while (ss >> word) {
+		bool is_prefix = word.back() == L'*';
+		if (is_prefix) {
+			word.pop_back();
+		}
+		if (word.size() == 0) {
+			continue;
+		}
+
+		res << L"\"";
+		for (wchar_t c : word) {
+			if (c == L'"') {
+				res << L"\"";
+			}
+			res << c;
+		}
+		res << L"\"";
+		if (is_prefix) {
+			res << L"*";
+		}
+		res << L" ";
+	}
+	return utf8_encode(res.str());
+}
+
+LibraryIndex::LibraryIndex(const Path& index_file_path) {
+	std::string file_path_utf8 = utf8_encode(index_file_path.get_path());
+	if (sqlite3_open(file_path_utf8.c_str(), &db)) {
+		std::cerr << "could not open library index " << sqlite3_errmsg(db) << std::endl;
+		sqlite3_close(db);
+		db = nullptr;
+		return;
+	}
+
+	// multiple instances of sioyek can add documents at the same time
+	sqlite3_busy_timeout(db, 5000);
+	execute("PRAGMA journal_mode=WAL;");
+
+	bool is_created = execute("CREATE TABLE IF NOT EXISTS library_documents ("\
+		"id INTEGER PRIMARY KEY AUTOINCREMENT,"\
+		"checksum TEXT UNIQUE,"\
+		"index_time TEXT);") &&
+		execute("CREATE VIRTUAL TABLE IF NOT EXISTS library_pages USING fts5(text, tokenize='unicode61 remove_diacritics 2');");
+
+	// sqlite is not compiled with FTS5
+	if (!is_created) {
+		sqlite3_close(db);
+		db = nullptr;
+	}
+}
+
+LibraryIndex::~LibraryIndex() {
+	if (db) {
+		sqlite3_close(db);
+	}
+}
+
+bool LibraryIndex::execute(const char* sql) {
+	char* error_message = nullptr;
+	int error_code = sqlite3_exec(db, sql, nullptr, nullptr, &error_message);
+	if (error_code != SQLITE_OK) {
+		std::cerr << "Library index SQL Error: " << error_message << std::endl;
+		sqlite3_free(error_message);
+		return false;
+	}
+	return true;
+}
+
+bool LibraryIndex::is_open() {
+	return db != nullptr;
+}
+
+bool LibraryIndex::has_document(const std::string& checksum) {
+	if (!db) return false;
+
+	std::lock_guard<std::mutex> lock(db_mutex);
+	sqlite3_stmt* statement = nullptr;
+	if (!handle_library_index_error(db, sqlite3_prepare_v2(db, "SELECT id FROM library_documents WHERE checksum=?;", -1, &statement, nullptr))) {
+		return false;
+	}
+	sqlite3_bind_text(statement, 1, checksum.c_str(), -1, SQLITE_TRANSIENT);
+	bool res = sqlite3_step(statement) == SQLITE_ROW;
+	sqlite3_finalize(statement);
+	return res;
+}
+
+bool LibraryIndex::add_document(const std::string& checksum, const SearchIndex& index) {
+	if (!db) return false;
+
+	std::lock_guard<std::mutex> lock(db_mutex);
+
+	// all the pages are added in a single transaction, which is much faster than a transaction per page and
+	// ensures that partially indexed documents are never visible
+	if (!execute("BEGIN;")) {
+		return false;
+	}
+
+	sqlite3_stmt* insert_document_statement = nullptr;
+	sqlite3_stmt* insert_page_statement = nullptr;
+
+	auto finish = [&](bool is_successful) {
+		sqlite3_finalize(insert_document_statement);
+		sqlite3_finalize(insert_page_statement);
+		execute(is_successful ? "COMMIT;" : "ROLLBACK;");
+		return is_successful;
+	};
+
+	if (!handle_library_index_error(db, sqlite3_prepare_v2(db,
+		"INSERT OR IGNORE INTO library_documents (checksum, index_time) VALUES (?, datetime('now'));", -1, &insert_document_statement, nullptr))) {
+		return finish(false);
+	}
+	sqlite3_bind_text(insert_document_statement, 1, checksum.c_str(), -1, SQLITE_TRANSIENT);
+	if (!handle_library_index_error(db, sqlite3_step(insert_document_statement))) {
+		return finish(false);
+	}
+
+	// the document was already indexed (possibly by another instance of sioyek)
+	if (sqlite3_changes(db) == 0) {
+		return finish(true);
+	}
+	sqlite3_int64 document_id = sqlite3_last_insert_rowid(db);
+
+	if (!handle_library_index_error(db, sqlite3_prepare_v2(db,
+		"INSERT INTO library_pages (rowid, text) VALUES (?, ?);", -1, &insert_page_statement, nullptr))) {
+		return finish(false);
+	}
+
+	const std::u16string& text = index.get_text();
+	for (size_t i = 0; i < index.num_pages(); i++) {
+		int page = index.get_page_number(i);
+		if (page >= (1 << LIBRARY_INDEX_PAGE_BITS)) {
+			break;
+		}
+		auto [begin_position, end_position] = index.get_page_range(i);
+
+		sqlite3_reset(insert_page_statement);
+		sqlite3_bind_int64(insert_page_statement, 1, (document_id << LIBRARY_INDEX_PAGE_BITS) | page);
+		sqlite3_bind_text16(insert_page_statement, 2, text.data() + begin_position, (end_position - begin_position) * sizeof(char16_t), SQLITE_STATIC);
+		if (!handle_library_index_error(db, sqlite3_step(insert_page_statement))) {
+			return finish(false);
+		}
+	}
+	return finish(true);
+}
+
+bool LibraryIndex::search(const std::wstring& query, int max_results, std::vector<LibrarySearchResult>& out_results) {
+	if (!db) return false;
+
+	std::string fts_query = get_fts_query(query);
+	if (fts_query.size() == 0) {
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(db_mutex);
+
+	std::string search_sql = "SELECT library_documents.checksum, library_pages.rowid, snippet(library_pages, 0, '', '', '...', 12) "\
+		"FROM library_pages JOIN library_documents ON library_documents.id = (library_pages.rowid >> " + std::to_string(LIBRARY_INDEX_PAGE_BITS) + ") "\
+		"WHERE library_pages MATCH ? ORDER BY rank LIMIT ?;";
+
+	sqlite3_stmt* statement = nullptr;
+	if (!handle_library_index_error(db, sqlite3_prepare_v2(db, search_sql.c_str(), -1, &statement, nullptr))) {
+		return false;
+	}
+	sqlite3_bind_text(statement, 1, fts_query.c_str(), -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int(statement, 2, max_results);
+
+	int error_code;
+	while ((error_code = sqlite3_step(statement)) == SQLITE_ROW) {
+		LibrarySearchResult result;
+		result.checksum = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+		result.page = static_cast<int>(sqlite3_column_int64(statement, 1) & ((1 << LIBRARY_INDEX_PAGE_BITS) - 1));
+		result.snippet = utf8_decode(reinterpret_cast<const char*>(sqlite3_column_text(statement, 2)));
+		out_results.push_back(result);
+	}
+	sqlite3_finalize(statement);
+	return handle_library_index_error(db, error_code);
+}
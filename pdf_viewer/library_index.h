@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "sqlite3.h"
+#include "path.h"
+#include "search_index.h"
+
+extern const int LIBRARY_SEARCH_MAX_RESULTS;
+
+struct LibrarySearchResult {
+	std::string checksum;
+	int page;
+	// the matched text along with a few words around it
+	std::wstring snippet;
+};
+
+/*
+	A full-text index of the text of all the documents which were opened before, used to search the entire library.
+	The text of each page is stored in an SQLite FTS5 table in a separate database file (so the potentially large
+	index doesn't bloat the user's database and writing to it doesn't lock the database). Documents are identified
+	by their checksum and are added in the background when they are indexed by Document::index_document.
+	All public methods are thread-safe.
+*/
+class LibraryIndex {
+private:
+	sqlite3* db = nullptr;
+	std::mutex db_mutex;
+
+	bool execute(const char* sql);
+
+public:
+	LibraryIndex(const Path& index_file_path);
+	~LibraryIndex();
+
+	bool is_open();
+	bool has_document(const std::string& checksum);
+
+	// adds the text of the pages of `index` to the library index, does nothing if the document is already indexed
+	bool add_document(const std::string& checksum, const SearchIndex& index);
+
+	/*
+		Finds the pages which contain all the words of `query` (words ending with `*` match all the words starting
+		with them), ordered by relevance.
+	*/
+	bool search(const std::wstring& query, int max_results, std::vector<LibrarySearchResult>& out_results);
+};
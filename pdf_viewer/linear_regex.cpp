@@ -0,0 +1,730 @@
+#include "linear_regex.h"
+
+#include <cwctype>
+#include <algorithm>
+
+// limits which prevent patterns like (a{1000}){1000} from using too much memory
+const int MAX_REGEX_REPEAT = 1000;
+const size_t MAX_REGEX_PROGRAM_SIZE = 100000;
+
+// number of steps of the VM between calls to should_stop
+const size_t REGEX_STOP_CHECK_INTERVAL = 4096;
+
+enum class RegexNodeType {
+	Empty,
+	Char,
+	Any,
+	Class,
+	Concat,
+	Alternate,
+	Repeat,
+	Begin,
+	End,
+	WordBoundary,
+	NotWordBoundary
+};
+
+struct RegexNode {
+	RegexNodeType type = RegexNodeType::Empty;
+	char32_t c = 0;
+	int class_index = -1;
+	int min_repeat = 0;
+	// -1 means unbounded
+	int max_repeat = -1;
+	bool is_greedy = true;
+	std::vector<std::unique_ptr<RegexNode>> children;
+};
+
+static std::unique_ptr<RegexNode> make_node(RegexNodeType type) {
+	std::unique_ptr<RegexNode> node = std::make_unique<RegexNode>();
+	node->type = type;
+	return node;
+}
+
+// whether `node` always matches the empty string without testing anything (e.g. an empty group)
+static bool is_empty_node(const RegexNode* node) {
+	switch (node->type) {
+	case RegexNodeType::Empty:
+		return true;
+	case RegexNodeType::Concat:
+	case RegexNodeType::Alternate:
+	case RegexNodeType::Repeat:
+		return std::all_of(node->children.begin(), node->children.end(), [](const auto& child) {
+			return is_empty_node(child.get());
+			});
+	default:
+		return false;
+	}
+}
+
+static bool is_word_char(char32_t c) {
+	return ((c >= L'a') && (c <= L'z')) || ((c >= L'A') && (c <= L'Z')) || ((c >= L'0') && (c <= L'9')) || (c == L'_');
+}
+
+static bool is_line_terminator(char32_t c) {
+	return (c == L'\n') || (c == L'\r') || (c == 0x2028) || (c == 0x2029);
+}
+
+static bool is_predefined_class(wchar_t c) {
+	return (c == L'd') || (c == L'D') || (c == L'w') || (c == L'W') || (c == L's') || (c == L'S');
+}
+
+static bool matches_predefined_class(wchar_t predefined_class, char32_t c) {
+	switch (predefined_class) {
+	case L'd':
+		return (c >= L'0') && (c <= L'9');
+	case L'w':
+		return is_word_char(c);
+	case L's':
+		return std::iswspace(static_cast<wint_t>(c)) || (c == 0xFEFF);
+	}
+	return false;
+}
+
+static char16_t fold_char(char16_t c) {
+	if ((c >= 0xD800) && (c <= 0xDFFF)) {
+		return c;
+	}
+	return static_cast<char16_t>(std::towlower(static_cast<wint_t>(c)));
+}
+
+bool RegexCharClass::matches(char32_t c, bool case_sensitive) const {
+	auto matches_exactly = [&](char32_t ch) {
+		for (const auto& [low, high] : ranges) {
+			if ((ch >= low) && (ch <= high)) return true;
+		}
+		for (const auto& [predefined_class, is_predefined_negated] : predefined_classes) {
+			if (matches_predefined_class(predefined_class, ch) != is_predefined_negated) return true;
+		}
+		return false;
+	};
+
+	bool res = matches_exactly(c);
+	if ((!res) && (!case_sensitive)) {
+		res = matches_exactly(std::towlower(static_cast<wint_t>(c))) || matches_exactly(std::towupper(static_cast<wint_t>(c)));
+	}
+	return res != is_negated;
+}
+
+/*
+	A recursive descent parser which converts the pattern to a tree of RegexNodes. Returns nullptr and sets
+	`error` when the pattern is invalid.
+*/
+class RegexParser {
+private:
+	const std::wstring& pattern;
+	std::vector<RegexCharClass>& classes;
+	size_t position = 0;
+
+	bool at_end() {
+		return position >= pattern.size();
+	}
+
+	wchar_t peek() {
+		return pattern[position];
+	}
+
+	std::unique_ptr<RegexNode> fail(const std::wstring& message) {
+		if (error.size() == 0) {
+			error = message;
+		}
+		return nullptr;
+	}
+
+	std::unique_ptr<RegexNode> parse_alternation() {
+		std::unique_ptr<RegexNode> first = parse_concat();
+		if ((first == nullptr) || at_end() || (peek() != L'|')) {
+			return first;
+		}
+
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Alternate);
+		node->children.push_back(std::move(first));
+		while ((!at_end()) && (peek() == L'|')) {
+			position++;
+			std::unique_ptr<RegexNode> next = parse_concat();
+			if (next == nullptr) return nullptr;
+			node->children.push_back(std::move(next));
+		}
+		return node;
+	}
+
+	std::unique_ptr<RegexNode> parse_concat() {
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Concat);
+		while ((!at_end()) && (peek() != L'|') && (peek() != L')')) {
+			std::unique_ptr<RegexNode> item = parse_repeat();
+			if (item == nullptr) return nullptr;
+			node->children.push_back(std::move(item));
+		}
+		return node;
+	}
+
+	bool parse_number(int& number) {
+		size_t begin = position;
+		number = 0;
+		while ((!at_end()) && (peek() >= L'0') && (peek() <= L'9')) {
+			number = std::min(number * 10 + (peek() - L'0'), MAX_REGEX_REPEAT + 1);
+			position++;
+		}
+		return position > begin;
+	}
+
+	// returns false without consuming anything if there is no quantifier at the current position
+	bool parse_quantifier(int& min_repeat, int& max_repeat) {
+		if (at_end()) return false;
+
+		wchar_t c = peek();
+		if (c == L'*' || c == L'+' || c == L'?') {
+			position++;
+			min_repeat = (c == L'+') ? 1 : 0;
+			max_repeat = (c == L'?') ? 1 : -1;
+			return true;
+		}
+
+		if (c == L'{') {
+			// a '{' which is not followed by a valid quantifier is a literal
+			size_t begin = position;
+			position++;
+			if (parse_number(min_repeat)) {
+				max_repeat = min_repeat;
+				if ((!at_end()) && (peek() == L',')) {
+					position++;
+					if (!parse_number(max_repeat)) {
+						max_repeat = -1;
+					}
+				}
+				if ((!at_end()) && (peek() == L'}')) {
+					position++;
+					return true;
+				}
+			}
+			position = begin;
+		}
+		return false;
+	}
+
+	std::unique_ptr<RegexNode> parse_repeat() {
+		std::unique_ptr<RegexNode> atom = parse_atom();
+		if (atom == nullptr) return nullptr;
+
+		int min_repeat = 0;
+		int max_repeat = 0;
+		if (!parse_quantifier(min_repeat, max_repeat)) {
+			return atom;
+		}
+
+		if ((min_repeat > MAX_REGEX_REPEAT) || (max_repeat > MAX_REGEX_REPEAT)) {
+			return fail(L"repetition count is too large");
+		}
+		if ((max_repeat != -1) && (max_repeat < min_repeat)) {
+			return fail(L"invalid repetition range");
+		}
+
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Repeat);
+		node->min_repeat = min_repeat;
+		node->max_repeat = max_repeat;
+		if ((!at_end()) && (peek() == L'?')) {
+			node->is_greedy = false;
+			position++;
+		}
+		node->children.push_back(std::move(atom));
+
+		int ignored_min, ignored_max;
+		if (parse_quantifier(ignored_min, ignored_max)) {
+			return fail(L"nothing to repeat");
+		}
+
+		// repeating an empty node doesn't change what it matches, but nested repeats of empty nodes
+		// would be emitted max_repeat^depth times
+		if (is_empty_node(node.get())) {
+			return make_node(RegexNodeType::Empty);
+		}
+		return node;
+	}
+
+	bool parse_hex(int num_digits, char32_t& value) {
+		value = 0;
+		for (int i = 0; i < num_digits; i++) {
+			if (at_end() || (!std::iswxdigit(static_cast<wint_t>(peek())))) {
+				return false;
+			}
+			wchar_t digit = std::towlower(static_cast<wint_t>(pattern[position++]));
+			value = value * 16 + ((digit <= L'9') ? (digit - L'0') : (digit - L'a' + 10));
+		}
+		return true;
+	}
+
+	// converts the escape sequence \c (c is already consumed) to the character it represents
+	bool parse_escaped_char(wchar_t c, char32_t& value) {
+		switch (c) {
+		case L'n': value = L'\n'; return true;
+		case L'r': value = L'\r'; return true;
+		case L't': value = L'\t'; return true;
+		case L'f': value = L'\f'; return true;
+		case L'v': value = L'\v'; return true;
+		case L'0': value = 0; return true;
+		case L'x':
+			if (!parse_hex(2, value)) {
+				fail(L"invalid \\x escape");
+				return false;
+			}
+			return true;
+		case L'u':
+			if (!parse_hex(4, value)) {
+				fail(L"invalid \\u escape");
+				return false;
+			}
+			return true;
+		}
+
+		if ((c >= L'1') && (c <= L'9')) {
+			fail(L"backreferences are not supported");
+			return false;
+		}
+		value = c;
+		return true;
+	}
+
+	std::unique_ptr<RegexNode> parse_predefined_class(wchar_t c) {
+		RegexCharClass char_class;
+		char_class.predefined_classes.push_back({ static_cast<wchar_t>(std::towlower(c)), std::iswupper(c) != 0 });
+		classes.push_back(char_class);
+
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Class);
+		node->class_index = static_cast<int>(classes.size() - 1);
+		return node;
+	}
+
+	std::unique_ptr<RegexNode> parse_escape() {
+		if (at_end()) {
+			return fail(L"trailing backslash");
+		}
+
+		wchar_t c = pattern[position++];
+		if (c == L'b') return make_node(RegexNodeType::WordBoundary);
+		if (c == L'B') return make_node(RegexNodeType::NotWordBoundary);
+		if (is_predefined_class(c)) return parse_predefined_class(c);
+
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Char);
+		if (!parse_escaped_char(c, node->c)) {
+			return nullptr;
+		}
+		return node;
+	}
+
+	// parses a single character of a character class, possibly escaped, returns false on error
+	bool parse_class_char(wchar_t c, char32_t& value) {
+		if (c != L'\\') {
+			value = c;
+			return true;
+		}
+		if (at_end()) {
+			fail(L"missing ]");
+			return false;
+		}
+		wchar_t escaped = pattern[position++];
+		if (escaped == L'b') {
+			value = L'\b';
+			return true;
+		}
+		return parse_escaped_char(escaped, value);
+	}
+
+	std::unique_ptr<RegexNode> parse_class() {
+		RegexCharClass char_class;
+		if ((!at_end()) && (peek() == L'^')) {
+			char_class.is_negated = true;
+			position++;
+		}
+
+		while (true) {
+			if (at_end()) {
+				return fail(L"missing ]");
+			}
+			wchar_t c = pattern[position++];
+			if (c == L']') {
+				break;
+			}
+
+			if ((c == L'\\') && (!at_end()) && is_predefined_class(peek())) {
+				wchar_t predefined_class = pattern[position++];
+				char_class.predefined_classes.push_back({ static_cast<wchar_t>(std::towlower(predefined_class)), std::iswupper(predefined_class) != 0 });
+				continue;
+			}
+
+			char32_t low;
+			if (!parse_class_char(c, low)) return nullptr;
+			char32_t high = low;
+
+			if ((position + 1 < pattern.size()) && (peek() == L'-') && (pattern[position + 1] != L']')) {
+				position++;
+				wchar_t high_char = pattern[position++];
+				if ((high_char == L'\\') && (!at_end()) && is_predefined_class(peek())) {
+					return fail(L"invalid range in character class");
+				}
+				if (!parse_class_char(high_char, high)) return nullptr;
+				if (high < low) {
+					return fail(L"invalid range in character class");
+				}
+			}
+			char_class.ranges.push_back({ low, high });
+		}
+
+		classes.push_back(char_class);
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Class);
+		node->class_index = static_cast<int>(classes.size() - 1);
+		return node;
+	}
+
+	std::unique_ptr<RegexNode> parse_atom() {
+		wchar_t c = pattern[position++];
+		switch (c) {
+		case L'.':
+			return make_node(RegexNodeType::Any);
+		case L'^':
+			return make_node(RegexNodeType::Begin);
+		case L'$':
+			return make_node(RegexNodeType::End);
+		case L'[':
+			return parse_class();
+		case L'\\':
+			return parse_escape();
+		case L'*':
+		case L'+':
+		case L'?':
+			return fail(L"nothing to repeat");
+		case L'(': {
+			if ((position + 1 < pattern.size()) && (pattern[position] == L'?') && (pattern[position + 1] == L':')) {
+				position += 2;
+			}
+			else if ((!at_end()) && (peek() == L'?')) {
+				return fail(L"lookaheads are not supported");
+			}
+			std::unique_ptr<RegexNode> inner = parse_alternation();
+			if (inner == nullptr) return nullptr;
+			if (at_end() || (peek() != L')')) {
+				return fail(L"missing )");
+			}
+			position++;
+			return inner;
+		}
+		}
+
+		std::unique_ptr<RegexNode> node = make_node(RegexNodeType::Char);
+		node->c = c;
+		return node;
+	}
+
+public:
+	std::wstring error;
+
+	RegexParser(const std::wstring& pattern, std::vector<RegexCharClass>& classes) : pattern(pattern), classes(classes) {}
+
+	std::unique_ptr<RegexNode> parse() {
+		std::unique_ptr<RegexNode> node = parse_alternation();
+		if ((node != nullptr) && (!at_end())) {
+			return fail(L"unmatched )");
+		}
+		return node;
+	}
+};
+
+int LinearRegex::emit_instruction(RegexOp op, int x, int y) {
+	RegexInstruction instruction;
+	instruction.op = op;
+	instruction.x = x;
+	instruction.y = y;
+	program.push_back(instruction);
+	return static_cast<int>(program.size() - 1);
+}
+
+bool LinearRegex::emit(const RegexNode* node) {
+	// nodes which don't emit instructions are counted too, so that compiling can't take much longer than running
+	// a program of the maximum size
+	if ((program.size() > MAX_REGEX_PROGRAM_SIZE) || (++num_emitted_nodes > MAX_REGEX_PROGRAM_SIZE)) {
+		return false;
+	}
+
+	switch (node->type) {
+	case RegexNodeType::Empty:
+		break;
+	case RegexNodeType::Char: {
+		// characters outside the basic plane are matched as two UTF-16 code units
+		std::vector<char16_t> units;
+		if (node->c > 0xFFFF) {
+			char32_t offset = node->c - 0x10000;
+			units.push_back(static_cast<char16_t>(0xD800 + (offset >> 10)));
+			units.push_back(static_cast<char16_t>(0xDC00 + (offset & 0x3FF)));
+		}
+		else {
+			units.push_back(static_cast<char16_t>(node->c));
+		}
+		for (char16_t unit : units) {
+			int index = emit_instruction(RegexOp::Char);
+			program[index].c = case_sensitive ? unit : fold_char(unit);
+		}
+		break;
+	}
+	case RegexNodeType::Any:
+		emit_instruction(RegexOp::Any);
+		break;
+	case RegexNodeType::Class:
+		emit_instruction(RegexOp::Class, node->class_index);
+		break;
+	case RegexNodeType::Begin:
+		emit_instruction(RegexOp::AssertBegin);
+		break;
+	case RegexNodeType::End:
+		emit_instruction(RegexOp::AssertEnd);
+		break;
+	case RegexNodeType::WordBoundary:
+		emit_instruction(RegexOp::AssertWordBoundary);
+		break;
+	case RegexNodeType::NotWordBoundary:
+		emit_instruction(RegexOp::AssertNotWordBoundary);
+		break;
+	case RegexNodeType::Concat:
+		for (const auto& child : node->children) {
+			if (!emit(child.get())) return false;
+		}
+		break;
+	case RegexNodeType::Alternate: {
+		// split L1, L2; L1: first; jump end; L2: split L3, L4; L3: second; jump end; L4: ... end:
+		std::vector<int> jumps;
+		for (size_t i = 0; i < node->children.size(); i++) {
+			if (i + 1 < node->children.size()) {
+				int split = emit_instruction(RegexOp::Split);
+				program[split].x = static_cast<int>(program.size());
+				if (!emit(node->children[i].get())) return false;
+				jumps.push_back(emit_instruction(RegexOp::Jump));
+				program[split].y = static_cast<int>(program.size());
+			}
+			else {
+				if (!emit(node->children[i].get())) return false;
+			}
+		}
+		for (int jump : jumps) {
+			program[jump].x = static_cast<int>(program.size());
+		}
+		break;
+	}
+	case RegexNodeType::Repeat: {
+		const RegexNode* child = node->children[0].get();
+		for (int i = 0; i < node->min_repeat; i++) {
+			if (!emit(child)) return false;
+		}
+
+		if (node->max_repeat == -1) {
+			// loop: split body, exit; body: child; jump loop; exit:
+			int split = emit_instruction(RegexOp::Split);
+			int body = static_cast<int>(program.size());
+			if (!emit(child)) return false;
+			emit_instruction(RegexOp::Jump, split);
+			int exit = static_cast<int>(program.size());
+			program[split].x = node->is_greedy ? body : exit;
+			program[split].y = node->is_greedy ? exit : body;
+		}
+		else {
+			// each optional repetition is preceded by a split which can skip the rest of the repetitions
+			std::vector<std::pair<int, int>> splits;
+			for (int i = node->min_repeat; i < node->max_repeat; i++) {
+				int split = emit_instruction(RegexOp::Split);
+				splits.push_back({ split, static_cast<int>(program.size()) });
+				if (!emit(child)) return false;
+			}
+			int exit = static_cast<int>(program.size());
+			for (const auto& [split, body] : splits) {
+				program[split].x = node->is_greedy ? body : exit;
+				program[split].y = node->is_greedy ? exit : body;
+			}
+		}
+		break;
+	}
+	}
+	return program.size() <= MAX_REGEX_PROGRAM_SIZE;
+}
+
+bool LinearRegex::compile(const std::wstring& pattern, bool case_sensitive_, std::wstring* error) {
+	program.clear();
+	classes.clear();
+	case_sensitive = case_sensitive_;
+	num_emitted_nodes = 0;
+
+	RegexParser parser(pattern, classes);
+	std::unique_ptr<RegexNode> root = parser.parse();
+	if (root == nullptr) {
+		if (error) *error = parser.error;
+		return false;
+	}
+
+	if (!emit(root.get())) {
+		program.clear();
+		if (error) *error = L"pattern is too large";
+		return false;
+	}
+	emit_instruction(RegexOp::Match);
+	return true;
+}
+
+bool LinearRegex::matches_char(const RegexInstruction& instruction, char16_t c, char16_t folded_c) const {
+	switch (instruction.op) {
+	case RegexOp::Char:
+		return (case_sensitive ? c : folded_c) == instruction.c;
+	case RegexOp::Any:
+		return !is_line_terminator(c);
+	case RegexOp::Class:
+		return classes[instruction.x].matches(c, case_sensitive);
+	default:
+		return false;
+	}
+}
+
+struct RegexThread {
+	int pc;
+	int start;
+};
+
+bool LinearRegex::find_all(const char16_t* text, size_t text_size, std::vector<std::pair<int, int>>& matches,
+	const std::function<bool(size_t)>& should_stop, size_t begin_position, size_t end_position) const {
+	if (program.size() == 0) {
+		return true;
+	}
+
+	std::vector<RegexThread> current_threads;
+	std::vector<RegexThread> next_threads;
+	// the generation in which each instruction was last added to a thread list, so each instruction is added at most once
+	std::vector<size_t> instruction_generations(program.size(), 0);
+	size_t generation = 0;
+	std::vector<int> stack;
+
+	auto is_word_boundary = [&](size_t position) {
+		bool is_previous_word = (position > 0) && is_word_char(text[position - 1]);
+		bool is_next_word = (position < text_size) && is_word_char(text[position]);
+		return is_previous_word != is_next_word;
+	};
+
+	// follows the instructions which don't consume characters and adds the reached instructions to `threads` in priority order
+	auto add_thread = [&](std::vector<RegexThread>& threads, int first_pc, int start, size_t position) {
+		stack.push_back(first_pc);
+		while (stack.size() > 0) {
+			int pc = stack.back();
+			stack.pop_back();
+			if (instruction_generations[pc] == generation) continue;
+			instruction_generations[pc] = generation;
+
+			const RegexInstruction& instruction = program[pc];
+			switch (instruction.op) {
+			case RegexOp::Jump:
+				stack.push_back(instruction.x);
+				break;
+			case RegexOp::Split:
+				// the preferred branch is pushed last so it is explored first
+				stack.push_back(instruction.y);
+				stack.push_back(instruction.x);
+				break;
+			case RegexOp::AssertBegin:
+				if (position == 0) stack.push_back(pc + 1);
+				break;
+			case RegexOp::AssertEnd:
+				if (position == text_size) stack.push_back(pc + 1);
+				break;
+			case RegexOp::AssertWordBoundary:
+				if (is_word_boundary(position)) stack.push_back(pc + 1);
+				break;
+			case RegexOp::AssertNotWordBoundary:
+				if (!is_word_boundary(position)) stack.push_back(pc + 1);
+				break;
+			default:
+				threads.push_back(RegexThread{ pc, start });
+			}
+		}
+	};
+
+	// when the pattern starts with a literal character, we can skip the positions which don't contain it
+	bool has_first_char = program[0].op == RegexOp::Char;
+	auto find_first_char = [&](size_t position) {
+		while (position < text_size) {
+			char16_t c = case_sensitive ? text[position] : fold_char(text[position]);
+			if (c == program[0].c) break;
+			position++;
+		}
+		return position;
+	};
+
+	size_t num_steps = 0;
+	size_t search_start = begin_position;
+	// after an empty match we search again at the same position, but only for a non-empty match which begins there
+	size_t not_null_position = SIZE_MAX;
+	end_position = std::min(end_position, text_size + 1);
+
+	while (search_start < end_position) {
+		bool has_match = false;
+		int match_begin = 0;
+		int match_end = 0;
+
+		size_t position = has_first_char ? find_first_char(search_start) : search_start;
+		current_threads.clear();
+		generation++;
+		if (position < end_position) {
+			add_thread(current_threads, 0, static_cast<int>(position), position);
+		}
+
+		while (true) {
+			if (should_stop && ((++num_steps % REGEX_STOP_CHECK_INTERVAL) == 0) && should_stop(position)) {
+				return false;
+			}
+
+			next_threads.clear();
+			generation++;
+
+			char16_t c = (position < text_size) ? text[position] : 0;
+			char16_t folded_c = case_sensitive ? c : fold_char(c);
+
+			for (const RegexThread& thread : current_threads) {
+				const RegexInstruction& instruction = program[thread.pc];
+				if (instruction.op == RegexOp::Match) {
+					if ((static_cast<size_t>(thread.start) == not_null_position) && (position == not_null_position)) {
+						continue;
+					}
+					// the threads after this one have lower priority, so they are discarded
+					has_match = true;
+					match_begin = thread.start;
+					match_end = static_cast<int>(position);
+					break;
+				}
+				if ((position < text_size) && matches_char(instruction, c, folded_c)) {
+					add_thread(next_threads, thread.pc + 1, thread.start, position + 1);
+				}
+			}
+
+			if (position >= text_size) {
+				break;
+			}
+			position++;
+
+			// start a new match attempt at the next position with the lowest priority
+			if (!has_match) {
+				if (has_first_char && (next_threads.size() == 0)) {
+					position = find_first_char(position);
+				}
+				if (position < end_position) {
+					add_thread(next_threads, 0, static_cast<int>(position), position);
+				}
+			}
+
+			std::swap(current_threads, next_threads);
+			// when there is no match, we keep going even with no threads (e.g. an assertion failed at this position)
+			if ((current_threads.size() == 0) && (has_match || (position >= end_position))) {
+				break;
+			}
+		}
+
+		if (!has_match) {
+			break;
+		}
+
+		matches.push_back({ match_begin, match_end });
+		search_start = match_end;
+		not_null_position = (match_end > match_begin) ? SIZE_MAX : match_end;
+	}
+	return true;
+}
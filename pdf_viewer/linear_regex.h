@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <cstdint>
+
+struct RegexNode;
+
+struct RegexCharClass {
+	// inclusive ranges of characters
+	std::vector<std::pair<char32_t, char32_t>> ranges;
+	// predefined classes (d, w or s) and whether they are negated (\D, \W and \S)
+	std::vector<std::pair<wchar_t, bool>> predefined_classes;
+	bool is_negated = false;
+
+	bool matches(char32_t c, bool case_sensitive) const;
+};
+
+enum class RegexOp {
+	Char,
+	Any,
+	Class,
+	Split,
+	Jump,
+	Match,
+	AssertBegin,
+	AssertEnd,
+	AssertWordBoundary,
+	AssertNotWordBoundary
+};
+
+struct RegexInstruction {
+	RegexOp op;
+	// the character matched by Char instructions
+	char16_t c = 0;
+	// the class index of Class instructions, the target of Jump instructions and the preferred target of Split instructions
+	int x = 0;
+	// the other target of Split instructions
+	int y = 0;
+};
+
+/*
+	A regular expression engine whose running time is linear in the size of the searched text (O(text size * pattern size)),
+	unlike std::wregex which backtracks and can take exponential time (or overflow the stack) on large inputs.
+	Patterns are compiled to a program which is run by a Pike VM, i.e. a simulation of the NFA of the pattern which keeps
+	the threads in priority order, so the matches are the same as the ones a backtracking engine would find.
+
+	Supports the ECMAScript syntax of std::wregex except backreferences and lookaheads: literals, `.`, character
+	classes ([a-z], [^a-z], \d, \w, \s, \D, \W, \S), groups ((...) and (?:...)), alternation, greedy and lazy
+	quantifiers (*, +, ?, {n}, {n,}, {n,m}) and assertions (^, $, \b, \B).
+	The text is matched as UTF-16 code units.
+*/
+class LinearRegex {
+private:
+	std::vector<RegexInstruction> program;
+	std::vector<RegexCharClass> classes;
+	bool case_sensitive = true;
+	// number of calls to emit while compiling, which is limited like the size of the program
+	size_t num_emitted_nodes = 0;
+
+	bool emit(const RegexNode* node);
+	int emit_instruction(RegexOp op, int x = 0, int y = 0);
+	bool matches_char(const RegexInstruction& instruction, char16_t c, char16_t folded_c) const;
+
+public:
+	// returns false if the pattern is invalid or uses unsupported features, in which case `error` describes the problem
+	bool compile(const std::wstring& pattern, bool case_sensitive, std::wstring* error = nullptr);
+
+	/*
+		Appends the [begin, end) positions of the leftmost non-overlapping matches in `text` which begin in
+		[begin_position, end_position) to `matches` (matches may extend beyond end_position). Like ECMAScript, after an
+		empty match the next match may be a non-empty match at the same position.
+		`should_stop` is called periodically during the search with the current position in the text, when it returns
+		true the search is stopped (keeping the matches found so far) and false is returned.
+	*/
+	bool find_all(const char16_t* text, size_t text_size, std::vector<std::pair<int, int>>& matches,
+		const std::function<bool(size_t)>& should_stop = nullptr, size_t begin_position = 0, size_t end_position = SIZE_MAX) const;
+};
@@ -62,6 +62,9 @@
 #include "utils.h"
 #include "ui.h"
 #include "pdf_renderer.h"
+#include "page_image_cache.h"
+#include "library_index.h"
+#include "document_handle_pool.h"
 #include "document.h"
 #include "document_view.h"
 #include "pdf_view_opengl_widget.h"
@@ -147,6 +150,27 @@ float VERTICAL_MOVE_AMOUNT = 1.0f;
 float HORIZONTAL_MOVE_AMOUNT = 1.0f;
 float MOVE_SCREEN_PERCENTAGE = 0.8f;
 const unsigned int CACHE_INVALID_MILIES = 1000;
+const int MAX_PREFETCHED_PAGES = 8;
+const float PREFETCH_LOOKAHEAD_SECONDS = 0.5f;
+const int RENDER_TILE_SIZE = 512;
+const int TILED_RENDER_MIN_PAGE_PIXELS = 2048;
+const float PREVIEW_RENDER_SCALE = 0.25f;
+const int NUM_TEXTURE_UPLOAD_BUFFERS = 3;
+const int DOCUMENT_INDEXING_SHARD_PAGES = 8;
+// super fast search reports the results after searching each chunk of this many characters
+const int SUPER_FAST_SEARCH_CHUNK_SIZE = 256 * 1024;
+// the page dimension loading threads update the layout after loading the dimensions of this many pages
+const int PAGE_DIMENSIONS_BATCH_SIZE = 32;
+// opened documents which are not used by any thread are kept in the pool so other threads can reuse them
+const int MAX_IDLE_POOLED_DOCUMENTS = 8;
+// the most recently used stext pages are kept even if they exceed the budget, since they may be in use
+const int MIN_CACHED_STEXT_PAGES = 4;
+// the text of this many pages before and after the visible pages is extracted in the background
+const int STEXT_PREFETCH_PAGES = 2;
+// actions which need the text of more than this many unextracted pages extract them in the main thread
+const int MAX_ASYNC_STEXT_PAGES = 8;
+// the lines, words and links of this many recently used pages are kept even if they exceed the budget
+const int MIN_CACHED_PAGE_DATA_PAGES = 4;
 const int PERSIST_MILIES = 1000 * 60;
 const int PAGE_PADDINGS = 0;
 const int MAX_PENDING_REQUESTS = 31;
@@ -215,6 +239,21 @@ float HYPERDRIVE_SPEED_FACTOR = 10.0f;
 float SMOOTH_SCROLL_SPEED = 3.0f;
 float SMOOTH_SCROLL_DRAG = 3000.0f;
 int PRERENDERED_PAGE_COUNT = 0;
+int RENDER_CACHE_MEGABYTES = 256;
+int DISPLAY_LIST_CACHE_PAGES = 64;
+int PAGE_IMAGE_CACHE_MEGABYTES = 128;
+int STEXT_CACHE_MEGABYTES = 32;
+int PAGE_DATA_CACHE_MEGABYTES = 16;
+int TEXTURE_UPLOAD_MEGABYTES_PER_FRAME = 8;
+int INDEXING_THREADS = 0;
+int SEARCH_THREADS = 0;
+int PAGE_DIMENSION_THREADS = 0;
+bool CACHE_DOCUMENT_INDICES = true;
+int DOCUMENT_INDEX_CACHE_MEGABYTES = 256;
+int REGEX_SEARCH_TIMEOUT_MILLISECONDS = 2000;
+bool INCREMENTAL_SEARCH = true;
+bool LIBRARY_SEARCH = true;
+const int LIBRARY_SEARCH_MAX_RESULTS = 1000;
 
 float PAGE_SEPARATOR_WIDTH = 0.0f;
 float PAGE_SEPARATOR_COLOR[3] = {0.9f, 0.9f, 0.9f};
@@ -251,6 +290,9 @@ Path tutorial_path(L"");
 Path last_opened_file_address_path(L"");
 Path shader_path(L"");
 Path auto_config_path(L"");
+Path page_image_cache_path(L"");
+Path document_index_cache_path(L"");
+Path library_index_file_path(L"");
 
 std::wstring SHIFT_CLICK_COMMAND = L"overview_under_cursor";
 std::wstring CONTROL_CLICK_COMMAND = L"smart_jump_under_cursor";
@@ -413,6 +455,9 @@ void configure_paths(){
 
 #endif
 	auto_config_path = standard_data_path.slash(L"auto.config");
+	page_image_cache_path = standard_data_path.slash(L"page_images");
+	document_index_cache_path = standard_data_path.slash(L"document_indices");
+	library_index_file_path = standard_data_path.slash(L"library_index.db");
 	// user_config_paths.insert(user_config_paths.begin(), auto_config_path);
 }
 
@@ -789,7 +834,13 @@ int main(int argc, char* args[]) {
 
 	CachedChecksummer checksummer(&prev_path_hash_pairs);
 
-	DocumentManager document_manager(mupdf_context, &db_manager, &checksummer);
+	page_image_cache_path.create_directories();
+	document_index_cache_path.create_directories();
+	PageImageCache page_image_cache(page_image_cache_path, &checksummer);
+	LibraryIndex library_index(library_index_file_path);
+	DocumentHandlePool document_handle_pool(mupdf_context);
+
+	DocumentManager document_manager(mupdf_context, &db_manager, &checksummer, &page_image_cache, &library_index, &document_handle_pool);
 
 	QFileSystemWatcher pref_file_watcher;
 	add_paths_to_file_system_watcher(pref_file_watcher, default_config_path, user_config_paths);
@@ -8,6 +8,7 @@
 #include <optional>
 #include <memory>
 #include <cctype>
+#include <algorithm>
 
 
 #include <qscrollarea.h>
@@ -119,6 +120,8 @@ extern bool SUPER_FAST_SEARCH;
 extern bool SHOW_CLOSEST_BOOKMARK_IN_STATUSBAR;
 extern bool SHOW_CLOSE_PORTAL_IN_STATUSBAR;
 extern bool CASE_SENSITIVE_SEARCH;
+extern bool INCREMENTAL_SEARCH;
+extern bool LIBRARY_SEARCH;
 extern bool SHOW_DOCUMENT_NAME_IN_STATUSBAR;
 extern std::wstring UI_FONT_FACE_NAME;
 extern bool SHOULD_HIGHLIGHT_LINKS;
@@ -294,11 +297,7 @@ void MainWidget::mouseMoveEvent(QMouseEvent* mouse_event) {
             //fz_point selection_begin = { last_mouse_down.x(), last_mouse_down.y()};
             //fz_point selection_end = { document_x, document_y };
 
-            main_document_view->get_text_selection(selection_begin,
-                selection_end,
-                is_word_selecting,
-                main_document_view->selected_character_rects,
-                selected_text);
+            update_text_selection(selection_begin, selection_end, is_word_selecting);
 
             validate_render();
             last_text_select_time = QTime::currentTime();
@@ -355,13 +354,13 @@ MainWidget::MainWidget(fz_context* mupdf_context,
     inverse_search_command = INVERSE_SEARCH_COMMAND;
     if (DISPLAY_RESOLUTION_SCALE <= 0){
 #ifdef SIOYEK_QT6
-        pdf_renderer = new PdfRenderer(4, should_quit_ptr, mupdf_context, QGuiApplication::primaryScreen()->devicePixelRatio());
+        pdf_renderer = new PdfRenderer(4, should_quit_ptr, mupdf_context, QGuiApplication::primaryScreen()->devicePixelRatio(), document_manager->get_document_handle_pool(), document_manager->get_page_image_cache());
 #else
-        pdf_renderer = new PdfRenderer(4, should_quit_ptr, mupdf_context, QApplication::desktop()->devicePixelRatioF());
+        pdf_renderer = new PdfRenderer(4, should_quit_ptr, mupdf_context, QApplication::desktop()->devicePixelRatioF(), document_manager->get_document_handle_pool(), document_manager->get_page_image_cache());
 #endif
     }
     else {
-        pdf_renderer = new PdfRenderer(4, should_quit_ptr, mupdf_context, DISPLAY_RESOLUTION_SCALE);
+        pdf_renderer = new PdfRenderer(4, should_quit_ptr, mupdf_context, DISPLAY_RESOLUTION_SCALE, document_manager->get_document_handle_pool(), document_manager->get_page_image_cache());
 
     }
     pdf_renderer->start_threads();
@@ -414,6 +413,10 @@ MainWidget::MainWidget(fz_context* mupdf_context,
     text_command_line_edit_container->setLayout(text_command_line_edit_container_layout);
     text_command_line_edit_container->hide();
 
+    QObject::connect(text_command_line_edit, &QLineEdit::textChanged, [&](const QString& text) {
+        handle_search_text_changed(text.toStdWString());
+    });
+
     on_command_done = [&](std::string command_name) {
         bool is_numeric = false;
         int page_number = QString::fromStdString(command_name).toInt(&is_numeric);
@@ -794,6 +797,9 @@ void MainWidget::validate_render() {
     if (!isVisible()) {
         return;
     }
+    if (main_document_view) {
+        main_document_view->update_offset_for_page_dimension_changes();
+    }
     if (last_smart_fit_page) {
         int current_page = get_current_page_number();
         if (current_page != last_smart_fit_page) {
@@ -1436,11 +1442,7 @@ void MainWidget::handle_left_click(WindowPos click_pos, bool down, bool is_shift
             //fz_point selection_begin = { last_mouse_down_x, last_mouse_down_y };
             //fz_point selection_end = { x_, y_ };
 
-            main_document_view->get_text_selection(last_mouse_down,
-                abs_doc_pos,
-                is_word_selecting,
-                main_document_view->selected_character_rects,
-                selected_text);
+            update_text_selection(last_mouse_down, abs_doc_pos, is_word_selecting);
             is_word_selecting = false;
         }
         else {
@@ -1947,6 +1949,9 @@ void MainWidget::smart_jump_under_pos(WindowPos pos){
     // if overview page is open and we middle click on a paper name, search it in a search engine
     if (opengl_widget->is_window_point_in_overview({ normal_x, normal_y })) {
         auto [doc_page, doc_x, doc_y] = opengl_widget->window_pos_to_overview_pos({ normal_x, normal_y });
+        if (!is_page_text_ready(doc_page, [this, pos]() { smart_jump_under_pos(pos); })) {
+            return;
+        }
         std::optional<std::wstring> paper_name = main_document_view->get_document()->get_paper_name_at_position(doc_page, doc_x, doc_y);
         if (paper_name) {
             handle_paper_name_on_pointer(paper_name.value(), is_shift_pressed);
@@ -1956,6 +1961,15 @@ void MainWidget::smart_jump_under_pos(WindowPos pos){
 
     auto [page, offset_x, offset_y] = main_document_view->window_to_document_pos(pos);
 
+    // if the text of the page is not extracted yet we jump when it is, the document may be scrolled by then so we
+    // convert the document position back to window position
+    DocumentPos document_pos = { page, offset_x, offset_y };
+    if (!is_page_text_ready(page, [this, document_pos]() {
+        smart_jump_under_pos(main_document_view->document_to_window_pos_in_pixels(document_pos));
+        })) {
+        return;
+    }
+
     fz_stext_page* stext_page = main_document_view->get_document()->get_stext_with_page_number(page);
     std::vector<fz_stext_char*> flat_chars;
     get_flat_chars_from_stext_page(stext_page, flat_chars);
@@ -2062,6 +2076,19 @@ bool MainWidget::overview_under_pos(WindowPos pos){
         }
     }
 
+    if (!main_document_view_has_document()) {
+        return false;
+    }
+
+    DocumentPos document_pos = main_document_view->window_to_document_pos(pos);
+    if (!is_page_text_ready(document_pos.page, [this, document_pos]() {
+        overview_under_pos(main_document_view->document_to_window_pos_in_pixels(document_pos));
+        })) {
+        // the overview is opened when the text of the page is extracted (if there is a reference under the pointer),
+        // until then the callers should act as if there was nothing to open (e.g. right click places the ruler)
+        return false;
+    }
+
     int autoreference_page;
     float autoreference_offset;
     if (find_location_of_text_under_pointer(pos, &autoreference_page, &autoreference_offset, true)) {
@@ -3418,6 +3445,46 @@ float CharacterAddress::focus_offset() {
 void MainWidget::clear_selected_text() {
 	main_document_view->selected_character_rects.clear();
 	selected_text.clear();
+	pending_text_selection = {};
+}
+
+void MainWidget::update_text_selection(AbsoluteDocumentPos begin, AbsoluteDocumentPos end, bool is_word_selection) {
+	if (!main_document_view_has_document()) {
+		return;
+	}
+
+	// extracting the text of a page can take a while, so if the text of the selected pages is not extracted yet
+	// we keep the current selection and update it to the latest pending selection when the text is ready
+	Document* document = doc();
+	bool is_ready = main_document_view->get_text_selection(begin, end, is_word_selection,
+		main_document_view->selected_character_rects, selected_text, this, [this, document]() {
+			if (pending_text_selection && main_document_view_has_document() && (doc() == document)) {
+				auto [pending_begin, pending_end, pending_is_word_selection] = pending_text_selection.value();
+				update_text_selection(pending_begin, pending_end, pending_is_word_selection);
+				validate_render();
+			}
+		});
+
+	if (is_ready) {
+		pending_text_selection = {};
+	}
+	else {
+		pending_text_selection = std::make_tuple(begin, end, is_word_selection);
+	}
+}
+
+bool MainWidget::is_page_text_ready(int page, std::function<void()> on_ready) {
+	if (page < 0) {
+		return true;
+	}
+
+	Document* document = doc();
+	// the callback is dropped if this window is closed before the page is extracted, the document may outlive it
+	return document->request_stext_pages({ page }, this, [this, document, on_ready]() {
+		if (main_document_view_has_document() && (doc() == document)) {
+			on_ready();
+		}
+		});
 }
 
 bool MainWidget::is_rect_visible(int page, fz_rect rect) {
@@ -3500,6 +3567,10 @@ void MainWidget::perform_search(std::wstring text, bool is_regex) {
 
    // When searching, the start position before search is saved in a mark named '0'
    main_document_view->add_mark('/');
+   update_search_results(text, is_regex);
+}
+
+void MainWidget::update_search_results(std::wstring text, bool is_regex) {
 
    int range_begin, range_end;
    std::wstring search_term;
@@ -3522,6 +3593,46 @@ void MainWidget::perform_search(std::wstring text, bool is_regex) {
    opengl_widget->search_text(search_term, CASE_SENSITIVE_SEARCH, is_regex, search_range);
 }
 
+void MainWidget::handle_search_text_changed(std::wstring text) {
+    // search as the user types, this is only done when the super fast index is ready since otherwise each
+    // keystroke would start a (slow) mupdf search
+    if ((!INCREMENTAL_SEARCH) || (!pending_command_instance) || (!doc()) || (!doc()->is_super_fast_index_ready())) {
+        return;
+    }
+
+    std::string command_name = pending_command_instance->get_name();
+    if ((command_name == "search") || (command_name == "chapter_search")) {
+        update_search_results(text, false);
+    }
+    else if (command_name == "regex_search") {
+        update_search_results(text, true);
+    }
+    else if (command_name == "search_words") {
+        update_word_search_results(text);
+    }
+}
+
+void MainWidget::perform_word_search(std::wstring text) {
+    if (!doc()->is_super_fast_index_ready()) {
+        show_error_message(L"word search only works when super_fast_search is enabled in prefs_user.config and the document is indexed");
+        return;
+    }
+
+    main_document_view->add_mark('/');
+    update_word_search_results(text);
+}
+
+void MainWidget::update_word_search_results(std::wstring text) {
+    int range_begin, range_end;
+    std::wstring search_term;
+    std::optional<std::pair<int, int>> search_range = {};
+    if (parse_search_command(text, &range_begin, &range_end, &search_term)) {
+        search_range = std::make_pair(range_begin, range_end);
+    }
+
+    opengl_widget->search_words(search_term, search_range);
+}
+
 void MainWidget::overview_to_definition() {
 	if (!opengl_widget->get_overview_page()) {
 		std::vector<DocumentPos> defpos = main_document_view->find_line_definitions();
@@ -3676,6 +3787,52 @@ void MainWidget::handle_goto_bookmark_global() {
 	current_widget->show();
 }
 
+void MainWidget::handle_search_library(std::wstring text) {
+	LibraryIndex* library_index = document_manager->get_library_index();
+	if ((!LIBRARY_SEARCH) || (!library_index->is_open())) {
+		show_error_message(L"library search is not available, make sure library_search is enabled in prefs_user.config");
+		return;
+	}
+
+	std::vector<LibrarySearchResult> results;
+	library_index->search(text, LIBRARY_SEARCH_MAX_RESULTS, results);
+
+	std::vector<std::wstring> snippets;
+	std::vector<std::wstring> locations;
+	std::vector<std::pair<std::wstring, int>> path_pages;
+
+	for (const auto& result : results) {
+		std::optional<std::wstring> path = checksummer->get_path(result.checksum);
+		if (path) {
+			std::wstring file_name = Path(path.value()).filename().value_or(L"");
+			std::wstring snippet = result.snippet;
+			std::replace(snippet.begin(), snippet.end(), L'\n', L' ');
+			snippets.push_back(ITEM_LIST_PREFIX + L" " + snippet);
+			locations.push_back(truncate_string(file_name, 50) + L" (" + std::to_wstring(result.page + 1) + L")");
+			path_pages.push_back(std::make_pair(path.value(), result.page));
+		}
+	}
+
+	if (path_pages.size() == 0) {
+		show_error_message(L"no results found in the library");
+		return;
+	}
+
+	set_current_widget(new FilteredSelectTableWindowClass<std::pair<std::wstring, int>>(
+		snippets,
+		locations,
+		path_pages,
+		-1,
+		[&](std::pair<std::wstring, int>* path_page) {
+			if (path_page) {
+				validate_render();
+				open_document_at_location(path_page->first, path_page->second, {}, 0.0f, {});
+			}
+		},
+		this));
+	current_widget->show();
+}
+
 void MainWidget::handle_add_highlight(char symbol) {
 	if (main_document_view->selected_character_rects.size() > 0) {
 		main_document_view->add_highlight(selection_begin, selection_end, symbol);
@@ -4137,3 +4294,61 @@ int MainWidget::num_visible_links() {
     main_document_view->get_visible_links(visible_page_links);
     return visible_page_links.size();
 }
+
+void MainWidget::show_cache_statistics() {
+    RenderCacheStatistics stats = pdf_renderer->get_cache_statistics();
+    long long num_lookups = stats.num_hits + stats.num_misses;
+    int hit_percent = num_lookups > 0 ? static_cast<int>(100 * stats.num_hits / num_lookups) : 0;
+
+    std::wstringstream ss;
+    ss << L"render cache: " << stats.num_entries << L" pages, "
+        << stats.num_bytes / (1024 * 1024) << L" / " << stats.budget_bytes / (1024 * 1024) << L" MB, "
+        << hit_percent << L"% hits (" << stats.num_hits << L"/" << num_lookups << L"), "
+        << stats.num_evictions << L" evictions, "
+        << stats.num_cancelled_requests << L" cancelled renders, "
+        << stats.num_ready_on_first_display << L"/" << (stats.num_ready_on_first_display + stats.num_not_ready_on_first_display)
+        << L" pages ready when displayed (" << stats.num_prefetched_pages_displayed << L" prefetched), "
+        << L"display lists: " << stats.num_display_lists << L" pages, "
+        << stats.num_display_list_hits << L"/" << (stats.num_display_list_hits + stats.num_display_list_misses) << L" reused";
+
+    if (main_document_view_has_document()) {
+        PageDataCacheStatistics page_data_stats = doc()->get_page_data_cache_statistics();
+        ss << L", page data: " << page_data_stats.num_entries << L" pages, "
+            << page_data_stats.num_bytes / 1024 << L" / " << page_data_stats.budget_bytes / 1024 << L" KB, "
+            << page_data_stats.num_hits << L"/" << (page_data_stats.num_hits + page_data_stats.num_misses) << L" hits, "
+            << page_data_stats.num_evictions << L" evictions";
+    }
+    set_status_message(ss.str());
+}
+
+void MainWidget::benchmark_indexing() {
+    Document* document = doc();
+    bool is_started = document->run_benchmark([document]() { return document->benchmark_indexing(); }, this, [this](const std::wstring& report) {
+        std::wcout << report << L"\n";
+        set_status_message(report);
+        validate_render();
+        });
+
+    if (is_started) {
+        set_status_message(L"benchmarking indexing ...");
+    }
+    else {
+        show_error_message(L"another benchmark is still running");
+    }
+}
+
+void MainWidget::benchmark_search_index() {
+    Document* document = doc();
+    bool is_started = document->run_benchmark([document]() { return document->benchmark_search_index(); }, this, [this](const std::wstring& report) {
+        std::wcout << report << L"\n";
+        set_status_message(report);
+        validate_render();
+        });
+
+    if (is_started) {
+        set_status_message(L"benchmarking search index ...");
+    }
+    else {
+        show_error_message(L"another benchmark is still running");
+    }
+}
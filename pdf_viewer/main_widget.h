@@ -7,6 +7,8 @@
 #include <memory>
 #include <vector>
 #include <optional>
+#include <tuple>
+#include <functional>
 
 #include <qwidget.h>
 #include <qlineedit.h>
@@ -90,6 +92,8 @@ public:
 	// is the user in word select mode? (happens when we double left click and move the cursor)
 	bool is_word_selecting = false;
 	std::wstring selected_text;
+	// the (begin, end, is_word_selection) of the text selection which is applied when the text of its pages is extracted
+	std::optional<std::tuple<AbsoluteDocumentPos, AbsoluteDocumentPos, bool>> pending_text_selection = {};
 
 	bool is_select_highlight_mode = false;
 	char select_highlight_type = 'a';
@@ -262,7 +266,13 @@ public:
 	void toggle_visual_scroll_mode();
 	void set_overview_link(PdfLink link);
 	void set_overview_position(int page, float offset);
+	// the callers should make sure that the text of the page under `pos` is extracted (see is_page_text_ready)
 	bool find_location_of_text_under_pointer(WindowPos pos, int* out_page, float* out_offset, bool update_candidates=false);
+	// returns true if the text of `page` of the current document is extracted, otherwise extracts it in the background
+	// and calls `on_ready` when it is done (if the document is still open)
+	bool is_page_text_ready(int page, std::function<void()> on_ready);
+	// selects the text between `begin` and `end`, or does so when the text of their pages is extracted
+	void update_text_selection(AbsoluteDocumentPos begin, AbsoluteDocumentPos end, bool is_word_selection);
 	std::optional<std::wstring> get_current_file_name();
 	CommandManager* get_command_manager();
 
@@ -304,6 +314,10 @@ public:
 	void goto_mark(char symbol);
 	void advance_command(std::unique_ptr<Command> command);
 	void perform_search(std::wstring text, bool is_regex=false);
+	void update_search_results(std::wstring text, bool is_regex);
+	void handle_search_text_changed(std::wstring text);
+	void perform_word_search(std::wstring text);
+	void update_word_search_results(std::wstring text);
 	void overview_to_definition();
 	void portal_to_definition();
 	void move_visual_mark_command(int amount);
@@ -312,6 +326,7 @@ public:
 	void handle_horizontal_move(int amount);
 	void handle_goto_bookmark();
 	void handle_goto_bookmark_global();
+	void handle_search_library(std::wstring text);
 	void handle_add_highlight(char symbol);
 	void handle_goto_highlight();
 	void handle_goto_highlight_global();
@@ -336,6 +351,9 @@ public:
 	std::optional<std::pair<int, fz_link*>> get_selected_link(const std::wstring& text);
 
 	int num_visible_links();
+	void show_cache_statistics();
+	void benchmark_indexing();
+	void benchmark_search_index();
 
 	protected:
 	void focusInEvent(QFocusEvent* ev);
@@ -0,0 +1,95 @@
+#include "page_data_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+PageDataCache::PageDataCache(fz_context* context) : context(context) {
+}
+
+PageDataCache::~PageDataCache() {
+	clear();
+}
+
+PageDataCache::Entry& PageDataCache::get_entry(int page) {
+	auto entry = page_entries.find(page);
+	if (entry != page_entries.end()) {
+		lru_entries.splice(lru_entries.begin(), lru_entries, entry->second);
+		return *entry->second;
+	}
+
+	Entry new_entry;
+	new_entry.page = page;
+	lru_entries.push_front(new_entry);
+	page_entries[page] = lru_entries.begin();
+	return lru_entries.front();
+}
+
+void PageDataCache::update(Entry& entry) {
+	num_bytes -= entry.num_bytes;
+	entry.num_bytes = get_page_data_memory_bytes(entry.data);
+	num_bytes += entry.num_bytes;
+
+	size_t budget_bytes = static_cast<size_t>(std::max(PAGE_DATA_CACHE_MEGABYTES, 0)) * 1024 * 1024;
+	while ((num_bytes > budget_bytes) && (lru_entries.size() > static_cast<size_t>(MIN_CACHED_PAGE_DATA_PAGES))) {
+		Entry& least_recent = lru_entries.back();
+		num_bytes -= least_recent.num_bytes;
+		page_entries.erase(least_recent.page);
+		drop(least_recent);
+		lru_entries.pop_back();
+		num_evictions++;
+	}
+}
+
+void PageDataCache::drop(Entry& entry) {
+	if (entry.data.links.has_value()) {
+		fz_drop_link(context, entry.data.links.value());
+		entry.data.links = {};
+	}
+}
+
+void PageDataCache::clear() {
+	for (auto& entry : lru_entries) {
+		drop(entry);
+	}
+	lru_entries.clear();
+	page_entries.clear();
+	num_bytes = 0;
+}
+
+PageDataCacheStatistics PageDataCache::get_statistics() {
+	PageDataCacheStatistics res;
+	res.num_entries = lru_entries.size();
+	res.num_bytes = num_bytes;
+	res.budget_bytes = static_cast<size_t>(std::max(PAGE_DATA_CACHE_MEGABYTES, 0)) * 1024 * 1024;
+	res.num_hits = num_hits;
+	res.num_misses = num_misses;
+	res.num_evictions = num_evictions;
+	return res;
+}
+
+size_t get_page_data_memory_bytes(const PageData& data) {
+	size_t res = sizeof(PageData);
+	if (data.lines.has_value()) {
+		res += data.lines->line_rects.capacity() * sizeof(fz_rect);
+		res += data.lines->line_texts.capacity() * sizeof(std::wstring);
+		for (const auto& text : data.lines->line_texts) {
+			res += text.capacity() * sizeof(wchar_t);
+		}
+	}
+	if (data.words.has_value()) {
+		res += data.words->word_rects.capacity() * sizeof(fz_rect);
+		res += data.words->word_char_rects.capacity() * sizeof(std::vector<fz_rect>);
+		for (const auto& char_rects : data.words->word_char_rects) {
+			res += char_rects.capacity() * sizeof(fz_rect);
+		}
+	}
+	if (data.links.has_value()) {
+		for (fz_link* link = data.links.value(); link != nullptr; link = link->next) {
+			res += sizeof(fz_link);
+			if (link->uri) {
+				res += std::strlen(link->uri);
+			}
+		}
+	}
+	return res;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <optional>
+
+#include <mupdf/fitz.h>
+
+extern int PAGE_DATA_CACHE_MEGABYTES;
+extern const int MIN_CACHED_PAGE_DATA_PAGES;
+
+struct PageLines {
+	// in page coordinates
+	std::vector<fz_rect> line_rects;
+	// empty when the lines were detected from the image of the page instead of its text
+	std::vector<std::wstring> line_texts;
+};
+
+struct PageWords {
+	std::vector<fz_rect> word_rects;
+	std::vector<std::vector<fz_rect>> word_char_rects;
+};
+
+// the data derived from the contents of a page, each field is empty until it is computed
+struct PageData {
+	std::optional<PageLines> lines;
+	std::optional<PageWords> words;
+	// the links of the page, which is nullptr if the page has no links
+	std::optional<fz_link*> links;
+};
+
+struct PageDataCacheStatistics {
+	size_t num_entries = 0;
+	size_t num_bytes = 0;
+	size_t budget_bytes = 0;
+	long long num_hits = 0;
+	long long num_misses = 0;
+	long long num_evictions = 0;
+};
+
+/*
+	The derived data (lines, words and links) of the recently used pages of a document, indexed by page. All the data
+	of a page is evicted together in least recently used order when the size of the cache exceeds PAGE_DATA_CACHE_MEGABYTES.
+	The MIN_CACHED_PAGE_DATA_PAGES most recently used pages are never evicted, so references to the data of a page stay
+	valid while the data of a few other pages is computed. Should only be used from the main thread.
+*/
+class PageDataCache {
+private:
+	struct Entry {
+		int page;
+		PageData data;
+		size_t num_bytes = 0;
+	};
+
+	fz_context* context = nullptr;
+
+	// the most recently used page is at the front
+	std::list<Entry> lru_entries;
+	std::unordered_map<int, std::list<Entry>::iterator> page_entries;
+	size_t num_bytes = 0;
+	long long num_hits = 0;
+	long long num_misses = 0;
+	long long num_evictions = 0;
+
+	// returns the entry of `page` (creating it if it doesn't exist) and marks it as the most recently used one
+	Entry& get_entry(int page);
+	// recomputes the size of `entry` after it is modified and evicts the least recently used pages if needed
+	void update(Entry& entry);
+	void drop(Entry& entry);
+
+public:
+	PageDataCache(fz_context* context);
+	~PageDataCache();
+
+	// returns the `field` of the data of `page`, computing it using `compute` if it is not cached
+	template<typename T, typename ComputeFunction>
+	T& get(int page, std::optional<T> PageData::* field, ComputeFunction compute) {
+		Entry& entry = get_entry(page);
+		if ((entry.data.*field).has_value()) {
+			num_hits++;
+			return (entry.data.*field).value();
+		}
+		num_misses++;
+		entry.data.*field = compute();
+		update(entry);
+		return (entry.data.*field).value();
+	}
+
+	void clear();
+	PageDataCacheStatistics get_statistics();
+};
+
+// approximate memory used by `data`
+size_t get_page_data_memory_bytes(const PageData& data);
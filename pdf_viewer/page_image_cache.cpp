@@ -0,0 +1,248 @@
+#include "page_image_cache.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <qdir.h>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qdatetime.h>
+#include <qstringlist.h>
+
+extern int PAGE_IMAGE_CACHE_MEGABYTES;
+
+// we don't keep more than this many images waiting to be written, new images are dropped instead
+const size_t MAX_PENDING_PAGE_IMAGE_WRITES = 64;
+
+QString PageImageKey::file_name() const {
+	return QString::fromStdString(checksum) + "_" + QString::number(last_edit_time) + "_" +
+		QString::number(page) + "_" + QString::number(zoom_bucket) + ".png";
+}
+
+PageImageCache::PageImageCache(Path cache_dir, CachedChecksummer* checksummer) :
+	cache_dir(cache_dir),
+	checksummer(checksummer)
+{
+	load_entries();
+	writer_thread = std::thread([&]() {
+		run_writer();
+		});
+}
+
+PageImageCache::~PageImageCache() {
+	pending_writes_mutex.lock();
+	should_quit = true;
+	pending_writes_mutex.unlock();
+	pending_writes_cv.notify_all();
+	writer_thread.join();
+}
+
+int PageImageCache::get_zoom_bucket(float zoom_level) {
+	// four buckets per doubling of the zoom level, so an image is rescaled by at most ~10%
+	return static_cast<int>(std::round(std::log2(zoom_level) * 4));
+}
+
+long long PageImageCache::get_last_edit_time(const std::wstring& document_path) {
+	QFileInfo info(QString::fromStdWString(document_path));
+	return info.lastModified().toMSecsSinceEpoch();
+}
+
+size_t PageImageCache::get_budget_bytes() {
+	return static_cast<size_t>(std::max(PAGE_IMAGE_CACHE_MEGABYTES, 0)) * 1024 * 1024;
+}
+
+void PageImageCache::load_entries() {
+	QDir dir(QString::fromStdWString(cache_dir.get_path()));
+	QFileInfoList files = dir.entryInfoList(QStringList() << "*.png", QDir::Files);
+
+	std::lock_guard guard(cache_mutex);
+	for (const auto& file : files) {
+		if (file.fileName().split("_").size() != 4) {
+			continue;
+		}
+		Entry entry;
+		entry.num_bytes = file.size();
+		entry.last_access_time = file.lastModified().toMSecsSinceEpoch();
+		entries[file.fileName()] = entry;
+		total_bytes += entry.num_bytes;
+	}
+}
+
+std::optional<QImage> PageImageCache::find(const std::wstring& document_path, int page, float zoom_level) {
+	if ((get_budget_bytes() == 0) || (zoom_level <= 0)) {
+		return {};
+	}
+
+	std::optional<std::string> checksum = checksummer->get_checksum_fast(document_path);
+	if (!checksum) {
+		return {};
+	}
+
+	PageImageKey key{ checksum.value(), get_last_edit_time(document_path), page, get_zoom_bucket(zoom_level) };
+	QString file_name = key.file_name();
+
+	cache_mutex.lock();
+	auto entry = entries.find(file_name);
+	bool exists = entry != entries.end();
+	if (exists) {
+		entry->second.last_access_time = QDateTime::currentMSecsSinceEpoch();
+	}
+	cache_mutex.unlock();
+
+	if (!exists) {
+		return {};
+	}
+
+	QImage image;
+	if (!image.load(QString::fromStdWString(cache_dir.slash(file_name.toStdWString()).get_path()), "PNG")) {
+		// the file was deleted or corrupted
+		std::lock_guard guard(cache_mutex);
+		auto invalid_entry = entries.find(file_name);
+		if (invalid_entry != entries.end()) {
+			total_bytes -= invalid_entry->second.num_bytes;
+			entries.erase(invalid_entry);
+		}
+		return {};
+	}
+
+	float image_zoom_level = image.text("zoom").toFloat();
+	if ((image_zoom_level > 0) && (image_zoom_level != zoom_level)) {
+		int width = static_cast<int>(std::round(image.width() * zoom_level / image_zoom_level));
+		int height = static_cast<int>(std::round(image.height() * zoom_level / image_zoom_level));
+		image = image.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	}
+	return image.convertToFormat(QImage::Format_RGB888);
+}
+
+void PageImageCache::insert(const std::wstring& document_path, int page, float zoom_level, const QImage& image) {
+	if ((get_budget_bytes() == 0) || (zoom_level <= 0) || image.isNull()) {
+		return;
+	}
+
+	PendingWrite pending_write;
+	pending_write.document_path = document_path;
+	pending_write.last_edit_time = get_last_edit_time(document_path);
+	pending_write.page = page;
+	pending_write.zoom_level = zoom_level;
+	pending_write.image = image;
+
+	pending_writes_mutex.lock();
+	bool should_add = pending_writes.size() < MAX_PENDING_PAGE_IMAGE_WRITES;
+	if (should_add) {
+		pending_writes.push_back(pending_write);
+	}
+	pending_writes_mutex.unlock();
+
+	if (should_add) {
+		pending_writes_cv.notify_one();
+	}
+}
+
+void PageImageCache::run_writer() {
+	while (true) {
+		std::unique_lock<std::mutex> lock(pending_writes_mutex);
+		pending_writes_cv.wait(lock, [&]() {
+			return should_quit || (pending_writes.size() > 0);
+			});
+
+		if (should_quit) break;
+
+		PendingWrite pending_write = std::move(pending_writes.front());
+		pending_writes.pop_front();
+		lock.unlock();
+
+		write_image(pending_write);
+	}
+}
+
+void PageImageCache::write_image(const PendingWrite& pending_write) {
+	// unlike find(), we are in a background thread so we can afford to compute the checksum if needed
+	std::string checksum = checksummer->get_checksum(pending_write.document_path);
+	if (checksum.size() == 0) {
+		return;
+	}
+
+	PageImageKey key{ checksum, pending_write.last_edit_time, pending_write.page, get_zoom_bucket(pending_write.zoom_level) };
+	QString file_name = key.file_name();
+	QString file_path = QString::fromStdWString(cache_dir.slash(file_name.toStdWString()).get_path());
+
+	erase_stale_versions(checksum, pending_write.last_edit_time);
+
+	QImage image = pending_write.image;
+	image.setText("zoom", QString::number(pending_write.zoom_level));
+
+	// write to a temporary file first so that readers never see a partially written image
+	QString temp_file_path = file_path + ".tmp";
+	if (!image.save(temp_file_path, "PNG")) {
+		return;
+	}
+	QFile::remove(file_path);
+	if (!QFile::rename(temp_file_path, file_path)) {
+		QFile::remove(temp_file_path);
+		return;
+	}
+
+	std::lock_guard guard(cache_mutex);
+	auto previous_entry = entries.find(file_name);
+	if (previous_entry != entries.end()) {
+		total_bytes -= previous_entry->second.num_bytes;
+	}
+	Entry entry;
+	entry.num_bytes = QFileInfo(file_path).size();
+	entry.last_access_time = QDateTime::currentMSecsSinceEpoch();
+	entries[file_name] = entry;
+	total_bytes += entry.num_bytes;
+
+	evict(get_budget_bytes());
+}
+
+void PageImageCache::erase_stale_versions(const std::string& checksum, long long last_edit_time) {
+	QString prefix = QString::fromStdString(checksum) + "_";
+	QString current_prefix = prefix + QString::number(last_edit_time) + "_";
+
+	std::lock_guard guard(cache_mutex);
+	// entries are sorted by file name, so all the images of this document are adjacent
+	auto it = entries.lower_bound(prefix);
+	while ((it != entries.end()) && it->first.startsWith(prefix)) {
+		if (!it->first.startsWith(current_prefix)) {
+			QFile::remove(QString::fromStdWString(cache_dir.slash(it->first.toStdWString()).get_path()));
+			total_bytes -= it->second.num_bytes;
+			it = entries.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+}
+
+void PageImageCache::evict(size_t budget_bytes) {
+	// should be called with cache_mutex locked
+	while ((total_bytes > budget_bytes) && (entries.size() > 0)) {
+		auto least_recent = std::min_element(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs) {
+			return lhs.second.last_access_time < rhs.second.last_access_time;
+			});
+		QFile::remove(QString::fromStdWString(cache_dir.slash(least_recent->first.toStdWString()).get_path()));
+		total_bytes -= least_recent->second.num_bytes;
+		entries.erase(least_recent);
+	}
+}
+
+QImage pixmap_to_qimage(fz_pixmap* pixmap) {
+	// we only render rgb pixmaps without alpha
+	if ((pixmap == nullptr) || (pixmap->n != 3)) {
+		return QImage();
+	}
+	QImage image(pixmap->samples, pixmap->w, pixmap->h, static_cast<int>(pixmap->stride), QImage::Format_RGB888);
+	// the image doesn't own the samples, so we return a deep copy
+	return image.copy();
+}
+
+fz_pixmap* qimage_to_pixmap(fz_context* mupdf_context, const QImage& image) {
+	// may throw mupdf exceptions, so it should be called inside fz_try
+	QImage rgb_image = image.convertToFormat(QImage::Format_RGB888);
+	fz_pixmap* pixmap = fz_new_pixmap(mupdf_context, fz_device_rgb(mupdf_context), rgb_image.width(), rgb_image.height(), nullptr, 0);
+	for (int y = 0; y < rgb_image.height(); y++) {
+		memcpy(pixmap->samples + y * pixmap->stride, rgb_image.constScanLine(y), rgb_image.width() * 3);
+	}
+	return pixmap;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+
+#include <qimage.h>
+#include <qstring.h>
+#include <mupdf/fitz.h>
+
+#include "path.h"
+#include "checksum.h"
+
+/*
+	Identifies a cached page image. Documents are identified by their checksum (so that the cache survives
+	moving or renaming the file) and their last modification time (so that editing the file invalidates
+	its cached images). Images are rendered at arbitrary zoom levels, so we group nearby zoom levels
+	into buckets and the image of a bucket is rescaled to the exact zoom level when it is loaded.
+*/
+struct PageImageKey {
+	std::string checksum;
+	long long last_edit_time;
+	int page;
+	int zoom_bucket;
+
+	QString file_name() const;
+};
+
+/*
+	A persistent on-disk cache of compressed low resolution page images which is shared between sessions,
+	so that when a document is reopened we can display its pages before they are rendered. Images are written
+	to disk in a background thread and the least recently used images are deleted when the size of the cache
+	exceeds PAGE_IMAGE_CACHE_MEGABYTES. All public methods are thread-safe.
+*/
+class PageImageCache {
+private:
+	struct Entry {
+		size_t num_bytes = 0;
+		long long last_access_time = 0;
+	};
+
+	struct PendingWrite {
+		std::wstring document_path;
+		long long last_edit_time;
+		int page;
+		float zoom_level;
+		QImage image;
+	};
+
+	Path cache_dir;
+	CachedChecksummer* checksummer = nullptr;
+
+	// file name -> entry, guarded by cache_mutex
+	std::map<QString, Entry> entries;
+	size_t total_bytes = 0;
+	std::mutex cache_mutex;
+
+	std::deque<PendingWrite> pending_writes;
+	std::mutex pending_writes_mutex;
+	std::condition_variable pending_writes_cv;
+	std::thread writer_thread;
+	bool should_quit = false;
+
+	void load_entries();
+	void run_writer();
+	void write_image(const PendingWrite& pending_write);
+	// removes the images of the older versions of a document which are never going to be used again
+	void erase_stale_versions(const std::string& checksum, long long last_edit_time);
+	void evict(size_t budget_bytes);
+	size_t get_budget_bytes();
+
+public:
+	PageImageCache(Path cache_dir, CachedChecksummer* checksummer);
+	~PageImageCache();
+
+	static int get_zoom_bucket(float zoom_level);
+	static long long get_last_edit_time(const std::wstring& document_path);
+
+	// returns the cached image of `page` rescaled to `zoom_level`, or an empty optional if there is no such image
+	// or the checksum of the document is not computed yet (we never compute checksums when looking up images
+	// because it requires reading the entire file)
+	std::optional<QImage> find(const std::wstring& document_path, int page, float zoom_level);
+
+	// queues `image` (the image of `page` rendered at `zoom_level`) to be written to disk in the background
+	void insert(const std::wstring& document_path, int page, float zoom_level, const QImage& image);
+};
+
+QImage pixmap_to_qimage(fz_pixmap* pixmap);
+fz_pixmap* qimage_to_pixmap(fz_context* mupdf_context, const QImage& image);
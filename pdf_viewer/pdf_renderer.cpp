@@ -1,13 +1,26 @@
 #include "pdf_renderer.h"
 #include "utils.h"
+#include <chrono>
+#include <algorithm>
+#include <cstring>
 #include <qdatetime.h>
+#include <qopenglcontext.h>
+#include <qopenglextrafunctions.h>
 
 extern bool LINEAR_TEXTURE_FILTERING;
+extern bool DEBUG;
 //extern bool AUTO_EMBED_ANNOTATIONS;
 
-PdfRenderer::PdfRenderer(int num_threads, bool* should_quit_pointer, fz_context* context_to_clone, float display_scale) : context_to_clone(context_to_clone),
+PdfRenderer::PdfRenderer(int num_threads, bool* should_quit_pointer, fz_context* context_to_clone, float display_scale, DocumentHandlePool* document_handle_pool, PageImageCache* page_image_cache) : context_to_clone(context_to_clone),
 pixmaps_to_drop(num_threads),
+pixmaps_to_copy(num_threads),
 pixmap_drop_mutex(num_threads),
+in_flight_requests(num_threads),
+render_cookies(num_threads),
+are_documents_invalidated(num_threads),
+display_list_caches(num_threads),
+page_image_cache(page_image_cache),
+document_handle_pool(document_handle_pool),
 should_quit_pointer(should_quit_pointer),
 num_threads(num_threads),
 display_scale(display_scale)
@@ -37,42 +50,109 @@ void PdfRenderer::start_threads() {
 	search_thread = std::thread([&]() {
 		run_search(num_threads);
 		});
+
+	// the search thread also searches pages, so we only need the rest of the search threads as helpers
+	int num_search_threads = SEARCH_THREADS > 0 ? SEARCH_THREADS : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / 2);
+	for (int i = 1; i < num_search_threads; i++) {
+		search_helper_threads.push_back(std::thread([&]() {
+			run_search_helper();
+			}));
+	}
 }
 
 void PdfRenderer::join_threads()
 {
+	// wake up the blocked threads so that they notice `should_quit_pointer`
+	wake_workers();
+	search_request_mutex.lock();
+	search_request_mutex.unlock();
+	search_request_cv.notify_all();
+	search_job_mutex.lock();
+	search_job_mutex.unlock();
+	search_job_cv.notify_all();
+
 	for (auto& worker : worker_threads) {
 		worker.join();
 	}
 	search_thread.join();
+	for (auto& helper : search_helper_threads) {
+		helper.join();
+	}
 }
 
 
-void PdfRenderer::add_request(std::wstring document_path, int page, float zoom_level) {
+void PdfRenderer::add_request(std::wstring document_path, int page, float zoom_level, RenderPriority priority, bool is_preview) {
 	//fz_document* doc = get_document_with_path(document_path);
 	if (document_path.size() > 0) {
 		RenderRequest req;
 		req.path = document_path;
 		req.page = page;
 		req.zoom_level = zoom_level;
+		req.priority = priority;
+		req.is_preview = is_preview;
+		enqueue_request(req);
+	}
+	else {
+		std::wcout << "Error: could not find documnet" << std::endl;
+	}
+}
 
-		pending_requests_mutex.lock();
-		bool should_add = true;
-		for (size_t i = 0; i < pending_render_requests.size(); i++) {
-			if (pending_render_requests[i] == req) {
-				should_add = false;
+void PdfRenderer::enqueue_request(RenderRequest req) {
+	unsigned int now = QDateTime::currentMSecsSinceEpoch();
+	RenderPriority priority = req.priority;
+	req.request_time = now;
+	req.viewer = current_viewer;
+	req.frame = current_frame;
+
+	pending_requests_mutex.lock();
+	bool should_add = true;
+
+	// repeated requests keep the request fresh and can only make it more urgent
+	auto refresh = [&](RenderRequest& existing) {
+		existing.request_time = now;
+		if (existing.viewer != current_viewer) {
+			// the page is visible in more than one viewer, so the frames of one viewer can't tell whether it is stale
+			existing.viewer = nullptr;
+		}
+		existing.frame = current_frame;
+		if (priority < existing.priority) {
+			if ((existing.priority == RenderPriority::Prefetch) && (priority != RenderPriority::Prefetch) && (!req.is_preview)) {
+				// the page was prefetched, but not soon enough
+				num_not_ready_on_first_display++;
 			}
+			existing.priority = priority;
 		}
-		if (should_add) {
-			pending_render_requests.push_back(req);
+	};
+
+	for (size_t i = 0; i < pending_render_requests.size(); i++) {
+		if (pending_render_requests[i] == req) {
+			refresh(pending_render_requests[i]);
+			should_add = false;
 		}
-		if (pending_render_requests.size() > (size_t) MAX_PENDING_REQUESTS) {
-			pending_render_requests.erase(pending_render_requests.begin());
+	}
+	for (int i = 0; i < num_threads; i++) {
+		// an aborted render is not going to produce a page, so the request should be rendered again
+		if (in_flight_requests[i].has_value() && (render_cookies[i].abort == 0) && (in_flight_requests[i].value() == req)) {
+			refresh(in_flight_requests[i].value());
+			should_add = false;
 		}
-		pending_requests_mutex.unlock();
 	}
-	else {
-		std::wcout << "Error: could not find documnet" << std::endl;
+
+	if (should_add) {
+		pending_render_requests.push_back(req);
+		if ((priority != RenderPriority::Prefetch) && (!req.is_preview)) {
+			num_not_ready_on_first_display++;
+		}
+	}
+	if (pending_render_requests.size() > (size_t) MAX_PENDING_REQUESTS) {
+		// drop the least urgent request
+		auto least_urgent = std::max_element(pending_render_requests.begin(), pending_render_requests.end(), is_more_urgent);
+		pending_render_requests.erase(least_urgent);
+		num_cancelled_requests++;
+	}
+	pending_requests_mutex.unlock();
+	if (should_add) {
+		pending_requests_cv.notify_one();
 	}
 }
 void PdfRenderer::add_request(std::wstring document_path,
@@ -82,7 +162,8 @@ void PdfRenderer::add_request(std::wstring document_path,
 	float* percent_done,
 	bool* is_searching,
 	std::mutex* mut,
-	std::optional<std::pair<int, int>> range) {
+	std::optional<std::pair<int, int>> range,
+	IncrementalSearchFunction search_function) {
 
 	//fz_document* doc = get_document_with_path(document_path);
 	if (document_path.size() > 0) {
@@ -96,87 +177,360 @@ void PdfRenderer::add_request(std::wstring document_path,
 		req.percent_done = percent_done;
 		req.is_searching = is_searching;
 		req.range = range;
+		req.search_function = search_function;
 
 		search_request_mutex.lock();
 		pending_search_request = req;
+		is_search_cancelled = false;
 		search_request_mutex.unlock();
+		search_request_cv.notify_one();
 	}
 	else {
 		std::wcout << "Error: could not find document" << std::endl;
 	}
 }
 
+void PdfRenderer::cancel_search() {
+	search_request_mutex.lock();
+	pending_search_request = {};
+	is_search_cancelled = true;
+	search_request_mutex.unlock();
+}
+
 //should only be called from the main thread
 
-GLuint PdfRenderer::find_rendered_page(std::wstring path, int page, float zoom_level, int* page_width, int* page_height) {
+GLuint PdfRenderer::find_rendered_page(std::wstring path, int page, float zoom_level, int* page_width, int* page_height, RenderPriority priority) {
 	//fz_document* doc = get_document_with_path(path);
 	if (path.size() > 0) {
 		RenderRequest req;
 		req.path = path;
 		req.page = page;
 		req.zoom_level = zoom_level;
-		cached_response_mutex.lock();
-		GLuint result = 0;
-		for (auto& cached_resp : cached_responses) {
-			if ((cached_resp.request == req) && (cached_resp.invalid == false)) {
-				cached_resp.last_access_time = QDateTime::currentMSecsSinceEpoch();
-
-				if (page_width) *page_width = cached_resp.width;
-				if (page_height) *page_height = cached_resp.height;
-
-				// We can only use OpenGL in the main thread, so we can not upload the rendered
-				// pixmap into a texture in the worker thread, so whenever we get a rendered page
-				// in the main thread, we initialize its OpenGL texture if it is not initialized already
-				if (cached_resp.texture != 0) {
-					result = cached_resp.texture;
-				}
-				else {
-					glGenTextures(1, &result);
-					glBindTexture(GL_TEXTURE_2D, result);
-
-					if (LINEAR_TEXTURE_FILTERING) {
-						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-					}
-					else {
-						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-					}
+		req.priority = priority;
+		return find_rendered_request(req, page_width, page_height);
+	}
+	return 0;
+}
+
+GLuint PdfRenderer::find_rendered_tile(std::wstring path, int page, float zoom_level, int tile_x, int tile_y, int* tile_width, int* tile_height, RenderPriority priority) {
+	if (path.size() > 0) {
+		RenderRequest req;
+		req.path = path;
+		req.page = page;
+		req.zoom_level = zoom_level;
+		req.tile_x = tile_x;
+		req.tile_y = tile_y;
+		req.priority = priority;
+		return find_rendered_request(req, tile_width, tile_height);
+	}
+	return 0;
+}
+
+GLuint PdfRenderer::find_rendered_request(const RenderRequest& req, int* page_width, int* page_height) {
+	RenderPriority priority = req.priority;
+	cached_response_mutex.lock();
+	GLuint result = 0;
+
+	auto lookup_begin = std::chrono::steady_clock::now();
+	RenderResponse* cached_resp = cached_responses.find(req, true);
+	total_lookup_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - lookup_begin).count();
+	num_lookups++;
+
+	// whether the page is rendered but its texture upload was deferred to the next frames
+	bool is_upload_deferred = false;
+
+	if (cached_resp && (cached_resp->invalid == false)) {
+		num_cache_hits++;
+		cached_resp->last_access_time = QDateTime::currentMSecsSinceEpoch();
+
+		if ((priority != RenderPriority::Prefetch) && (!cached_resp->was_displayed)) {
+			cached_resp->was_displayed = true;
+			num_ready_on_first_display++;
+			if (cached_resp->request.priority == RenderPriority::Prefetch) {
+				num_prefetched_pages_displayed++;
+			}
+		}
+
+		if (page_width) *page_width = cached_resp->width;
+		if (page_height) *page_height = cached_resp->height;
+
+		if (priority == RenderPriority::Prefetch) {
+			// prefetched pages are not displayed yet, so we don't spend the upload budget on them
+			result = cached_resp->texture;
+			cached_response_mutex.unlock();
+			return result;
+		}
+
+		result = get_response_texture(cached_resp);
+		is_upload_deferred = (result == 0);
+	}
+	else {
+		num_cache_misses++;
+	}
+	cached_response_mutex.unlock();
+	if (result == 0) {
+		if (!is_upload_deferred) {
+			enqueue_request(req);
+		}
+		if (req.is_tile()) {
+			// the caller is responsible for drawing a placeholder for the missing tiles
+			return 0;
+		}
+		GLuint closest_texture = try_closest_rendered_page(req.path, req.page, req.zoom_level, page_width, page_height);
+		if ((closest_texture == 0) && (!is_upload_deferred) && (!req.is_preview) && (priority != RenderPriority::Prefetch)) {
+			// there is nothing to display until the page is rendered, so we first render a cheap low resolution
+			// version of the page which is displayed (scaled up) until the full resolution render is finished
+			RenderRequest preview_req = req;
+			preview_req.zoom_level = req.zoom_level * PREVIEW_RENDER_SCALE;
+			preview_req.is_preview = true;
+			enqueue_request(preview_req);
+		}
+		return closest_texture;
+	}
+	return result;
+}
+
+GLuint PdfRenderer::get_response_texture(RenderResponse* resp) {
+	/*
+	We can only use OpenGL in the main thread, so we can not upload the rendered
+	pixmap into a texture in the worker thread, so whenever we get a rendered page
+	in the main thread, we initialize its OpenGL texture if it is not initialized already.
+	Copying a large pixmap takes a while, so instead of copying it in the frame, we map a pixel buffer object
+	which the worker that rendered the pixmap fills and the texture is created from the buffer in a later frame
+	(see finish_texture_uploads).
+	Returns 0 if the texture is not created yet, either because its pixmap is being copied or because this frame
+	has already used its upload budget.
+	Should be called from the main thread with cached_response_mutex locked.
+	*/
+	if (resp->texture != 0) {
+		return resp->texture;
+	}
+	if (resp->upload_buffer != nullptr) {
+		return 0;
+	}
+
+	// we always upload at least one pixmap per frame so that we make progress even if a single
+	// pixmap is larger than the budget (pixmaps are bounded by TILED_RENDER_MIN_PAGE_PIXELS anyway)
+	size_t upload_budget = get_upload_budget_bytes();
+	if ((upload_budget > 0) && (frame_upload_bytes > 0) && (frame_upload_bytes + resp->num_bytes > upload_budget)) {
+		has_deferred_uploads = true;
+		upload_statistics.num_deferred_uploads++;
+		return 0;
+	}
+
+	auto upload_begin = std::chrono::steady_clock::now();
+
+	if (start_texture_upload(resp)) {
+		frame_upload_bytes += resp->num_bytes;
+		upload_statistics.total_upload_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - upload_begin).count();
+		return 0;
+	}
+	if (are_upload_buffers_supported) {
+		// all the upload buffers are being filled, they are freed in the next frames
+		upload_statistics.num_deferred_uploads++;
+		return 0;
+	}
+
+	// without pixel buffer objects, glTexImage2D copies the pixmap from client memory in this frame
+	GLuint texture = create_texture();
+	// OpenGL usually expects powers of two textures and since our pixmaps dimensions are
+	// often not powers of two, we set the unpack alignment to 1 (no alignment)
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, resp->pixmap->w, resp->pixmap->h, 0, GL_RGB, GL_UNSIGNED_BYTE, resp->pixmap->samples);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	frame_upload_bytes += resp->num_bytes;
+	upload_statistics.num_uploads++;
+	upload_statistics.num_bytes += resp->num_bytes;
+	upload_statistics.total_upload_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - upload_begin).count();
+
+	// don't need the pixmap anymore
+	pixmap_drop_mutex[resp->thread].lock();
+	pixmaps_to_drop[resp->thread].push_back(resp->pixmap);
+	resp->texture = texture;
+	resp->pixmap = nullptr;
+	pixmap_drop_mutex[resp->thread].unlock();
+
+	// we can't wake up the workers here because cached_response_mutex is locked, see end_frame
+	has_pixmap_tasks = true;
+
+	return texture;
+}
+
+GLuint PdfRenderer::create_texture() {
+	// creates a texture for a rendered page and binds it
+	GLuint texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	if (LINEAR_TEXTURE_FILTERING) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+	else {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
 
 #ifdef GL_CLAMP
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 #else
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 #endif
+	return texture;
+}
 
+bool PdfRenderer::start_texture_upload(RenderResponse* resp) {
+	// should be called from the main thread with cached_response_mutex locked
+	QOpenGLContext* gl_context = QOpenGLContext::currentContext();
+	if ((gl_context == nullptr) || (gl_context->format().majorVersion() < 3)) {
+		are_upload_buffers_supported = false;
+		return false;
+	}
+	QOpenGLExtraFunctions* gl = gl_context->extraFunctions();
 
-					// OpenGL usually expects powers of two textures and since our pixmaps dimensions are
-					// often not powers of two, we set the unpack alignment to 1 (no alignment) 
+	if (upload_buffers.size() == 0) {
+		upload_buffers.resize(NUM_TEXTURE_UPLOAD_BUFFERS);
+		for (auto& upload_buffer : upload_buffers) {
+			gl->glGenBuffers(1, &upload_buffer.buffer);
+		}
+	}
 
-					glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cached_resp.pixmap->w, cached_resp.pixmap->h, 0, GL_RGB, GL_UNSIGNED_BYTE, cached_resp.pixmap->samples);
-					glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	auto free_buffer = std::find_if(upload_buffers.begin(), upload_buffers.end(), [](const TextureUploadBuffer& upload_buffer) {
+		return !upload_buffer.is_in_use;
+		});
+	if (free_buffer == upload_buffers.end()) {
+		return false;
+	}
 
-					// don't need the pixmap anymore
-					pixmap_drop_mutex[cached_resp.thread].lock();
-					pixmaps_to_drop[cached_resp.thread].push_back(cached_resp.pixmap);
-					cached_resp.texture = result;
-					pixmap_drop_mutex[cached_resp.thread].unlock();
+	size_t num_bytes = static_cast<size_t>(resp->pixmap->stride) * resp->pixmap->h;
+	gl->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, free_buffer->buffer);
+	// orphan the previous storage of the buffer instead of waiting for its transfer to finish
+	gl->glBufferData(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(num_bytes), nullptr, GL_STREAM_DRAW);
+	void* data = gl->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, static_cast<GLsizeiptr>(num_bytes), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	gl->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (data == nullptr) {
+		are_upload_buffers_supported = false;
+		return false;
+	}
 
-				}
-				break;
+	free_buffer->is_in_use = true;
+	free_buffer->request = resp->request;
+	free_buffer->thread = resp->thread;
+	free_buffer->pixmap = resp->pixmap;
+	free_buffer->data = data;
+	free_buffer->num_bytes = num_bytes;
+	free_buffer->is_filled = false;
+	resp->upload_buffer = &(*free_buffer);
+
+	pixmap_drop_mutex[resp->thread].lock();
+	pixmaps_to_copy[resp->thread].push_back(resp->upload_buffer);
+	pixmap_drop_mutex[resp->thread].unlock();
+
+	// we can't wake up the workers here because cached_response_mutex is locked, see end_frame
+	has_pixmap_tasks = true;
+	return true;
+}
+
+void PdfRenderer::finish_texture_uploads() {
+	// should be called from the main thread
+	QOpenGLContext* gl_context = QOpenGLContext::currentContext();
+	if ((gl_context == nullptr) || (upload_buffers.size() == 0)) {
+		return;
+	}
+	QOpenGLExtraFunctions* gl = gl_context->extraFunctions();
+
+	cached_response_mutex.lock();
+	for (auto& upload_buffer : upload_buffers) {
+		if (!upload_buffer.is_in_use) {
+			continue;
+		}
+		pixmap_drop_mutex[upload_buffer.thread].lock();
+		bool is_filled = upload_buffer.is_filled;
+		pixmap_drop_mutex[upload_buffer.thread].unlock();
+		if (!is_filled) {
+			continue;
+		}
+
+		auto upload_begin = std::chrono::steady_clock::now();
+
+		gl->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer.buffer);
+		bool is_unmapped = gl->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		// the response may have been deleted (and its pixmap dropped after the copy) while the pixmap was being copied
+		RenderResponse* resp = cached_responses.find(upload_buffer.request);
+		if ((resp != nullptr) && (resp->upload_buffer == &upload_buffer)) {
+			resp->upload_buffer = nullptr;
+			// if the buffer was corrupted while it was mapped, the upload is retried in the next frame
+			if (is_unmapped) {
+				GLuint texture = create_texture();
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+				// when a pixel unpack buffer is bound, the data pointer is an offset into the buffer, so the
+				// driver transfers the data without blocking this frame
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, resp->pixmap->w, resp->pixmap->h, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+				upload_statistics.num_uploads++;
+				upload_statistics.num_bytes += resp->num_bytes;
+
+				// don't need the pixmap anymore
+				pixmap_drop_mutex[resp->thread].lock();
+				pixmaps_to_drop[resp->thread].push_back(resp->pixmap);
+				resp->texture = texture;
+				resp->pixmap = nullptr;
+				pixmap_drop_mutex[resp->thread].unlock();
+				has_pixmap_tasks = true;
 			}
 		}
-		cached_response_mutex.unlock();
-		if (result == 0) {
-			add_request(path, page, zoom_level);
-			return try_closest_rendered_page(path, page, zoom_level, page_width, page_height);
+		gl->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		upload_buffer.is_in_use = false;
+		upload_buffer.pixmap = nullptr;
+		upload_buffer.data = nullptr;
+		upload_statistics.total_upload_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - upload_begin).count();
+	}
+	cached_response_mutex.unlock();
+}
+
+size_t PdfRenderer::get_upload_budget_bytes() {
+	return static_cast<size_t>(std::max(TEXTURE_UPLOAD_MEGABYTES_PER_FRAME, 0)) * 1024 * 1024;
+}
+
+void PdfRenderer::begin_frame(const void* viewer) {
+	finish_texture_uploads();
+	frame_upload_bytes = 0;
+	has_deferred_uploads = false;
+	current_viewer = viewer;
+	current_frame++;
+}
+
+bool PdfRenderer::end_frame() {
+	pending_requests_mutex.lock();
+	last_finished_frames[current_viewer] = current_frame;
+	for (int i = 0; i < num_threads; i++) {
+		if (in_flight_requests[i].has_value() && is_request_stale(in_flight_requests[i].value())) {
+			// the page was not drawn in this frame (e.g. because the user scrolled past it)
+			// so we abort it to make room for the requests that are still relevant
+			render_cookies[i].abort = 1;
 		}
-		return result;
 	}
-	return 0;
+	pending_requests_mutex.unlock();
+	current_viewer = nullptr;
+
+	if (has_pixmap_tasks) {
+		// the pixmaps are copied and freed by the workers which rendered them, so idle workers should wake up
+		has_pixmap_tasks = false;
+		wake_workers();
+	}
+	return has_deferred_uploads;
+}
+
+TextureUploadStatistics PdfRenderer::take_upload_statistics() {
+	TextureUploadStatistics res = upload_statistics;
+	upload_statistics = TextureUploadStatistics();
+	return res;
 }
 
 GLuint PdfRenderer::try_closest_rendered_page(std::wstring doc_path, int page, float zoom_level, int* page_width, int* page_height) {
@@ -186,19 +540,13 @@ GLuint PdfRenderer::try_closest_rendered_page(std::wstring doc_path, int page, f
 	*/
 	cached_response_mutex.lock();
 
-	float min_diff = 10000.0f;
 	GLuint best_texture = 0;
 
-	for (const auto& cached_resp : cached_responses) {
-		if ((cached_resp.request.path == doc_path) && (cached_resp.request.page == page) && (cached_resp.texture != 0)) {
-			float diff = cached_resp.request.zoom_level - zoom_level;
-			if (diff <= min_diff) {
-				min_diff = diff;
-				best_texture = cached_resp.texture;
-				if (page_width) *page_width = static_cast<int>(cached_resp.width * zoom_level / cached_resp.request.zoom_level);
-				if (page_height) *page_height = static_cast<int>(cached_resp.height * zoom_level / cached_resp.request.zoom_level);
-			}
-		}
+	RenderResponse* closest_resp = cached_responses.find_closest(doc_path, page, zoom_level);
+	if (closest_resp) {
+		best_texture = get_response_texture(closest_resp);
+		if (page_width) *page_width = static_cast<int>(closest_resp->width * zoom_level / closest_resp->request.zoom_level);
+		if (page_height) *page_height = static_cast<int>(closest_resp->height * zoom_level / closest_resp->request.zoom_level);
 	}
 	cached_response_mutex.unlock();
 	return best_texture;
@@ -211,49 +559,44 @@ void PdfRenderer::delete_old_pages(bool force_all, bool invalidate_all) {
 	that created them, so we add old pixmaps to pixmaps_to_delete and delete them later from the worker thread
 	*/
 	cached_response_mutex.lock();
-	std::vector<int> indices_to_delete;
 	unsigned int now = QDateTime::currentMSecsSinceEpoch();
-	std::vector<int> cached_response_times;
-
-	for (size_t i = 0; i < cached_responses.size(); i++) {
-		cached_response_times.push_back(now - cached_responses[i].last_access_time);
-	}
-	int N = 5;
 
 	if (invalidate_all) {
-		for (size_t i = 0; i < cached_responses.size(); i++) {
-			cached_responses[i].invalid = true;
-		}
-		are_documents_invalidated = true;
+		cached_responses.for_each([&](RenderResponse& resp) {
+			resp.invalid = true;
+			});
+		std::fill(are_documents_invalidated.begin(), are_documents_invalidated.end(), true);
 	}
 
+	std::vector<RenderResponse> responses_to_delete = std::move(orphan_responses);
+	orphan_responses.clear();
+
 	if (force_all) {
-		for (size_t i = 0; i < cached_responses.size(); i++) {
-			indices_to_delete.push_back(i);
-		}
-		are_documents_invalidated = true;
+		std::vector<RenderResponse> evicted = cached_responses.evict(0, 0, now + 1);
+		responses_to_delete.insert(responses_to_delete.end(), evicted.begin(), evicted.end());
+		std::fill(are_documents_invalidated.begin(), are_documents_invalidated.end(), true);
 	}
-	else if (cached_response_times.size() > (size_t) N) {
-		// we never delete N most recent pages
-		// todo: make this configurable
-		std::nth_element(cached_response_times.begin(), cached_response_times.begin() + N - 1, cached_response_times.end());
-
-
-		unsigned int time_threshold = now - cached_response_times[N - 1];
-
-		for (size_t i = 0; i < cached_responses.size(); i++) {
-			if ((cached_responses[i].last_access_time < time_threshold)
-				&& ((now - cached_responses[i].last_access_time) > CACHE_INVALID_MILIES)) {
-				indices_to_delete.push_back(i);
+	else {
+		// we never delete the N most recent pages or pages that were used recently since they are probably visible
+		// invalid pages are not going to be used again so they don't need to be protected
+		int N = 5;
+		std::vector<RenderRequest> invalid_requests;
+		cached_responses.for_each([&](RenderResponse& resp) {
+			if (resp.invalid && ((now - resp.last_access_time) > CACHE_INVALID_MILIES)) {
+				invalid_requests.push_back(resp.request);
 			}
+			});
+		for (const auto& req : invalid_requests) {
+			responses_to_delete.push_back(*cached_responses.find(req));
+			cached_responses.erase(req);
 		}
+
+		std::vector<RenderResponse> evicted = cached_responses.evict(get_cache_budget_bytes(), N, now - CACHE_INVALID_MILIES);
+		num_cache_evictions += evicted.size();
+		responses_to_delete.insert(responses_to_delete.end(), evicted.begin(), evicted.end());
 	}
 
-	// We erase from back to front so that erasing one element does not change
-	// the index of other elements
-	for (int j = indices_to_delete.size() - 1; j >= 0; j--) {
-		int index_to_delete = indices_to_delete[j];
-		RenderResponse resp = cached_responses[index_to_delete];
+	for (const auto& resp : responses_to_delete) {
 
 		pixmap_drop_mutex[resp.thread].lock();
 		if (resp.texture == 0) {
@@ -264,10 +607,121 @@ void PdfRenderer::delete_old_pages(bool force_all, bool invalidate_all) {
 		if (resp.texture != 0) {
 			glDeleteTextures(1, &resp.texture);
 		}
+	}
+	cached_response_mutex.unlock();
+
+	if (responses_to_delete.size() > 0) {
+		// idle workers should drop the pixmaps that we just queued
+		wake_workers();
+	}
+
+	if (DEBUG) {
+		report_lookup_statistics();
+	}
+}
+
+RenderCacheStatistics PdfRenderer::get_cache_statistics() {
+	cached_response_mutex.lock();
+	RenderCacheStatistics res;
+	res.num_entries = cached_responses.size();
+	res.num_bytes = cached_responses.get_total_bytes();
+	res.budget_bytes = get_cache_budget_bytes();
+	res.num_hits = num_cache_hits;
+	res.num_misses = num_cache_misses;
+	res.num_evictions = num_cache_evictions;
+	res.num_ready_on_first_display = num_ready_on_first_display;
+	res.num_prefetched_pages_displayed = num_prefetched_pages_displayed;
+	res.num_display_lists = num_display_lists;
+	res.num_display_list_hits = num_display_list_hits;
+	res.num_display_list_misses = num_display_list_misses;
+	cached_response_mutex.unlock();
+
+	pending_requests_mutex.lock();
+	res.num_cancelled_requests = num_cancelled_requests;
+	res.num_not_ready_on_first_display = num_not_ready_on_first_display;
+	pending_requests_mutex.unlock();
+
+	return res;
+}
+
+size_t PdfRenderer::get_cache_budget_bytes() {
+	return static_cast<size_t>(std::max(RENDER_CACHE_MEGABYTES, 0)) * 1024 * 1024;
+}
+
+size_t PdfRenderer::estimate_render_bytes(float page_width, float page_height, float zoom_level) {
+	float scale = get_render_scale(zoom_level);
+	return static_cast<size_t>(page_width * scale) * static_cast<size_t>(page_height * scale) * 3;
+}
+
+float PdfRenderer::get_render_scale(float zoom_level) {
+	return zoom_level * display_scale;
+}
+
+bool PdfRenderer::should_render_tiled(float page_width, float page_height, float zoom_level) {
+	float scale = get_render_scale(zoom_level);
+	return std::max(page_width, page_height) * scale > TILED_RENDER_MIN_PAGE_PIXELS;
+}
+
+float PdfRenderer::get_preview_zoom_level(float page_width, float page_height, float zoom_level) {
+	float preview_zoom_level = zoom_level * PREVIEW_RENDER_SCALE;
 
-		cached_responses.erase(cached_responses.begin() + index_to_delete);
+	// the preview itself should be small enough to be rendered in its entirety
+	float max_page_size = std::max(page_width, page_height);
+	if (max_page_size > 0) {
+		preview_zoom_level = std::min(preview_zoom_level, TILED_RENDER_MIN_PAGE_PIXELS / (max_page_size * display_scale));
 	}
+	return preview_zoom_level;
+}
+
+void PdfRenderer::report_lookup_statistics() {
+	cached_response_mutex.lock();
+	if (num_lookups > 0) {
+		std::wcout << L"render cache: " << cached_responses.size() << L" entries, "
+			<< (total_lookup_nanos / num_lookups) << L" ns per lookup (" << num_lookups << L" lookups)\n";
+	}
+	total_lookup_nanos = 0;
+	num_lookups = 0;
 	cached_response_mutex.unlock();
+
+	long long num_hits = num_display_list_hits;
+	long long num_misses = num_display_list_misses;
+	if ((num_hits > 0) && (num_misses > 0)) {
+		std::wcout << L"display lists: " << num_display_lists << L" pages, "
+			<< (total_render_nanos_without_cached_list / num_misses) / 1000 << L" us per render from scratch ("
+			<< num_misses << L" renders), "
+			<< (total_render_nanos_with_cached_list / num_hits) / 1000 << L" us per render from cached display list ("
+			<< num_hits << L" renders)\n";
+	}
+}
+
+void PdfRenderer::run_incremental_search(SearchRequest& req) {
+	req.search_results_mutex->lock();
+	req.search_results->clear();
+	*req.is_searching = true;
+	*req.percent_done = 0;
+	req.search_results_mutex->unlock();
+
+	// the search is stale when a new search is requested or it is cancelled
+	auto is_stale = [&]() {
+		std::lock_guard guard(search_request_mutex);
+		return pending_search_request.has_value() || is_search_cancelled || (*should_quit_pointer);
+	};
+
+	req.search_function(is_stale, [&](std::vector<SearchResult>&& results, float percent_done) {
+		req.search_results_mutex->lock();
+		// checked while holding search_results_mutex, so we never add results after cancel_search cleared them
+		if (!is_stale()) {
+			req.search_results->insert(req.search_results->end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+			*req.percent_done = percent_done;
+		}
+		req.search_results_mutex->unlock();
+		emit search_advance();
+		});
+
+	req.search_results_mutex->lock();
+	*req.is_searching = false;
+	req.search_results_mutex->unlock();
+	emit search_advance();
 }
 
 void PdfRenderer::run_search(int thread_index)
@@ -275,94 +729,235 @@ void PdfRenderer::run_search(int thread_index)
 	fz_context* mupdf_context  = init_context();
 
 	while (!(*should_quit_pointer)) {
-		if (pending_search_request.has_value()) {
+		std::unique_lock<std::mutex> search_lock(search_request_mutex);
+		search_request_cv.wait(search_lock, [&]() {
+			return (*should_quit_pointer) || pending_search_request.has_value();
+			});
+
+		if (pending_search_request.has_value() && !(*should_quit_pointer)) {
 
-			search_request_mutex.lock();
 			SearchRequest req = pending_search_request.value();
 			pending_search_request = {};
-			search_request_mutex.unlock();
+			search_lock.unlock();
 
-			fz_document* doc = get_document_with_path(thread_index, mupdf_context, req.path);
+			if (req.search_function) {
+				run_incremental_search(req);
+				continue;
+			}
+
+			run_mupdf_search(thread_index, mupdf_context, req);
+		}
+	}
+}
 
-			int num_pages_in_document = fz_count_pages(mupdf_context, doc);
+static std::vector<SearchResult> search_page_with_mupdf(fz_context* mupdf_context, fz_document* doc, int page_number, const std::string& search_term) {
+	// mupdf doesn't report the number of hits which didn't fit in the buffer, so we search again with a larger
+	// buffer when it is full
+	const int initial_max_hits = 32;
+	const int max_max_hits = 4096;
 
-			int page_begin = 0;
-			int page_end = num_pages_in_document-1;
+	std::vector<fz_quad> hitboxes;
+	std::vector<int> hit_marks;
+	int num_hits = 0;
+	fz_page* page = nullptr;
+	fz_var(page);
 
-			if (req.range) {
-				page_begin = req.range.value().first-1;
-				page_end = req.range.value().second-1;
+	fz_try(mupdf_context) {
+		page = fz_load_page(mupdf_context, doc, page_number);
+		for (int max_hits = initial_max_hits; max_hits <= max_max_hits; max_hits *= 4) {
+			hitboxes.resize(max_hits);
+			hit_marks.resize(max_hits);
+			num_hits = fz_search_page(mupdf_context, page, search_term.c_str(), hit_marks.data(), hitboxes.data(), max_hits);
+			if (num_hits < max_hits) {
+				break;
 			}
-			// make sure page range is valid {
-			if (page_begin < 0) page_begin = 0;
-			if (page_begin > num_pages_in_document-1) page_begin = num_pages_in_document-1;
-			if (page_end < 0) page_end = 0;
-			if (page_end > num_pages_in_document-1) page_end = num_pages_in_document-1;
-			//}
+		}
+	}
+	fz_always(mupdf_context) {
+		fz_drop_page(mupdf_context, page);
+	}
+	fz_catch(mupdf_context) {
+		std::wcout << L"Error: could not search page " << page_number << L"\n";
+		num_hits = 0;
+	}
 
-			int num_pages = page_end - page_begin + 1;
+	std::vector<SearchResult> results;
+	for (int j = 0; j < num_hits; j++) {
+		if ((hit_marks[j] == 1) || (results.size() == 0)) {
+			// Hit box belongs to new entry
+			results.push_back(SearchResult{ std::vector<fz_rect>(), page_number });
+		}
+		results.back().rects.push_back(fz_rect_from_quad(hitboxes[j]));
+	}
+	return results;
+}
 
-			req.search_results_mutex->lock();
-			req.search_results->clear();
-			*req.is_searching = true;
-			req.search_results_mutex->unlock();
+bool PdfRenderer::search_next_job_page(fz_context* mupdf_context, fz_document* doc, MupdfSearchJob& job) {
+	size_t page_index;
+	{
+		std::lock_guard guard(job.mutex);
+		if (job.is_cancelled || (job.next_page_index >= job.pages.size())) {
+			return false;
+		}
+		page_index = job.next_page_index++;
+	}
+
+	std::vector<SearchResult> results = search_page_with_mupdf(mupdf_context, doc, job.pages[page_index], job.search_term);
+
+	{
+		std::lock_guard guard(job.mutex);
+		job.page_results[page_index] = std::move(results);
+	}
+	job.page_searched_cv.notify_all();
+	return true;
+}
 
-			if (req.start_page > page_end || req.start_page < page_begin) {
-				req.start_page = page_begin;
+void PdfRenderer::run_search_helper() {
+	fz_context* mupdf_context = init_context();
+	std::shared_ptr<MupdfSearchJob> last_job = nullptr;
+
+	while (!(*should_quit_pointer)) {
+		std::shared_ptr<MupdfSearchJob> job = nullptr;
+		{
+			std::unique_lock<std::mutex> job_lock(search_job_mutex);
+			search_job_cv.wait(job_lock, [&]() {
+				return (*should_quit_pointer) || (current_search_job && (current_search_job != last_job));
+				});
+			if (*should_quit_pointer) {
+				break;
 			}
+			job = current_search_job;
+			last_job = job;
+		}
 
-			int total_results = 0;
-			int num_handled_pages = 0;
-			int i = req.start_page;
-			while (num_handled_pages < num_pages && (!pending_search_request.has_value()) && (!(*should_quit_pointer))) {
-				num_handled_pages++;
-				fz_page* page = fz_load_page(mupdf_context, doc, i);
-
-				const int max_hits_per_page = 20;
-				fz_quad hitboxes[max_hits_per_page];
-                                int hit_mark[max_hits_per_page];
-				int num_results = fz_search_page(mupdf_context, page, utf8_encode(req.search_term).c_str(), hit_mark, hitboxes, max_hits_per_page);
-
-				if (num_results > 0) {
-					req.search_results_mutex->lock();
-					for (int j = 0; j < num_results; j++) {
-						if (hit_mark[j] == 1) {
-							// Hit box belongs to new entry
-							req.search_results->push_back(SearchResult{ std::vector<fz_rect>(), i });
-						}
-						req.search_results->back().rects.push_back(fz_rect_from_quad(hitboxes[j]));
-					}
-					req.search_results_mutex->unlock();
-				}
+		// helpers take the document from the pool for each search instead of keeping it, so they never search
+		// an outdated version of a document which was modified
+		fz_document* doc = document_handle_pool->acquire(mupdf_context, job->path);
+		if (doc != nullptr) {
+			while (search_next_job_page(mupdf_context, doc, *job)) {
+			}
+			document_handle_pool->release(mupdf_context, doc);
+		}
+	}
+	fz_drop_context(mupdf_context);
+}
 
-				if (num_handled_pages % 16 == 0) {
-					*req.percent_done = (float)num_handled_pages / num_pages;
-					//*invalidate_pointer = true;
-					emit search_advance();
-				}
+void PdfRenderer::run_mupdf_search(int thread_index, fz_context* mupdf_context, SearchRequest& req) {
+	// the document is taken from the pool for each search, so we never search an outdated version of a document
+	// which was modified
+	fz_document* doc = document_handle_pool->acquire(mupdf_context, req.path);
+	if (doc == nullptr) {
+		req.search_results_mutex->lock();
+		*req.is_searching = false;
+		req.search_results_mutex->unlock();
+		emit search_advance();
+		return;
+	}
 
-				total_results += num_results;
+	int num_pages_in_document = fz_count_pages(mupdf_context, doc);
 
-				fz_drop_page(mupdf_context, page);
+	int page_begin = 0;
+	int page_end = num_pages_in_document-1;
 
-				i++;
-				if (i > page_end) {
-					i = page_begin;
-				}
-			}
+	if (req.range) {
+		page_begin = req.range.value().first-1;
+		page_end = req.range.value().second-1;
+	}
+	// make sure page range is valid {
+	if (page_begin < 0) page_begin = 0;
+	if (page_begin > num_pages_in_document-1) page_begin = num_pages_in_document-1;
+	if (page_end < 0) page_end = 0;
+	if (page_end > num_pages_in_document-1) page_end = num_pages_in_document-1;
+	//}
+
+	int num_pages = page_end - page_begin + 1;
+
+	req.search_results_mutex->lock();
+	req.search_results->clear();
+	*req.is_searching = true;
+	req.search_results_mutex->unlock();
+
+	if (req.start_page > page_end || req.start_page < page_begin) {
+		req.start_page = page_begin;
+	}
+
+	std::shared_ptr<MupdfSearchJob> job = std::make_shared<MupdfSearchJob>();
+	job->path = req.path;
+	job->search_term = utf8_encode(req.search_term);
+	for (int i = 0; i < num_pages; i++) {
+		job->pages.push_back(page_begin + (req.start_page - page_begin + i) % num_pages);
+	}
+	job->page_results.resize(num_pages);
+
+	search_job_mutex.lock();
+	current_search_job = job;
+	search_job_mutex.unlock();
+	search_job_cv.notify_all();
+
+	// the search is stale when a new search is requested or it is cancelled
+	auto is_stale = [&]() {
+		std::lock_guard guard(search_request_mutex);
+		return pending_search_request.has_value() || is_search_cancelled || (*should_quit_pointer);
+	};
+
+	size_t num_reported_pages = 0;
+	while ((num_reported_pages < job->pages.size()) && (!is_stale())) {
+
+		// report the results of the pages which are searched, in order
+		std::vector<SearchResult> results;
+		size_t num_previously_reported_pages = num_reported_pages;
+		job->mutex.lock();
+		while ((num_reported_pages < job->pages.size()) && job->page_results[num_reported_pages].has_value()) {
+			std::vector<SearchResult>& page_results = job->page_results[num_reported_pages].value();
+			results.insert(results.end(), std::make_move_iterator(page_results.begin()), std::make_move_iterator(page_results.end()));
+			job->page_results[num_reported_pages] = {};
+			num_reported_pages++;
+		}
+		job->mutex.unlock();
+
+		if (num_reported_pages > num_previously_reported_pages) {
 			req.search_results_mutex->lock();
-			*req.is_searching = false;
-			//*invalidate_pointer = true;
-			//if (on_search_invalidate) {
-			//	on_search_invalidate();
-			//}
-			emit search_advance();
+			// checked while holding search_results_mutex, so we never add results after cancel_search cleared them
+			if (!is_stale()) {
+				req.search_results->insert(req.search_results->end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+				*req.percent_done = (float)num_reported_pages / num_pages;
+			}
 			req.search_results_mutex->unlock();
+
+			if ((results.size() > 0) || (num_reported_pages / 16 != num_previously_reported_pages / 16)) {
+				emit search_advance();
+			}
+			continue;
 		}
-		else{
-			sleep_ms(100);
+
+		// the search thread searches pages too, and when all the pages are taken it waits for the helpers
+		if (!search_next_job_page(mupdf_context, doc, *job)) {
+			std::unique_lock<std::mutex> job_lock(job->mutex);
+			job->page_searched_cv.wait_for(job_lock, std::chrono::milliseconds(50), [&]() {
+				return job->page_results[num_reported_pages].has_value();
+				});
 		}
 	}
+
+	// stop the helpers, they finish the pages they are searching and ignore the rest
+	job->mutex.lock();
+	job->is_cancelled = true;
+	job->mutex.unlock();
+	search_job_mutex.lock();
+	if (current_search_job == job) {
+		current_search_job = nullptr;
+	}
+	search_job_mutex.unlock();
+	document_handle_pool->release(mupdf_context, doc);
+
+	req.search_results_mutex->lock();
+	*req.is_searching = false;
+	//*invalidate_pointer = true;
+	//if (on_search_invalidate) {
+	//	on_search_invalidate();
+	//}
+	emit search_advance();
+	req.search_results_mutex->unlock();
 }
 
 PdfRenderer::~PdfRenderer() {
@@ -372,42 +967,81 @@ fz_document* PdfRenderer::get_document_with_path(int thread_index, fz_context* m
 
 	std::pair<int, std::wstring> document_id = std::make_pair(thread_index, path);
 
+	std::lock_guard guard(opened_documents_mutex);
 	if (opened_documents.find(document_id) != opened_documents.end()) {
 		return opened_documents.at(document_id);
 	}
 
-	fz_document* ret_val = nullptr;
-	fz_try(mupdf_context) {
-		ret_val = fz_open_document(mupdf_context, utf8_encode(path).c_str());
+	// workers keep their documents until they are invalidated, so they are taken from the pool only once
+	fz_document* ret_val = document_handle_pool->acquire(mupdf_context, path);
+	if (ret_val != nullptr) {
+		opened_documents[document_id] = ret_val;
+	}
+	return ret_val;
+}
 
-		if (fz_needs_password(mupdf_context, ret_val)) {
-			if (document_passwords.find(path) != document_passwords.end()) {
-				fz_authenticate_password(mupdf_context, ret_val, document_passwords[path].c_str());
-			}
+void PdfRenderer::release_documents(int thread_index, fz_context* mupdf_context) {
+	std::lock_guard guard(opened_documents_mutex);
+	for (auto it = opened_documents.begin(); it != opened_documents.end();) {
+		if (it->first.first == thread_index) {
+			document_handle_pool->release(mupdf_context, it->second);
+			it = opened_documents.erase(it);
+		}
+		else {
+			it++;
 		}
-
-		opened_documents[make_pair(thread_index, path)] = ret_val;
-	}
-	fz_catch(mupdf_context) {
-		std::wcout << "Error: could not open document" << std::endl;
 	}
-
-	return ret_val;
 }
 
-void PdfRenderer::delete_old_pixmaps(int thread_index, fz_context* mupdf_context) {
+void PdfRenderer::run_pixmap_tasks(int thread_index, fz_context* mupdf_context) {
 	// this function should only be called from the worker thread
 	pixmap_drop_mutex[thread_index].lock();
-	for (size_t i = 0; i < pixmaps_to_drop[thread_index].size(); i++) {
+	std::vector<TextureUploadBuffer*> buffers_to_fill = std::move(pixmaps_to_copy[thread_index]);
+	std::vector<fz_pixmap*> pixmaps = std::move(pixmaps_to_drop[thread_index]);
+	pixmaps_to_copy[thread_index].clear();
+	pixmaps_to_drop[thread_index].clear();
+	pixmap_drop_mutex[thread_index].unlock();
+
+	// the main thread doesn't touch the mapped storage of the buffers until they are filled
+	for (TextureUploadBuffer* upload_buffer : buffers_to_fill) {
+		memcpy(upload_buffer->data, upload_buffer->pixmap->samples, upload_buffer->num_bytes);
+	}
+	if (buffers_to_fill.size() > 0) {
+		pixmap_drop_mutex[thread_index].lock();
+		for (TextureUploadBuffer* upload_buffer : buffers_to_fill) {
+			upload_buffer->is_filled = true;
+		}
+		pixmap_drop_mutex[thread_index].unlock();
+		// the textures are created in the next frame
+		emit render_advance();
+	}
+
+	for (size_t i = 0; i < pixmaps.size(); i++) {
 		fz_try(mupdf_context) {
-			fz_drop_pixmap(mupdf_context, pixmaps_to_drop[thread_index][i]);
+			fz_drop_pixmap(mupdf_context, pixmaps[i]);
 		}
 		fz_catch(mupdf_context) {
 			std::wcout << "Error: could not drop pixmap" << std::endl;
 		}
 	}
-	pixmaps_to_drop[thread_index].clear();
-	pixmap_drop_mutex[thread_index].unlock();
+}
+
+bool PdfRenderer::has_pixmaps_to_drop(int thread_index) {
+	std::lock_guard guard(pixmap_drop_mutex[thread_index]);
+	return (pixmaps_to_drop[thread_index].size() > 0) || (pixmaps_to_copy[thread_index].size() > 0);
+}
+
+bool PdfRenderer::has_pixmaps_to_copy(int thread_index) {
+	std::lock_guard guard(pixmap_drop_mutex[thread_index]);
+	return pixmaps_to_copy[thread_index].size() > 0;
+}
+
+void PdfRenderer::wake_workers() {
+	// acquiring the mutex makes sure that a worker which has just checked its wait condition
+	// is already blocked on the condition variable and doesn't miss the notification
+	pending_requests_mutex.lock();
+	pending_requests_mutex.unlock();
+	pending_requests_cv.notify_all();
 }
 void PdfRenderer::clear_cache() {
 	delete_old_pages(false, true);
@@ -417,56 +1051,94 @@ void PdfRenderer::run(int thread_index) {
 	fz_context* mupdf_context  = init_context();
 
 	while (!(*should_quit_pointer)) {
-		pending_requests_mutex.lock();
+		std::unique_lock<std::mutex> pending_lock(pending_requests_mutex);
 
-		while (pending_render_requests.size() == 0) {
-			pending_requests_mutex.unlock();
-			delete_old_pixmaps(thread_index, mupdf_context);
-			if (*should_quit_pointer) break;
+		pending_requests_cv.wait(pending_lock, [&]() {
+			return (*should_quit_pointer) || (pending_render_requests.size() > 0) || has_pixmaps_to_drop(thread_index);
+			});
 
-			sleep_ms(100);
-			pending_requests_mutex.lock();
-		}
 		if (*should_quit_pointer) break;
+
+		if (has_pixmaps_to_copy(thread_index)) {
+			// the main thread is waiting for these pixmaps to create the textures of the displayed pages
+			pending_lock.unlock();
+			run_pixmap_tasks(thread_index, mupdf_context);
+			continue;
+		}
+
+		std::optional<RenderRequest> most_urgent = pop_most_urgent_request();
+
+		if (!most_urgent) {
+			pending_lock.unlock();
+			run_pixmap_tasks(thread_index, mupdf_context);
+			continue;
+		}
 		//cout << "worker thread running ... pending requests: " << pending_render_requests.size() << endl;
 
-		RenderRequest req = pending_render_requests[pending_render_requests.size() - 1];
+		RenderRequest req = most_urgent.value();
 
 		// if the request is already rendered, just return the previous result
 		cached_response_mutex.lock();
 
-		if (are_documents_invalidated) {
-			for (auto [_, document] : opened_documents) {
-				fz_drop_document(mupdf_context, document);
-			}
-			opened_documents.clear();
-			are_documents_invalidated = false;
+		if (are_documents_invalidated[thread_index]) {
+			// display lists reference the resources of their documents, so they should be dropped first
+			evict_display_lists(thread_index, mupdf_context, 0);
+			release_documents(thread_index, mupdf_context);
+			are_documents_invalidated[thread_index] = false;
 		}
 
-		bool is_already_rendered = false;
-		for (const auto& cached_rep : cached_responses) {
-			if ((cached_rep.request == req) && (cached_rep.invalid == false)) is_already_rendered = true;
-		}
+		RenderResponse* cached_rep = cached_responses.find(req);
+		bool is_already_rendered = (cached_rep != nullptr) && (cached_rep->invalid == false);
 		cached_response_mutex.unlock();
-		pending_render_requests.pop_back();
-		pending_requests_mutex.unlock();
+
+		if (!is_already_rendered) {
+			in_flight_requests[thread_index] = req;
+			render_cookies[thread_index] = fz_cookie{};
+		}
+		pending_lock.unlock();
 
 		if (!is_already_rendered) {
 
+			fz_pixmap* rendered_pixmap = nullptr;
+			fz_var(rendered_pixmap);
+
+			// previews are low resolution whole page images, so they can be loaded from the on-disk cache
+			// of the previous sessions which is much faster than rendering them
+			bool is_cacheable_on_disk = (page_image_cache != nullptr) && req.is_preview && (!req.is_tile());
+			std::optional<QImage> cached_image = {};
+			if (is_cacheable_on_disk) {
+				cached_image = page_image_cache->find(req.path, req.page, get_render_scale(req.zoom_level));
+			}
+
 			fz_try(mupdf_context) {
-				fz_matrix transform_matrix = fz_pre_scale(fz_identity, req.zoom_level * display_scale, req.zoom_level * display_scale);
-				fz_document* doc = get_document_with_path(thread_index, mupdf_context, req.path);
-				fz_pixmap* rendered_pixmap = nullptr;
-
-				//if (AUTO_EMBED_ANNOTATIONS) {
-				//	fz_page* page = fz_load_page(mupdf_context, doc, req.page);
-				//	rendered_pixmap = fz_new_pixmap_from_page_contents(mupdf_context, page, transform_matrix, fz_device_rgb(mupdf_context), 0);
-				//	fz_drop_page(mupdf_context, page);
-				//}
-				//else {
-				rendered_pixmap = fz_new_pixmap_from_page_number(mupdf_context, doc, req.page, transform_matrix, fz_device_rgb(mupdf_context), 0);
-				//}
+				if (cached_image) {
+					rendered_pixmap = qimage_to_pixmap(mupdf_context, cached_image.value());
+				}
+				else {
+					fz_document* doc = get_document_with_path(thread_index, mupdf_context, req.path);
+					rendered_pixmap = render_pixmap(thread_index, mupdf_context, doc, req, &render_cookies[thread_index]);
+				}
+			}
+			fz_catch(mupdf_context) {
+				std::cerr << "Error: could not render page" << std::endl;
+			}
 
+			pending_requests_mutex.lock();
+			in_flight_requests[thread_index] = {};
+			bool was_aborted = render_cookies[thread_index].abort != 0;
+			if (was_aborted) {
+				num_cancelled_requests++;
+			}
+			pending_requests_mutex.unlock();
+
+			if (was_aborted) {
+				// the page is going to be re-requested by the next frame if it is still needed
+				if (rendered_pixmap) {
+					fz_drop_pixmap(mupdf_context, rendered_pixmap);
+				}
+				emit render_advance();
+			}
+			else if (rendered_pixmap) {
 				RenderResponse resp;
 				resp.thread = thread_index;
 				resp.request = req;
@@ -476,24 +1148,212 @@ void PdfRenderer::run(int thread_index) {
 				resp.height = rendered_pixmap->h;
 				resp.texture = 0;
 				resp.invalid = false;
+				resp.num_bytes = static_cast<size_t>(rendered_pixmap->w) * rendered_pixmap->h * rendered_pixmap->n;
+
+				if (is_cacheable_on_disk && (!cached_image)) {
+					// the image is compressed and written to disk in the background
+					page_image_cache->insert(req.path, req.page, get_render_scale(req.zoom_level), pixmap_to_qimage(rendered_pixmap));
+				}
 
 				cached_response_mutex.lock();
-				cached_responses.push_back(resp);
+				RenderResponse* previous_resp = cached_responses.find(req);
+				if (previous_resp) {
+					// an invalidated response of this request is still in the cache, we can't free its texture
+					// in the worker thread, so we let the main thread's garbage collector free it
+					orphan_responses.push_back(*previous_resp);
+					cached_responses.erase(req);
+				}
+				cached_responses.insert(resp);
 				cached_response_mutex.unlock();
 
 				emit render_advance();
-
-			}
-			fz_catch(mupdf_context) {
-				std::cerr << "Error: could not render page" << std::endl;
 			}
 		}
 
 	}
+	release_documents(thread_index, mupdf_context);
+}
+
+bool PdfRenderer::is_request_stale(const RenderRequest& req) {
+	if (req.viewer == nullptr) {
+		return false;
+	}
+	auto last_finished = last_finished_frames.find(req.viewer);
+	// a later frame of the viewer was drawn without this page
+	return (last_finished != last_finished_frames.end()) && (last_finished->second > req.frame);
+}
+
+std::optional<RenderRequest> PdfRenderer::pop_most_urgent_request() {
+	// should be called with pending_requests_mutex locked
+
+	// requests that were not repeated in the last frame of their viewer are for pages that are no longer visible
+	size_t num_requests_before = pending_render_requests.size();
+	pending_render_requests.erase(std::remove_if(pending_render_requests.begin(), pending_render_requests.end(),
+		[&](const RenderRequest& req) {
+			return is_request_stale(req);
+		}), pending_render_requests.end());
+	num_cancelled_requests += num_requests_before - pending_render_requests.size();
+
+	if (pending_render_requests.size() == 0) {
+		return {};
+	}
+
+	auto most_urgent = std::min_element(pending_render_requests.begin(), pending_render_requests.end(), is_more_urgent);
+
+	RenderRequest res = *most_urgent;
+	pending_render_requests.erase(most_urgent);
+	return res;
+}
+
+fz_pixmap* PdfRenderer::render_pixmap(int thread_index, fz_context* mupdf_context, fz_document* doc, const RenderRequest& req, fz_cookie* cookie) {
+	/*
+	This is equivalent to fz_new_pixmap_from_page_number, except that it passes a cookie to mupdf
+	so that the render can be aborted from another thread, that it can render a single tile of the page
+	and that it renders from the (possibly cached) display list of the page. Returns nullptr if the
+	render was aborted before the page was interpreted.
+	*/
+	auto render_begin = std::chrono::steady_clock::now();
+
+	bool was_cached = false;
+	fz_display_list* display_list = get_display_list(thread_index, mupdf_context, doc, req, cookie, &was_cached);
+	if (display_list == nullptr) {
+		return nullptr;
+	}
+
+	float scale = get_render_scale(req.zoom_level);
+	fz_matrix transform_matrix = fz_pre_scale(fz_identity, scale, scale);
+
+	fz_device* device = nullptr;
+	fz_pixmap* pixmap = nullptr;
+	fz_var(device);
+	fz_var(pixmap);
+
+	fz_try(mupdf_context) {
+		fz_irect bbox = fz_round_rect(fz_transform_rect(fz_bound_display_list(mupdf_context, display_list), transform_matrix));
+
+		if (req.is_tile()) {
+			// the draw device clips the rendering to the bounds of the pixmap, so we only need to
+			// create a pixmap which covers the tile
+			fz_irect tile_bbox;
+			tile_bbox.x0 = bbox.x0 + req.tile_x * RENDER_TILE_SIZE;
+			tile_bbox.y0 = bbox.y0 + req.tile_y * RENDER_TILE_SIZE;
+			tile_bbox.x1 = tile_bbox.x0 + RENDER_TILE_SIZE;
+			tile_bbox.y1 = tile_bbox.y0 + RENDER_TILE_SIZE;
+			bbox = fz_intersect_irect(bbox, tile_bbox);
+		}
+		pixmap = fz_new_pixmap_with_bbox(mupdf_context, fz_device_rgb(mupdf_context), bbox, nullptr, 0);
+		fz_clear_pixmap_with_value(mupdf_context, pixmap, 0xff);
+
+		device = fz_new_draw_device(mupdf_context, transform_matrix, pixmap);
+		fz_run_display_list(mupdf_context, display_list, device, fz_identity, fz_infinite_rect, cookie);
+		fz_close_device(mupdf_context, device);
+	}
+	fz_always(mupdf_context) {
+		fz_drop_device(mupdf_context, device);
+		fz_drop_display_list(mupdf_context, display_list);
+	}
+	fz_catch(mupdf_context) {
+		fz_drop_pixmap(mupdf_context, pixmap);
+		fz_rethrow(mupdf_context);
+	}
+
+	long long render_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - render_begin).count();
+	if (was_cached) {
+		total_render_nanos_with_cached_list += render_nanos;
+	}
+	else {
+		total_render_nanos_without_cached_list += render_nanos;
+	}
+	return pixmap;
+}
+
+fz_display_list* PdfRenderer::get_display_list(int thread_index, fz_context* mupdf_context, fz_document* doc, const RenderRequest& req, fz_cookie* cookie, bool* was_cached) {
+	/*
+	Returns the display list of the requested page with a new reference which should be dropped by the caller.
+	Interpreting the content stream of a page is often much more expensive than rasterizing it, so we keep
+	the display lists of the recently rendered pages and when the page is rendered again at a different zoom
+	level (or its other tiles are rendered), we only need to replay the display list.
+	Returns nullptr if the interpretation was aborted using the cookie.
+	*/
+	DisplayListCache& cache = display_list_caches[thread_index];
+	auto key = std::make_pair(req.path, req.page);
+	unsigned int now = QDateTime::currentMSecsSinceEpoch();
+
+	auto cached = cache.display_lists.find(key);
+	if (cached != cache.display_lists.end()) {
+		*was_cached = true;
+		num_display_list_hits++;
+		cached->second.last_access_time = now;
+		return fz_keep_display_list(mupdf_context, cached->second.display_list);
+	}
+	*was_cached = false;
+	num_display_list_misses++;
+
+	fz_page* page = nullptr;
+	fz_device* device = nullptr;
+	fz_display_list* display_list = nullptr;
+	fz_var(page);
+	fz_var(device);
+	fz_var(display_list);
+
+	fz_try(mupdf_context) {
+		page = fz_load_page(mupdf_context, doc, req.page);
+		display_list = fz_new_display_list(mupdf_context, fz_bound_page(mupdf_context, page));
+		device = fz_new_list_device(mupdf_context, display_list);
+		fz_run_page(mupdf_context, page, device, fz_identity, cookie);
+		fz_close_device(mupdf_context, device);
+	}
+	fz_always(mupdf_context) {
+		fz_drop_device(mupdf_context, device);
+		fz_drop_page(mupdf_context, page);
+	}
+	fz_catch(mupdf_context) {
+		fz_drop_display_list(mupdf_context, display_list);
+		fz_rethrow(mupdf_context);
+	}
+
+	if (cookie->abort) {
+		// the display list is incomplete
+		fz_drop_display_list(mupdf_context, display_list);
+		return nullptr;
+	}
+
+	// each worker gets an equal share of the cached pages (but at least one when the cache is enabled)
+	size_t max_display_lists = DISPLAY_LIST_CACHE_PAGES > 0 ? std::max(DISPLAY_LIST_CACHE_PAGES / num_threads, 1) : 0;
+	if (max_display_lists > 0) {
+		CachedDisplayList cached_list;
+		cached_list.display_list = fz_keep_display_list(mupdf_context, display_list);
+		cached_list.last_access_time = now;
+
+		cache.display_lists[key] = cached_list;
+		num_display_lists++;
+
+		evict_display_lists(thread_index, mupdf_context, max_display_lists);
+	}
+	return display_list;
+}
+
+void PdfRenderer::evict_display_lists(int thread_index, fz_context* mupdf_context, size_t max_display_lists) {
+	// should only be called from the worker thread which owns the cache
+	DisplayListCache& cache = display_list_caches[thread_index];
+
+	while (cache.display_lists.size() > max_display_lists) {
+
+		auto least_recent = std::min_element(cache.display_lists.begin(), cache.display_lists.end(),
+			[](const auto& lhs, const auto& rhs) {
+				return lhs.second.last_access_time < rhs.second.last_access_time;
+			});
+
+		fz_drop_display_list(mupdf_context, least_recent->second.display_list);
+		num_display_lists--;
+		cache.display_lists.erase(least_recent);
+	}
 }
 
 void PdfRenderer::add_password(std::wstring path, std::string password) {
-	document_passwords[path] = password;
+	document_handle_pool->set_password(path, password);
+	// the pooled documents were opened without the password
+	document_handle_pool->invalidate(path);
 	delete_old_pages(true, false);
 }
 
@@ -507,6 +1367,149 @@ bool operator==(const RenderRequest& lhs, const RenderRequest& rhs) {
 	if (rhs.zoom_level != lhs.zoom_level) {
 		return false;
 	}
+	if ((rhs.tile_x != lhs.tile_x) || (rhs.tile_y != lhs.tile_y)) {
+		return false;
+	}
 	return true;
 }
 
+bool is_more_urgent(const RenderRequest& lhs, const RenderRequest& rhs) {
+	if (lhs.priority != rhs.priority) {
+		return lhs.priority < rhs.priority;
+	}
+	// previews are cheap and are displayed until the actual page is rendered
+	if (lhs.is_preview != rhs.is_preview) {
+		return lhs.is_preview;
+	}
+	// among the requests with the same priority, newer requests are more urgent
+	return lhs.request_time > rhs.request_time;
+}
+
+bool RenderRequest::is_tile() const {
+	return tile_x >= 0;
+}
+
+
+size_t RenderRequestHash::operator()(const RenderRequest& req) const {
+	size_t res = std::hash<std::wstring>()(req.path);
+	res ^= std::hash<int>()(req.page) + 0x9e3779b9 + (res << 6) + (res >> 2);
+	res ^= std::hash<float>()(req.zoom_level) + 0x9e3779b9 + (res << 6) + (res >> 2);
+	res ^= std::hash<int>()(req.tile_x * 65536 + req.tile_y) + 0x9e3779b9 + (res << 6) + (res >> 2);
+	return res;
+}
+
+RenderResponse* RenderCache::find(const RenderRequest& req, bool update_recency) {
+	auto it = responses.find(req);
+	if (it != responses.end()) {
+		if (update_recency) {
+			lru_list.splice(lru_list.begin(), lru_list, it->second.lru_position);
+		}
+		return &it->second.response;
+	}
+	return nullptr;
+}
+
+RenderResponse* RenderCache::find_closest(const std::wstring& path, int page, float zoom_level) {
+	auto path_it = zoom_index.find(path);
+	if (path_it == zoom_index.end()) {
+		return nullptr;
+	}
+	auto page_it = path_it->second.find(page);
+	if (page_it == path_it->second.end()) {
+		return nullptr;
+	}
+
+	// walk outwards from the requested zoom level in both directions and return the first
+	// response that is closer than all the responses on the other side
+	const std::map<float, RenderResponse*>& zoom_levels = page_it->second;
+	auto upper = zoom_levels.lower_bound(zoom_level);
+	auto lower = std::make_reverse_iterator(upper);
+
+	// responses which are neither uploaded nor rendered can not be displayed
+	auto is_usable = [](RenderResponse* resp) {
+		return (resp->texture != 0) || (resp->pixmap != nullptr);
+	};
+	while ((upper != zoom_levels.end()) && (!is_usable(upper->second))) upper++;
+	while ((lower != zoom_levels.rend()) && (!is_usable(lower->second))) lower++;
+
+	if (upper == zoom_levels.end()) {
+		return lower == zoom_levels.rend() ? nullptr : lower->second;
+	}
+	if (lower == zoom_levels.rend()) {
+		return upper->second;
+	}
+
+	// on ties, prefer the higher zoom level since downscaling looks better than upscaling
+	if ((upper->first - zoom_level) <= (zoom_level - lower->first)) {
+		return upper->second;
+	}
+	return lower->second;
+}
+
+RenderResponse* RenderCache::insert(const RenderResponse& resp) {
+	erase(resp.request);
+
+	lru_list.push_front(resp.request);
+	auto [it, _] = responses.insert({ resp.request, Entry{resp, lru_list.begin()} });
+	RenderResponse* inserted = &it->second.response;
+	if (!resp.request.is_tile()) {
+		zoom_index[resp.request.path][resp.request.page][resp.request.zoom_level] = inserted;
+	}
+	total_bytes += resp.num_bytes;
+	return inserted;
+}
+
+void RenderCache::erase(const RenderRequest& req) {
+	auto it = responses.find(req);
+	if (it == responses.end()) {
+		return;
+	}
+
+	auto path_it = zoom_index.find(req.path);
+	if ((!req.is_tile()) && (path_it != zoom_index.end())) {
+		auto page_it = path_it->second.find(req.page);
+		if (page_it != path_it->second.end()) {
+			page_it->second.erase(req.zoom_level);
+			if (page_it->second.size() == 0) {
+				path_it->second.erase(page_it);
+			}
+		}
+		if (path_it->second.size() == 0) {
+			zoom_index.erase(path_it);
+		}
+	}
+	total_bytes -= it->second.response.num_bytes;
+	lru_list.erase(it->second.lru_position);
+	responses.erase(it);
+}
+
+size_t RenderCache::size() const {
+	return responses.size();
+}
+
+size_t RenderCache::get_total_bytes() const {
+	return total_bytes;
+}
+
+std::vector<RenderResponse> RenderCache::evict(size_t budget_bytes, size_t num_protected, unsigned int protected_access_time) {
+	std::vector<RenderResponse> evicted;
+
+	while ((total_bytes > budget_bytes) && (lru_list.size() > num_protected)) {
+		RenderRequest req = lru_list.back();
+		RenderResponse& resp = responses.at(req).response;
+
+		// the rest of the list is even more recent than this one
+		if (resp.last_access_time >= protected_access_time) {
+			break;
+		}
+		evicted.push_back(resp);
+		erase(req);
+	}
+	return evicted;
+}
+
+void RenderCache::for_each(std::function<void(RenderResponse&)> f) {
+	for (auto& [_, entry] : responses) {
+		f(entry.response);
+	}
+}
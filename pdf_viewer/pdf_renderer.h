@@ -4,6 +4,8 @@
 #include <string>
 #include <mupdf/fitz.h>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <variant>
 #include <unordered_map>
 #include <map>
@@ -11,6 +13,7 @@
 #include <iostream>
 #include <functional>
 #include <thread>
+#include <memory>
 #include <unordered_map>
 #include <map>
 //#include <gl/glew.h>
@@ -18,16 +21,58 @@
 
 #include <qobject.h>
 #include <qtimer.h>
+#include <list>
 
 #include "book.h"
+#include "page_image_cache.h"
+#include "document_handle_pool.h"
 
 extern const int MAX_PENDING_REQUESTS;
 extern const unsigned int CACHE_INVALID_MILIES;
+extern const int RENDER_TILE_SIZE;
+extern const int TILED_RENDER_MIN_PAGE_PIXELS;
+extern const float PREVIEW_RENDER_SCALE;
+extern int RENDER_CACHE_MEGABYTES;
+extern int DISPLAY_LIST_CACHE_PAGES;
+extern const int NUM_TEXTURE_UPLOAD_BUFFERS;
+extern int TEXTURE_UPLOAD_MEGABYTES_PER_FRAME;
+extern int SEARCH_THREADS;
+
+/*
+	Render requests with smaller priority values are rendered first. Pages that are visible in the
+	main window are the most urgent, then the overview window, then the helper window, and
+	prefetched pages are only rendered when there is nothing else to do.
+*/
+enum class RenderPriority {
+	Visible = 0,
+	Overview = 1,
+	Helper = 2,
+	Prefetch = 3
+};
 
 struct RenderRequest {
 	std::wstring path;
 	int page;
 	float zoom_level;
+
+	// when rendering large pages (high zoom levels) we only render the visible RENDER_TILE_SIZE x RENDER_TILE_SIZE
+	// pixel tiles of the page, tile_x and tile_y are the column and row of the tile or -1 for the entire page
+	int tile_x = -1;
+	int tile_y = -1;
+
+	// scheduling information, these are not a part of the request's identity (see operator==)
+	RenderPriority priority = RenderPriority::Visible;
+	// the last time this request was made, newer requests are rendered first
+	unsigned int request_time = 0;
+	// the viewer and the frame which last made this request (see PdfRenderer::begin_frame). Requests which are
+	// not repeated in the next frame of their viewer are no longer visible and are stale. Requests made outside
+	// of a frame or by more than one viewer have no viewer and never become stale.
+	const void* viewer = nullptr;
+	long long frame = 0;
+	// low resolution previews are rendered before the other requests with the same priority
+	bool is_preview = false;
+
+	bool is_tile() const;
 };
 
 struct SearchRequest {
@@ -39,6 +84,47 @@ struct SearchRequest {
 	float* percent_done = nullptr;
 	bool* is_searching = nullptr;
 	std::optional<std::pair<int, int>> range;
+	// when set, this function is used instead of searching the pages with mupdf
+	IncrementalSearchFunction search_function = nullptr;
+};
+
+/*
+	A mupdf search which is shared between the search thread and the search helper threads. Each thread searches
+	the next unsearched page (in the order in which the results are shown) and the search thread reports the
+	results in that order as soon as all the previous pages are searched.
+*/
+struct MupdfSearchJob {
+	std::wstring path;
+	std::string search_term;
+	// the pages in the order in which their results are shown
+	std::vector<int> pages;
+
+	// the rest of the fields are guarded by `mutex`
+	std::mutex mutex;
+	// notified when a page is searched
+	std::condition_variable page_searched_cv;
+	size_t next_page_index = 0;
+	// the results of pages[i], or empty if it is not searched yet
+	std::vector<std::optional<std::vector<SearchResult>>> page_results;
+	bool is_cancelled = false;
+};
+
+/*
+	A pixel buffer object which the main thread maps and the worker which rendered `pixmap` fills, so the main thread
+	doesn't copy the pixmap itself. In a later frame the main thread unmaps the buffer and creates the texture from it.
+*/
+struct TextureUploadBuffer {
+	GLuint buffer = 0;
+	bool is_in_use = false;
+	// the response whose pixmap is copied into the buffer and the worker thread which rendered it
+	RenderRequest request;
+	int thread = -1;
+	fz_pixmap* pixmap = nullptr;
+	// the mapped storage of the buffer
+	void* data = nullptr;
+	size_t num_bytes = 0;
+	// set by the worker when it has copied the pixmap, guarded by PdfRenderer::pixmap_drop_mutex[thread]
+	bool is_filled = false;
 };
 
 struct RenderResponse {
@@ -49,10 +135,112 @@ struct RenderResponse {
 	int width = -1;
 	int height = -1;
 	GLuint texture = 0;
+	// the buffer which the pixmap is being copied into when its texture is being created
+	TextureUploadBuffer* upload_buffer = nullptr;
 	bool invalid = false;
+
+	// size of the pixmap (or the texture that replaces it) in bytes
+	size_t num_bytes = 0;
+
+	// whether this page was ever displayed (as opposed to only being prefetched)
+	bool was_displayed = false;
+};
+
+struct CachedDisplayList {
+	fz_display_list* display_list = nullptr;
+	unsigned int last_access_time = 0;
+};
+
+/*
+	Display lists of the pages recently rendered by a worker thread, indexed by (document path, page).
+	Since display lists can only be used with the context that created them, each worker has its own cache.
+	mupdf doesn't expose the size of a display list, so the cache is limited by the number of lists.
+*/
+struct DisplayListCache {
+	std::map<std::pair<std::wstring, int>, CachedDisplayList> display_lists;
+};
+
+struct RenderCacheStatistics {
+	size_t num_entries = 0;
+	size_t num_bytes = 0;
+	size_t budget_bytes = 0;
+	long long num_hits = 0;
+	long long num_misses = 0;
+	long long num_evictions = 0;
+	long long num_cancelled_requests = 0;
+
+	// number of times a page was (or was not) already rendered when it was first displayed
+	long long num_ready_on_first_display = 0;
+	long long num_not_ready_on_first_display = 0;
+	// number of the pages ready on first display which were rendered by prefetching
+	long long num_prefetched_pages_displayed = 0;
+
+	size_t num_display_lists = 0;
+	long long num_display_list_hits = 0;
+	long long num_display_list_misses = 0;
+};
+
+// texture uploads since the last call to PdfRenderer::take_upload_statistics
+struct TextureUploadStatistics {
+	long long num_uploads = 0;
+	long long num_deferred_uploads = 0;
+	size_t num_bytes = 0;
+	long long total_upload_nanos = 0;
 };
 
 bool operator==(const RenderRequest& lhs, const RenderRequest& rhs);
+// whether `lhs` should be rendered before `rhs`
+bool is_more_urgent(const RenderRequest& lhs, const RenderRequest& rhs);
+
+struct RenderRequestHash {
+	size_t operator()(const RenderRequest& req) const;
+};
+
+/*
+	Rendered pages are looked up once per visible page per frame, so instead of scanning a flat list
+	of responses we index them in two ways: an exact (path, page, zoom) hash map for the common case
+	and a per-(path, page) map sorted by zoom level which is used when the exact zoom level is not
+	rendered yet and we want to display the closest available zoom level instead.
+	The responses are also kept in a least recently used list along with their size in bytes, so that
+	we can evict the pages we are least likely to need when the cache grows beyond its memory budget.
+	This class is not thread-safe, it should be guarded by PdfRenderer::cached_response_mutex.
+*/
+class RenderCache {
+private:
+	struct Entry {
+		RenderResponse response;
+		std::list<RenderRequest>::iterator lru_position;
+	};
+
+	std::unordered_map<RenderRequest, Entry, RenderRequestHash> responses;
+	std::unordered_map<std::wstring, std::unordered_map<int, std::map<float, RenderResponse*>>> zoom_index;
+
+	// most recently used requests are at the front
+	std::list<RenderRequest> lru_list;
+	size_t total_bytes = 0;
+
+public:
+	// when `update_recency` is true, the response is marked as the most recently used one
+	RenderResponse* find(const RenderRequest& req, bool update_recency=false);
+
+	// returns the rendered response (which has a texture or a rendered pixmap) of `page` with the zoom level closest to `zoom_level`,
+	// tiles are not considered
+	RenderResponse* find_closest(const std::wstring& path, int page, float zoom_level);
+
+	RenderResponse* insert(const RenderResponse& resp);
+	void erase(const RenderRequest& req);
+	size_t size() const;
+	size_t get_total_bytes() const;
+
+	// removes least recently used responses until the cache fits in `budget_bytes`. The `num_protected` most
+	// recently used responses and the responses accessed after `protected_access_time` are never evicted
+	// because they are probably still visible on screen. Returns the evicted responses so that the caller
+	// can free their resources.
+	std::vector<RenderResponse> evict(size_t budget_bytes, size_t num_protected, unsigned int protected_access_time);
+
+	// calls `f` for every cached response, `f` should not modify the cache
+	void for_each(std::function<void(RenderResponse&)> f);
+};
 
 class PdfRenderer : public QObject{
 	Q_OBJECT
@@ -65,39 +253,136 @@ class PdfRenderer : public QObject{
 	fz_context* context_to_clone;
 
 	std::vector<std::vector<fz_pixmap*>> pixmaps_to_drop;
+	// the upload buffers which each worker should fill with the pixmaps it rendered, guarded by pixmap_drop_mutex
+	std::vector<std::vector<TextureUploadBuffer*>> pixmaps_to_copy;
+	// the documents each thread took from document_handle_pool, keyed by (thread index, path)
 	std::map<std::pair<int, std::wstring>, fz_document*> opened_documents;
+	std::mutex opened_documents_mutex;
 
 	std::vector<RenderRequest> pending_render_requests;
+	// the request each worker is currently rendering (if any) and the cookie which can be used to abort it,
+	// both are guarded by pending_requests_mutex
+	std::vector<std::optional<RenderRequest>> in_flight_requests;
+	std::vector<fz_cookie> render_cookies;
 	std::optional<SearchRequest> pending_search_request;
-	std::vector<RenderResponse> cached_responses;
+	// set when the current search is cancelled, guarded by search_request_mutex
+	bool is_search_cancelled = false;
+	RenderCache cached_responses;
+	// responses which were replaced by a newer render but whose resources are not freed yet
+	std::vector<RenderResponse> orphan_responses;
 	std::vector<std::thread> worker_threads;
 	std::thread search_thread;
+	std::vector<std::thread> search_helper_threads;
+
+	// the mupdf search which the helper threads should work on, guarded by search_job_mutex
+	std::shared_ptr<MupdfSearchJob> current_search_job;
+	std::mutex search_job_mutex;
+	std::condition_variable search_job_cv;
 
 	std::mutex pending_requests_mutex;
 	std::mutex search_request_mutex;
 	std::mutex cached_response_mutex;
 	std::vector<std::mutex> pixmap_drop_mutex;
 
+	// worker threads block on these instead of polling, they are notified when a new request is added,
+	// when there are pixmaps to drop or when the application is quitting
+	std::condition_variable pending_requests_cv;
+	std::condition_variable search_request_cv;
+
 	QTimer garbage_collect_timer;
 
 	bool* should_quit_pointer = nullptr;
-	bool are_documents_invalidated = false;
+	// set for all the worker threads when documents should be reloaded (e.g. because they were modified),
+	// guarded by cached_response_mutex
+	std::vector<bool> are_documents_invalidated;
+
+	std::vector<DisplayListCache> display_list_caches;
+
+	// low resolution previews are loaded from (and saved to) this on-disk cache, may be null
+	PageImageCache* page_image_cache = nullptr;
+	// the documents used by the worker and search threads are taken from (and returned to) this pool
+	DocumentHandlePool* document_handle_pool = nullptr;
 
 	int num_threads = 0;
 	float display_scale = 1.0f;
 
-	std::map<std::wstring, std::string> document_passwords;
+	// statistics used to measure the cost of cache lookups (printed when `debug` is enabled)
+	long long total_lookup_nanos = 0;
+	long long num_lookups = 0;
+
+	long long num_cache_hits = 0;
+	long long num_cache_misses = 0;
+	long long num_cache_evictions = 0;
+	long long num_cancelled_requests = 0;
+	long long num_ready_on_first_display = 0;
+	long long num_not_ready_on_first_display = 0;
+	long long num_prefetched_pages_displayed = 0;
+
+	// display list statistics, the render times are used to compare rendering a page from scratch with
+	// replaying its cached display list (printed when `debug` is enabled)
+	std::atomic<size_t> num_display_lists = 0;
+	std::atomic<long long> num_display_list_hits = 0;
+	std::atomic<long long> num_display_list_misses = 0;
+	std::atomic<long long> total_render_nanos_with_cached_list = 0;
+	std::atomic<long long> total_render_nanos_without_cached_list = 0;
+
+	// rendered pixmaps are uploaded into textures through these pixel buffer objects (see TextureUploadBuffer),
+	// created lazily in the main thread and never resized after that
+	std::vector<TextureUploadBuffer> upload_buffers;
+	bool are_upload_buffers_supported = true;
+
+	// number of bytes uploaded in the current frame, the uploads which don't fit in TEXTURE_UPLOAD_MEGABYTES_PER_FRAME
+	// are deferred to the next frames (only accessed from the main thread)
+	size_t frame_upload_bytes = 0;
+	bool has_deferred_uploads = false;
+	// set when the workers have pixmaps to drop or copy, they are woken at the end of the frame
+	bool has_pixmap_tasks = false;
+	TextureUploadStatistics upload_statistics;
+
+	// the viewer which is drawing the current frame (only accessed from the main thread)
+	const void* current_viewer = nullptr;
+	long long current_frame = 0;
+	// the last frame finished by each viewer, guarded by pending_requests_mutex
+	std::unordered_map<const void*, long long> last_finished_frames;
 
 	fz_context* init_context();
 	fz_document* get_document_with_path(int thread_index, fz_context* mupdf_context, std::wstring path);
-	GLuint try_closest_rendered_page(std::wstring doc_path, int page, float zoom_level, int* page_width, int* page_height);
-	void delete_old_pixmaps(int thread_index, fz_context* mupdf_context);
+	// returns the documents of the thread to the pool
+	void release_documents(int thread_index, fz_context* mupdf_context);
+	// copies the pixmaps of the upload buffers of the thread and then drops its old pixmaps, the copies are done
+	// first because the pixmaps of deleted responses may still be waiting to be copied
+	void run_pixmap_tasks(int thread_index, fz_context* mupdf_context);
+	bool has_pixmaps_to_drop(int thread_index);
+	bool has_pixmaps_to_copy(int thread_index);
+	void wake_workers();
 	void run(int thread_index);
+	// should be called with pending_requests_mutex locked
+	bool is_request_stale(const RenderRequest& req);
+	std::optional<RenderRequest> pop_most_urgent_request();
+	fz_pixmap* render_pixmap(int thread_index, fz_context* mupdf_context, fz_document* doc, const RenderRequest& req, fz_cookie* cookie);
+	fz_display_list* get_display_list(int thread_index, fz_context* mupdf_context, fz_document* doc, const RenderRequest& req, fz_cookie* cookie, bool* was_cached);
+	void evict_display_lists(int thread_index, fz_context* mupdf_context, size_t max_display_lists);
 	void run_search(int thread_index);
+	void run_search_helper();
+	void run_incremental_search(SearchRequest& req);
+	void run_mupdf_search(int thread_index, fz_context* mupdf_context, SearchRequest& req);
+	// searches the next unsearched page of `job`, returns false if there are no pages left
+	bool search_next_job_page(fz_context* mupdf_context, fz_document* doc, MupdfSearchJob& job);
+	void report_lookup_statistics();
+	void enqueue_request(RenderRequest req);
+	GLuint find_rendered_request(const RenderRequest& req, int* width, int* height);
+	GLuint get_response_texture(RenderResponse* resp);
+	// maps a free upload buffer and asks the worker which rendered the pixmap of `resp` to fill it,
+	// returns false if pixel buffer objects are not supported or all the buffers are in use
+	bool start_texture_upload(RenderResponse* resp);
+	// creates the textures of the upload buffers which the workers have filled
+	void finish_texture_uploads();
+	GLuint create_texture();
+	size_t get_upload_budget_bytes();
 
 public:
 
-	PdfRenderer(int num_threads, bool* should_quit_pointer, fz_context* context_to_clone, float display_scale);
+	PdfRenderer(int num_threads, bool* should_quit_pointer, fz_context* context_to_clone, float display_scale, DocumentHandlePool* document_handle_pool, PageImageCache* page_image_cache=nullptr);
 	~PdfRenderer();
 	void clear_cache();
 
@@ -105,7 +390,7 @@ public:
 	void join_threads();
 
 	//should only be called from the main thread
-	void add_request(std::wstring document_path, int page, float zoom_level);
+	void add_request(std::wstring document_path, int page, float zoom_level, RenderPriority priority=RenderPriority::Visible, bool is_preview=false);
 	void add_request(std::wstring document_path,
 		int page,
 		std::wstring term,
@@ -114,12 +399,38 @@ public:
 		bool* is_searching,
 		std::mutex* mut,
 		std::optional<std::pair<int,
-		int>> range = {});
+		int>> range = {},
+		IncrementalSearchFunction search_function = nullptr);
+	// stops the current search (if any), its results are not updated anymore
+	void cancel_search();
+
+	GLuint find_rendered_page(std::wstring path, int page, float zoom_level, int* page_width, int* page_height, RenderPriority priority=RenderPriority::Visible);
+	GLuint try_closest_rendered_page(std::wstring doc_path, int page, float zoom_level, int* page_width, int* page_height);
+	GLuint find_rendered_tile(std::wstring path, int page, float zoom_level, int tile_x, int tile_y, int* tile_width, int* tile_height, RenderPriority priority=RenderPriority::Visible);
 
-	GLuint find_rendered_page(std::wstring path, int page, float zoom_level, int* page_width, int* page_height);
+	// number of rendered pixels per document unit at `zoom_level`
+	float get_render_scale(float zoom_level);
+	// whether a page with the given dimensions is too large to be rendered in its entirety at `zoom_level`
+	bool should_render_tiled(float page_width, float page_height, float zoom_level);
+	// zoom level of the low resolution preview which is displayed while the page is being rendered at `zoom_level`
+	float get_preview_zoom_level(float page_width, float page_height, float zoom_level);
 	void delete_old_pages(bool force_all=false, bool invalidate_all=false);
+	RenderCacheStatistics get_cache_statistics();
+	size_t get_cache_budget_bytes();
+
+	// approximate size of the pixmap of a page with the given dimensions rendered at `zoom_level`
+	size_t estimate_render_bytes(float page_width, float page_height, float zoom_level);
 	void add_password(std::wstring path, std::string password);
 
+	// should be called from the main thread before and after `viewer` draws a frame. The pages requested
+	// during a frame are the pages visible in `viewer`, so when the frame ends, the requests of the previous
+	// frames of `viewer` which were not repeated are cancelled. begin_frame creates the textures of the pixmaps which
+	// the workers have copied into upload buffers. end_frame returns true if some of the textures were not uploaded
+	// because of the upload budget, in which case another frame should be drawn to upload them
+	void begin_frame(const void* viewer);
+	bool end_frame();
+	TextureUploadStatistics take_upload_statistics();
+
 signals:
 	void render_advance();
 	void search_advance();
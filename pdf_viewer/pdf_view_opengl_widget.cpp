@@ -2,6 +2,7 @@
 #include "path.h"
 #include <qcolor.h>
 #include <cmath>
+#include <algorithm>
 
 extern Path shader_path;
 extern float GAMMA;
@@ -34,6 +35,7 @@ extern float DISPLAY_RESOLUTION_SCALE;
 extern float KEYBOARD_SELECT_BACKGROUND_COLOR[4];
 extern float KEYBOARD_SELECT_TEXT_COLOR[4];
 extern bool ALPHABETIC_LINK_TAGS;
+extern bool DEBUG;
 
 GLfloat g_quad_vertex[] = {
 	-1.0f, -1.0f,
@@ -377,6 +379,9 @@ void PdfViewOpenGLWidget::render_highlight_document(GLuint program, int page, fz
 
 void PdfViewOpenGLWidget::paintGL() {
 
+	auto frame_begin = std::chrono::steady_clock::now();
+	pdf_renderer->begin_frame(this);
+
 	QPainter painter(this);
 	QTextOption option;
 
@@ -385,9 +390,45 @@ void PdfViewOpenGLWidget::paintGL() {
 
 	render(&painter);
 
+	if (pdf_renderer->end_frame()) {
+		// some of the rendered pages didn't fit in this frame's upload budget
+		update();
+	}
+
+	if (DEBUG) {
+		report_frame_statistics(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - frame_begin).count());
+	}
+
 	//painter.drawText(-100, -100, "1234567890");
 }
 
+void PdfViewOpenGLWidget::report_frame_statistics(long long frame_nanos) {
+	/*
+	Prints the average and maximum frame times along with the texture uploads in the last second,
+	which is useful to see the effect of texture_upload_megabytes_per_frame on stutters while scrolling.
+	*/
+	total_frame_nanos += frame_nanos;
+	max_frame_nanos = std::max(max_frame_nanos, frame_nanos);
+	num_frames++;
+
+	auto now = std::chrono::steady_clock::now();
+	if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_frame_report_time).count() < 1000) {
+		return;
+	}
+
+	TextureUploadStatistics upload_statistics = pdf_renderer->take_upload_statistics();
+	std::wcout << (is_helper ? L"helper " : L"") << L"frame time: " << (total_frame_nanos / num_frames) / 1000 << L" us average, "
+		<< max_frame_nanos / 1000 << L" us max (" << num_frames << L" frames), texture uploads: "
+		<< upload_statistics.num_uploads << L" (" << upload_statistics.num_bytes / 1024 << L" KB, "
+		<< upload_statistics.total_upload_nanos / 1000 << L" us), "
+		<< upload_statistics.num_deferred_uploads << L" deferred\n";
+
+	total_frame_nanos = 0;
+	max_frame_nanos = 0;
+	num_frames = 0;
+	last_frame_report_time = now;
+}
+
 PdfViewOpenGLWidget::PdfViewOpenGLWidget(DocumentView* document_view, PdfRenderer* pdf_renderer, ConfigManager* config_manager, bool is_helper, QWidget* parent) :
 	QOpenGLWidget(parent),
 	document_view(document_view),
@@ -410,10 +451,15 @@ PdfViewOpenGLWidget::PdfViewOpenGLWidget(DocumentView* document_view, PdfRendere
 }
 
 void PdfViewOpenGLWidget::cancel_search() {
+	// stop the search thread first, so it doesn't add results after we clear them
+	pdf_renderer->cancel_search();
+
+	search_results_mutex.lock();
 	search_results.clear();
 	current_search_result_index =-1;
 	is_searching = false;
 	is_search_cancelled = true;
+	search_results_mutex.unlock();
 }
 
 void PdfViewOpenGLWidget::handle_escape() {
@@ -526,7 +572,8 @@ void PdfViewOpenGLWidget::render_overview(OverviewState overview) {
 		docpos.page,
 		zoom_level,
 		nullptr,
-		nullptr);
+		nullptr,
+		RenderPriority::Overview);
 
 	fz_rect window_rect = get_overview_rect_pixel_perfect(
 		document_view->get_view_width(),
@@ -637,10 +684,95 @@ void PdfViewOpenGLWidget::render_overview(OverviewState overview) {
 
 }
 
+void PdfViewOpenGLWidget::prefetch_pages(const std::vector<int>& visible_pages) {
+	/*
+	Requests low priority renders for the pages that are likely to become visible soon. We look further
+	ahead when scrolling fast or after move_screens/move_pages jumps and stop when the prefetched pages
+	would not fit in the render cache anyway.
+	*/
+	if (visible_pages.size() == 0) return;
+
+	Document* doc = document_view->get_document();
+	float zoom_level = document_view->get_zoom_level();
+	float offset_y = document_view->get_offset_y();
+	qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+	float secs = static_cast<float>(now - last_prefetch_time) / 1000.0f;
+	if ((secs > 0) && (secs < 0.5f)) {
+		float current_velocity = (offset_y - last_prefetch_offset_y) / secs;
+		scroll_velocity = (scroll_velocity + current_velocity) / 2;
+	}
+	else {
+		scroll_velocity = 0;
+	}
+	float jump_amount = document_view->take_last_jump_amount();
+	if (jump_amount != 0) {
+		jump_lookahead = std::abs(jump_amount);
+	}
+	else if (offset_y != last_prefetch_offset_y) {
+		jump_lookahead /= 2;
+	}
+	if (offset_y != last_prefetch_offset_y) {
+		scroll_direction = offset_y > last_prefetch_offset_y ? 1 : -1;
+	}
+	last_prefetch_time = now;
+	last_prefetch_offset_y = offset_y;
+
+	// the distance we expect to move (in absolute document units) before the prefetched pages are needed
+	float lookahead = std::max(std::abs(scroll_velocity) * PREFETCH_LOOKAHEAD_SECONDS, jump_lookahead);
+
+	// leave half of the cache for the pages that are already rendered
+	size_t budget = pdf_renderer->get_cache_budget_bytes() / 2;
+	size_t used_bytes = 0;
+	for (int page : visible_pages) {
+		used_bytes += pdf_renderer->estimate_render_bytes(doc->get_page_width(page), doc->get_page_height(page), zoom_level);
+	}
+
+	int num_pages = doc->num_pages();
+	int min_prefetched_pages = std::max(PRERENDERED_PAGE_COUNT, 1);
+	int edge_page = scroll_direction > 0 ?
+		*std::max_element(visible_pages.begin(), visible_pages.end()) :
+		*std::min_element(visible_pages.begin(), visible_pages.end());
+
+	int num_prefetched = 0;
+	float prefetched_distance = 0;
+	for (int page = edge_page + scroll_direction; (page >= 0) && (page < num_pages); page += scroll_direction) {
+		if ((num_prefetched >= min_prefetched_pages) && (prefetched_distance >= lookahead)) break;
+		if (num_prefetched >= MAX_PREFETCHED_PAGES) break;
+
+		// pages which are rendered in tiles are only rendered when they become visible
+		if (pdf_renderer->should_render_tiled(doc->get_page_width(page), doc->get_page_height(page), zoom_level)) break;
+
+		size_t page_bytes = pdf_renderer->estimate_render_bytes(doc->get_page_width(page), doc->get_page_height(page), zoom_level);
+		if (used_bytes + page_bytes > budget) break;
+		used_bytes += page_bytes;
+
+		pdf_renderer->find_rendered_page(doc->get_path(),
+			page,
+			zoom_level,
+			nullptr,
+			nullptr,
+			RenderPriority::Prefetch);
+
+		prefetched_distance += doc->get_page_height(page);
+		num_prefetched++;
+	}
+}
+
 void PdfViewOpenGLWidget::render_page(int page_number) {
 
 	if (!valid_document()) return;
 
+	Document* doc = document_view->get_document();
+	float zoom_level = document_view->get_zoom_level();
+
+	// tiles are not rotated, so we render rotated pages in their entirety
+	if ((rotation_index == 0) && pdf_renderer->should_render_tiled(doc->get_page_width(page_number), doc->get_page_height(page_number), zoom_level)) {
+		render_page_tiles(page_number);
+		render_page_separator(page_number);
+		return;
+	}
+
 	int rendered_width = -1;
 	int rendered_height = -1;
 
@@ -648,7 +780,8 @@ void PdfViewOpenGLWidget::render_page(int page_number) {
 		page_number,
 		document_view->get_zoom_level(),
 		&rendered_width,
-		&rendered_height);
+		&rendered_height,
+		is_helper ? RenderPriority::Helper : RenderPriority::Visible);
 
 
 	if (rotation_index % 2 == 1) {
@@ -708,6 +841,121 @@ void PdfViewOpenGLWidget::render_page(int page_number) {
 	glBufferData(GL_ARRAY_BUFFER, sizeof(page_vertices), page_vertices, GL_DYNAMIC_DRAW);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
+	render_page_separator(page_number);
+}
+
+void PdfViewOpenGLWidget::render_page_tiles(int page_number) {
+	/*
+	Draws the visible tiles of a page which is too large to be rendered in its entirety. While the tiles
+	are being rendered, we draw a rendered version of the entire page with a lower zoom level (or request
+	a low resolution preview if there is none)
+	*/
+	Document* doc = document_view->get_document();
+	float zoom_level = document_view->get_zoom_level();
+	float page_width = doc->get_page_width(page_number);
+	float page_height = doc->get_page_height(page_number);
+	fz_rect page_rect = { 0, 0, page_width, page_height };
+
+#ifdef SIOYEK_QT6
+	float device_pixel_ratio = static_cast<float>(QGuiApplication::primaryScreen()->devicePixelRatio());
+#else
+	float device_pixel_ratio = QApplication::desktop()->devicePixelRatioF();
+#endif
+
+	if (DISPLAY_RESOLUTION_SCALE > 0) {
+		device_pixel_ratio *= DISPLAY_RESOLUTION_SCALE;
+	}
+
+	float page_vertices[4 * 2];
+	bind_program();
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glBindBuffer(GL_ARRAY_BUFFER, shared_gl_objects.uv_buffer_object);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(g_quad_uvs), g_quad_uvs, GL_DYNAMIC_DRAW);
+
+	int placeholder_width = -1;
+	int placeholder_height = -1;
+	GLuint placeholder_texture = pdf_renderer->try_closest_rendered_page(doc->get_path(), page_number, zoom_level, &placeholder_width, &placeholder_height);
+	if (placeholder_texture != 0) {
+		rect_to_quad(document_view->document_to_window_rect(page_number, page_rect), page_vertices);
+		glBindTexture(GL_TEXTURE_2D, placeholder_texture);
+		glBindBuffer(GL_ARRAY_BUFFER, shared_gl_objects.vertex_buffer_object);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(page_vertices), page_vertices, GL_DYNAMIC_DRAW);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	else {
+		pdf_renderer->add_request(doc->get_path(),
+			page_number,
+			pdf_renderer->get_preview_zoom_level(page_width, page_height, zoom_level),
+			is_helper ? RenderPriority::Helper : RenderPriority::Visible,
+			true);
+	}
+
+	// the part of the page that is visible in the window, in document coordinates
+	int view_width = document_view->get_view_width();
+	int view_height = document_view->get_view_height();
+	float accum_page_height = doc->get_accum_page_height(page_number);
+	AbsoluteDocumentPos absolute_top_left = document_view->window_to_absolute_document_pos({ 0, 0 });
+	AbsoluteDocumentPos absolute_bottom_right = document_view->window_to_absolute_document_pos({ view_width, view_height });
+
+	fz_rect visible_rect;
+	visible_rect.x0 = std::max(0.0f, page_width / 2 + absolute_top_left.x);
+	visible_rect.x1 = std::min(page_width, page_width / 2 + absolute_bottom_right.x);
+	visible_rect.y0 = std::max(0.0f, absolute_top_left.y - accum_page_height);
+	visible_rect.y1 = std::min(page_height, absolute_bottom_right.y - accum_page_height);
+
+	if ((visible_rect.x1 <= visible_rect.x0) || (visible_rect.y1 <= visible_rect.y0)) {
+		return;
+	}
+
+	float tile_document_size = RENDER_TILE_SIZE / pdf_renderer->get_render_scale(zoom_level);
+	int first_tile_x = static_cast<int>(visible_rect.x0 / tile_document_size);
+	int last_tile_x = static_cast<int>(visible_rect.x1 / tile_document_size);
+	int first_tile_y = static_cast<int>(visible_rect.y0 / tile_document_size);
+	int last_tile_y = static_cast<int>(visible_rect.y1 / tile_document_size);
+
+	for (int tile_y = first_tile_y; tile_y <= last_tile_y; tile_y++) {
+		for (int tile_x = first_tile_x; tile_x <= last_tile_x; tile_x++) {
+			if ((tile_x * tile_document_size >= page_width) || (tile_y * tile_document_size >= page_height)) {
+				continue;
+			}
+
+			int tile_width = -1;
+			int tile_height = -1;
+			GLuint texture = pdf_renderer->find_rendered_tile(doc->get_path(),
+				page_number,
+				zoom_level,
+				tile_x,
+				tile_y,
+				&tile_width,
+				&tile_height,
+				is_helper ? RenderPriority::Helper : RenderPriority::Visible);
+
+			if (texture == 0) continue;
+
+			fz_rect tile_rect;
+			tile_rect.x0 = tile_x * tile_document_size;
+			tile_rect.y0 = tile_y * tile_document_size;
+			tile_rect.x1 = std::min(page_width, tile_rect.x0 + tile_document_size);
+			tile_rect.y1 = std::min(page_height, tile_rect.y0 + tile_document_size);
+
+			fz_rect window_rect = document_view->document_to_window_rect_pixel_perfect(page_number,
+				tile_rect,
+				static_cast<int>(tile_width / device_pixel_ratio),
+				static_cast<int>(tile_height / device_pixel_ratio));
+			rect_to_quad(window_rect, page_vertices);
+
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glBindBuffer(GL_ARRAY_BUFFER, shared_gl_objects.vertex_buffer_object);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(page_vertices), page_vertices, GL_DYNAMIC_DRAW);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		}
+	}
+}
+
+void PdfViewOpenGLWidget::render_page_separator(int page_number) {
+	float page_vertices[4 * 2];
+
 	if (!is_presentation_mode()) {
 
 		// render page separator
@@ -754,8 +1002,11 @@ void PdfViewOpenGLWidget::render(QPainter* painter) {
 		return;
 	}
 
+	document_view->update_offset_for_page_dimension_changes();
+
 	std::vector<int> visible_pages;
 	document_view->get_visible_pages(document_view->get_view_height(), visible_pages);
+	document_view->get_document()->prefetch_stext_pages(visible_pages);
 
 	if (color_mode == ColorPalette::Dark) {
 		glClearColor(DARK_MODE_BACKGROUND_COLOR[0], DARK_MODE_BACKGROUND_COLOR[1], DARK_MODE_BACKGROUND_COLOR[2], 1.0f);
@@ -777,7 +1028,8 @@ void PdfViewOpenGLWidget::render(QPainter* painter) {
 				visible_page_number.value() + 1,
 				document_view->get_zoom_level(),
 				nullptr,
-				nullptr);
+				nullptr,
+				RenderPriority::Prefetch);
 		}
 		render_page(visible_page_number.value());
 	}
@@ -798,19 +1050,8 @@ void PdfViewOpenGLWidget::render(QPainter* painter) {
 				//}
 			}
 		}
-		// prerender pages
-		if (visible_pages.size() > 0) {
-			int num_pages = document_view->get_document()->num_pages();
-			int max_page = visible_pages[visible_pages.size() - 1];
-			for (int i = 1; i < (PRERENDERED_PAGE_COUNT + 1); i++) {
-				if (max_page + i < num_pages) {
-					pdf_renderer->find_rendered_page(document_view->get_document()->get_path(),
-						max_page + i,
-						document_view->get_zoom_level(),
-						nullptr,
-						nullptr);
-				}
-			}
+		if (!is_helper) {
+			prefetch_pages(visible_pages);
 		}
 	}
 
@@ -1076,25 +1317,38 @@ void PdfViewOpenGLWidget::search_text(const std::wstring& text, bool case_sensit
 	}
 
 	if (document_view->get_document()->is_super_fast_index_ready()) {
-		if (!text.empty()) {
-			int current_page = document_view->get_center_page_number();
-			std::vector<SearchResult> results;
-			if (regex) {
-				results = document_view->get_document()->search_regex(text, case_sensitive, current_page, min_page, max_page);
-			}
-			else {
-				results = document_view->get_document()->search_text(text, case_sensitive, current_page, min_page, max_page);
-			}
-			search_results = std::move(results);
-			is_searching = false;
-			is_search_cancelled = false;
-			percent_done = 1.0f;
+		if (text.empty()) {
+			cancel_search();
+			return;
 		}
+
+		Document* doc = document_view->get_document();
+		int current_page = document_view->get_center_page_number();
+		search_results_mutex.lock();
+		is_searching = true;
+		is_search_cancelled = false;
+		percent_done = 0.0f;
+		search_results_mutex.unlock();
+
+		// the index is searched in the search thread and the results are shown as they are found, starting from the
+		// current page. Starting a new search (e.g. when the query is edited) stops the previous one
+		pdf_renderer->add_request(
+			doc->get_path(),
+			current_page,
+			text,
+			&search_results,
+			&percent_done,
+			&is_searching,
+			&search_results_mutex,
+			range,
+			doc->make_incremental_search(text, regex, case_sensitive, current_page, min_page, max_page));
 	}
 	else {
 
+		search_results_mutex.lock();
 		is_searching = true;
 		is_search_cancelled = false;
+		search_results_mutex.unlock();
 
 		int current_page = document_view->get_center_page_number();
 		if (current_page >= 0) {
@@ -1112,6 +1366,32 @@ void PdfViewOpenGLWidget::search_text(const std::wstring& text, bool case_sensit
 	}
 }
 
+void PdfViewOpenGLWidget::search_words(const std::wstring& text, std::optional<std::pair<int, int>> range) {
+
+	if (!document_view) return;
+
+	// the word index is searched in sublinear time, so unlike search_text we don't need the search thread
+	cancel_search();
+
+	int min_page = -1;
+	int max_page = 2147483647;
+	if (range.has_value()) {
+		min_page = range.value().first;
+		max_page = range.value().second;
+	}
+
+	int current_page = document_view->get_center_page_number();
+	std::vector<SearchResult> results = document_view->get_document()->search_words(text, current_page, min_page, max_page);
+
+	search_results_mutex.lock();
+	search_results = std::move(results);
+	current_search_result_index = -1;
+	is_searching = false;
+	is_search_cancelled = false;
+	percent_done = 1.0f;
+	search_results_mutex.unlock();
+}
+
 void PdfViewOpenGLWidget::set_dark_mode(bool mode) {
 	if (mode == true) {
 		this->color_mode = ColorPalette::Dark;
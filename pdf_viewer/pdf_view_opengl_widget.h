@@ -11,6 +11,7 @@
 #include <optional>
 #include <utility>
 #include <memory>
+#include <chrono>
 
 #include <qapplication.h>
 #include <qpushbutton.h>
@@ -44,6 +45,9 @@
 #include "document_view.h"
 #include "path.h"
 
+extern const int MAX_PREFETCHED_PAGES;
+extern const float PREFETCH_LOOKAHEAD_SECONDS;
+
 
 
 struct OpenGLSharedResources {
@@ -156,6 +160,20 @@ private:
 
 	std::optional<fz_rect> selected_rectangle = {};
 
+	// used to estimate the scroll velocity and direction for prefetching
+	qint64 last_prefetch_time = 0;
+	float last_prefetch_offset_y = 0;
+	float scroll_velocity = 0;
+	int scroll_direction = 1;
+	// the distance of the last move_pages/move_screens jump, which decays when the view is moved by other means
+	float jump_lookahead = 0;
+
+	// frame time statistics which are printed when `debug` is enabled
+	long long total_frame_nanos = 0;
+	long long max_frame_nanos = 0;
+	int num_frames = 0;
+	std::chrono::steady_clock::time_point last_frame_report_time = std::chrono::steady_clock::now();
+
 	GLuint LoadShaders(Path vertex_file_path_, Path fragment_file_path_);
 protected: 
 	void initializeGL() override;
@@ -174,6 +192,10 @@ protected:
 	void disable_stencil();
 
 	void render_transparent_background();
+	void prefetch_pages(const std::vector<int>& visible_pages);
+	void render_page_tiles(int page_number);
+	void render_page_separator(int page_number);
+	void report_frame_statistics(long long frame_nanos);
 
 public:
 
@@ -212,6 +234,7 @@ public:
 	void render_page(int page_number);
 	bool get_is_searching(float* prog);
 	void search_text(const std::wstring& text, bool case_sensitive=true, bool regex=false, std::optional<std::pair<int, int>> range = {});
+	void search_words(const std::wstring& text, std::optional<std::pair<int, int>> range = {});
 	void set_dark_mode(bool mode);
 	void toggle_dark_mode();
 	void set_custom_color_mode(bool mode);
@@ -0,0 +1,56 @@
+#include "prefix_sum_tree.h"
+
+#include <algorithm>
+
+void PrefixSumTree::assign(const std::vector<float>& values) {
+	int n = static_cast<int>(values.size());
+	tree.assign(n + 1, 0.0);
+	for (int i = 1; i <= n; i++) {
+		tree[i] += values[i - 1];
+		int parent = i + (i & -i);
+		if (parent <= n) {
+			tree[parent] += tree[i];
+		}
+	}
+
+	highest_power_of_two = 1;
+	while (highest_power_of_two * 2 <= n) {
+		highest_power_of_two *= 2;
+	}
+}
+
+void PrefixSumTree::clear() {
+	tree.clear();
+	highest_power_of_two = 0;
+}
+
+int PrefixSumTree::size() const {
+	return std::max(static_cast<int>(tree.size()) - 1, 0);
+}
+
+void PrefixSumTree::add(int index, float delta) {
+	for (int i = index + 1; i < static_cast<int>(tree.size()); i += (i & -i)) {
+		tree[i] += delta;
+	}
+}
+
+float PrefixSumTree::prefix_sum(int index) const {
+	double res = 0;
+	for (int i = std::min(index, size()); i > 0; i -= (i & -i)) {
+		res += tree[i];
+	}
+	return static_cast<float>(res);
+}
+
+int PrefixSumTree::find_last_less(float value) const {
+	// the largest number of values whose sum is less than `value`, found by descending the implicit tree
+	int count = 0;
+	double remaining = value;
+	for (int step = highest_power_of_two; step > 0; step /= 2) {
+		if ((count + step <= size()) && (tree[count + step] < remaining)) {
+			count += step;
+			remaining -= tree[count];
+		}
+	}
+	return std::max(std::min(count, size() - 1), 0);
+}
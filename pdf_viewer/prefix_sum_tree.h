@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+
+/*
+	A Fenwick tree of non-negative values (e.g. the heights of the pages of a document) which supports changing a
+	value, computing the sum of the values before an index and finding the index containing a cumulative sum in
+	O(log n), so changing the height of a page doesn't require recomputing the accumulated heights of all the pages
+	after it.
+*/
+class PrefixSumTree {
+private:
+	// sums are accumulated in double so that many small updates don't accumulate rounding errors
+	std::vector<double> tree;
+	int highest_power_of_two = 0;
+
+public:
+	// replaces the values of the tree with `values` in O(n)
+	void assign(const std::vector<float>& values);
+	void clear();
+	int size() const;
+
+	void add(int index, float delta);
+
+	// the sum of the values in [0, index)
+	float prefix_sum(int index) const;
+
+	// the last index whose prefix sum is less than `value`, or 0 if there is no such index
+	int find_last_less(float value) const;
+};
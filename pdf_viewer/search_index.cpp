@@ -0,0 +1,704 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+#include <qstring.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SEARCH_INDEX_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static void append_utf16(std::u16string& output, uint32_t code_point, std::vector<int>* surrogate_positions) {
+	if (code_point > 0xFFFF && code_point <= 0x10FFFF) {
+		code_point -= 0x10000;
+		output.push_back(static_cast<char16_t>(0xD800 + (code_point >> 10)));
+		if (surrogate_positions) {
+			surrogate_positions->push_back(static_cast<int>(output.size()));
+		}
+		output.push_back(static_cast<char16_t>(0xDC00 + (code_point & 0x3FF)));
+	}
+	else {
+		output.push_back(static_cast<char16_t>(code_point));
+	}
+}
+
+std::u16string wstring_to_utf16(const std::wstring& str) {
+	std::u16string res;
+	res.reserve(str.size());
+	for (wchar_t c : str) {
+		// when wchar_t is 16 bits, the string is already UTF-16
+		append_utf16(res, static_cast<uint32_t>(c), nullptr);
+	}
+	return res;
+}
+
+/*
+	The normalized form of each character of the basic multilingual plane: its compatibility decomposition (which
+	expands ligatures, e.g. "ﬁ" -> "fi", and separates the diacritics from the letters, e.g. "é" -> "e" + U+0301)
+	without the diacritics and case folded. Only non-spacing marks are removed, the spacing and enclosing marks are
+	a part of the spelling in scripts like Devanagari, Bengali and Thai (e.g. vowel signs), so words which only
+	differ in them are different words. Normalizing each character using QString is too slow to be done for the
+	entire text of the document so we compute it once for all characters.
+*/
+struct NormalizationTable {
+	// the normalized form of character c is normalized_chars[first_normalized_chars[c]..first_normalized_chars[c + 1])
+	std::vector<int> first_normalized_chars;
+	std::u16string normalized_chars;
+};
+
+static NormalizationTable create_normalization_table() {
+	NormalizationTable table;
+	table.first_normalized_chars.reserve(0x10001);
+
+	for (int c = 0; c < 0x10000; c++) {
+		table.first_normalized_chars.push_back(static_cast<int>(table.normalized_chars.size()));
+
+		if (c < 0x80) {
+			table.normalized_chars.push_back(static_cast<char16_t>(((c >= 'A') && (c <= 'Z')) ? (c - 'A' + 'a') : c));
+			continue;
+		}
+		// surrogates are not valid characters by themselves
+		if ((c >= 0xD800) && (c <= 0xDFFF)) {
+			table.normalized_chars.push_back(static_cast<char16_t>(c));
+			continue;
+		}
+		// soft hyphens are only displayed at the end of lines, where they split a word into two
+		if (c == 0xAD) {
+			continue;
+		}
+
+		QString decomposed = QString(QChar(static_cast<char16_t>(c))).normalized(QString::NormalizationForm_KD);
+		for (QChar decomposed_char : decomposed) {
+			if (decomposed_char.category() == QChar::Mark_NonSpacing) {
+				continue;
+			}
+			QString folded = QString(decomposed_char).toCaseFolded();
+			for (QChar folded_char : folded) {
+				table.normalized_chars.push_back(folded_char.unicode());
+			}
+		}
+	}
+	table.first_normalized_chars.push_back(static_cast<int>(table.normalized_chars.size()));
+	return table;
+}
+
+static const NormalizationTable& get_normalization_table() {
+	static const NormalizationTable table = create_normalization_table();
+	return table;
+}
+
+static void append_normalized_char(const NormalizationTable& table, std::u16string& output, char16_t c) {
+	int begin = table.first_normalized_chars[c];
+	int end = table.first_normalized_chars[c + 1];
+	output.append(table.normalized_chars, begin, end - begin);
+}
+
+std::u16string normalize_utf16(const std::u16string& str) {
+	const NormalizationTable& table = get_normalization_table();
+	std::u16string res;
+	res.reserve(str.size());
+	for (char16_t c : str) {
+		append_normalized_char(table, res, c);
+	}
+	return res;
+}
+
+static int count_trailing_zeros(unsigned int x) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+// the code point which begins at text[position] and the number of code units it occupies
+static char32_t get_code_point(const std::u16string& text, size_t position, size_t* size) {
+	if (QChar::isHighSurrogate(text[position]) && (position + 1 < text.size()) && QChar::isLowSurrogate(text[position + 1])) {
+		*size = 2;
+		return QChar::surrogateToUcs4(text[position], text[position + 1]);
+	}
+	*size = 1;
+	return text[position];
+}
+
+static bool is_word_index_char(char32_t c) {
+	if (c == U'_') {
+		return true;
+	}
+	// spacing marks (e.g. devanagari vowel signs) are part of the words of their base characters
+	return QChar::isLetterOrNumber(c) || (QChar::category(c) == QChar::Mark_SpacingCombining);
+}
+
+// scripts which are written without spaces between words, each of their characters is indexed as a separate word
+static bool is_single_char_word(char32_t c) {
+	switch (QChar::script(c)) {
+	case QChar::Script_Han:
+	case QChar::Script_Hiragana:
+	case QChar::Script_Katakana:
+	case QChar::Script_Thai:
+	case QChar::Script_Lao:
+	case QChar::Script_Khmer:
+	case QChar::Script_Myanmar:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// the end of the word which begins at text[begin] (or `begin` if no word begins there), words end at `limit`
+static size_t get_word_end(const std::u16string& text, size_t begin, size_t limit) {
+	size_t size;
+	char32_t c = get_code_point(text, begin, &size);
+	if (!is_word_index_char(c)) {
+		return begin;
+	}
+	size_t end = begin + size;
+	if (!is_single_char_word(c)) {
+		while (end < limit) {
+			c = get_code_point(text, end, &size);
+			if (!is_word_index_char(c) || is_single_char_word(c)) {
+				break;
+			}
+			end += size;
+		}
+	}
+	return std::min(end, limit);
+}
+
+static void find_all_scalar(const char16_t* text, size_t begin, size_t text_size, const char16_t* query, size_t query_size, std::vector<int>& positions) {
+	for (size_t i = begin; i + query_size <= text_size; i++) {
+		if ((text[i] == query[0]) && (memcmp(text + i + 1, query + 1, (query_size - 1) * sizeof(char16_t)) == 0)) {
+			positions.push_back(static_cast<int>(i));
+		}
+	}
+}
+
+static void find_all_positions(const char16_t* text, size_t text_size, const char16_t* query, size_t query_size, std::vector<int>& positions) {
+	if ((query_size == 0) || (query_size > text_size)) {
+		return;
+	}
+
+	size_t i = 0;
+#ifdef SEARCH_INDEX_USE_SSE2
+	/*
+	Compares the first and the last characters of the query with 8 consecutive positions of the text at once
+	and only compares the rest of the query at the positions where both of them match. Since the first and the
+	last characters rarely match together, most of the text is skipped 8 characters at a time.
+	*/
+	const __m128i first = _mm_set1_epi16(static_cast<short>(query[0]));
+	const __m128i last = _mm_set1_epi16(static_cast<short>(query[query_size - 1]));
+
+	for (; i + query_size - 1 + 8 <= text_size; i += 8) {
+		__m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+		__m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + query_size - 1));
+		__m128i matches = _mm_and_si128(_mm_cmpeq_epi16(first, block_first), _mm_cmpeq_epi16(last, block_last));
+
+		// two bits for each matching position
+		unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(matches));
+		while (mask != 0) {
+			int bit = count_trailing_zeros(mask);
+			size_t position = i + bit / 2;
+			if ((query_size <= 2) || (memcmp(text + position + 1, query + 1, (query_size - 2) * sizeof(char16_t)) == 0)) {
+				positions.push_back(static_cast<int>(position));
+			}
+			mask &= ~(3u << bit);
+		}
+	}
+#endif
+	// the remaining positions (or all of them when SIMD is not available)
+	find_all_scalar(text, i, text_size, query, query_size, positions);
+}
+
+static uint16_t pack_coordinate(float value, float origin) {
+	float packed = std::round((value - origin) * SEARCH_INDEX_RECT_SCALE);
+	return static_cast<uint16_t>(std::clamp(packed, 0.0f, 65535.0f));
+}
+
+void SearchIndex::add_page(int page, const std::wstring& page_text, const std::vector<fz_rect>& page_rects) {
+	if (page_text.size() == 0) {
+		return;
+	}
+
+	fz_point origin = { page_rects[0].x0, page_rects[0].y0 };
+	for (const auto& rect : page_rects) {
+		origin.x = std::min(origin.x, rect.x0);
+		origin.y = std::min(origin.y, rect.y0);
+	}
+
+	page_numbers.push_back(page);
+	page_first_glyphs.push_back(static_cast<int>(glyph_rects.size()));
+	page_origins.push_back(origin);
+
+	for (size_t i = 0; i < page_text.size(); i++) {
+		append_utf16(text, static_cast<uint32_t>(page_text[i]), &surrogate_positions);
+
+		const fz_rect& rect = page_rects[i];
+		glyph_rects.push_back(PackedGlyphRect{
+			pack_coordinate(rect.x0, origin.x),
+			pack_coordinate(rect.y0, origin.y),
+			pack_coordinate(rect.x1, origin.x),
+			pack_coordinate(rect.y1, origin.y) });
+	}
+	update_normalized_text();
+}
+
+void SearchIndex::append(const SearchIndex& other) {
+	int position_offset = static_cast<int>(text.size());
+	int glyph_offset = static_cast<int>(glyph_rects.size());
+
+	int normalized_position_offset = static_cast<int>(normalized_text.size());
+
+	text.append(other.text);
+	normalized_text.append(other.normalized_text);
+	for (auto [normalized_position, difference] : other.normalized_offsets) {
+		push_normalized_offset(normalized_position + normalized_position_offset, difference + position_offset - normalized_position_offset);
+	}
+	num_normalized_units += other.num_normalized_units;
+	for (int position : other.surrogate_positions) {
+		surrogate_positions.push_back(position + position_offset);
+	}
+	page_numbers.insert(page_numbers.end(), other.page_numbers.begin(), other.page_numbers.end());
+	for (int first_glyph : other.page_first_glyphs) {
+		page_first_glyphs.push_back(first_glyph + glyph_offset);
+	}
+	page_origins.insert(page_origins.end(), other.page_origins.begin(), other.page_origins.end());
+	glyph_rects.insert(glyph_rects.end(), other.glyph_rects.begin(), other.glyph_rects.end());
+}
+
+void SearchIndex::push_normalized_offset(int normalized_position, int difference) {
+	if ((normalized_offsets.size() == 0) || (normalized_offsets.back().second != difference)) {
+		normalized_offsets.push_back(std::make_pair(normalized_position, difference));
+	}
+}
+
+void SearchIndex::update_normalized_text() {
+	const NormalizationTable& table = get_normalization_table();
+	for (; num_normalized_units < text.size(); num_normalized_units++) {
+		size_t first_normalized_position = normalized_text.size();
+		append_normalized_char(table, normalized_text, text[num_normalized_units]);
+		// all the characters of the expansion of a ligature map to the position of the ligature
+		for (size_t i = first_normalized_position; i < normalized_text.size(); i++) {
+			push_normalized_offset(static_cast<int>(i), static_cast<int>(num_normalized_units) - static_cast<int>(i));
+		}
+	}
+}
+
+int SearchIndex::get_normalized_text_position(int normalized_position) const {
+	auto it = std::upper_bound(normalized_offsets.begin(), normalized_offsets.end(), std::make_pair(normalized_position, INT_MAX));
+	if (it == normalized_offsets.begin()) {
+		return normalized_position;
+	}
+	return normalized_position + std::prev(it)->second;
+}
+
+int SearchIndex::get_normalized_position(int position) const {
+	// text positions of the normalized characters are increasing, so we can binary search the first one which is not before `position`
+	int low = 0;
+	int high = static_cast<int>(normalized_text.size());
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (get_normalized_text_position(mid) < position) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+int SearchIndex::get_glyph_end_position(int position) const {
+	if ((text[position] >= 0xD800) && (text[position] <= 0xDBFF) && (static_cast<size_t>(position) + 1 < text.size())) {
+		return position + 2;
+	}
+	return position + 1;
+}
+
+std::pair<int, int> SearchIndex::get_normalized_range_text_range(int normalized_begin, int normalized_end) const {
+	int begin_position = get_normalized_text_position(normalized_begin);
+	int end_position = get_glyph_end_position(get_normalized_text_position(normalized_end - 1));
+	// include the diacritics after the last character, which have no normalized characters
+	if (static_cast<size_t>(normalized_end) < normalized_text.size()) {
+		end_position = std::max(end_position, get_normalized_text_position(normalized_end));
+	}
+	return std::make_pair(begin_position, end_position);
+}
+
+void SearchIndex::find_all(const std::u16string& query, bool case_sensitive, std::vector<std::pair<int, int>>& matches, size_t begin, size_t end) const {
+	end = std::min(end, text.size());
+	if ((begin >= end) || (query.size() == 0)) {
+		return;
+	}
+
+	std::vector<int> positions;
+	if (case_sensitive) {
+		// matches which begin before `end` may end after it
+		size_t search_end = std::min(end + query.size() - 1, text.size());
+		find_all_positions(text.data() + begin, search_end - begin, query.data(), query.size(), positions);
+		for (int position : positions) {
+			int match_begin = position + static_cast<int>(begin);
+			matches.push_back(std::make_pair(match_begin, match_begin + static_cast<int>(query.size())));
+		}
+	}
+	else {
+		std::u16string normalized_query = normalize_utf16(query);
+		if (normalized_query.size() == 0) {
+			return;
+		}
+		size_t normalized_begin = get_normalized_position(static_cast<int>(begin));
+		size_t normalized_end = get_normalized_position(static_cast<int>(end));
+		if (normalized_begin >= normalized_end) {
+			return;
+		}
+		size_t search_end = std::min(normalized_end + normalized_query.size() - 1, normalized_text.size());
+		find_all_positions(normalized_text.data() + normalized_begin, search_end - normalized_begin, normalized_query.data(), normalized_query.size(), positions);
+
+		size_t num_previous_matches = matches.size();
+		for (int position : positions) {
+			int match_begin = position + static_cast<int>(normalized_begin);
+			std::pair<int, int> match = get_normalized_range_text_range(match_begin, match_begin + static_cast<int>(normalized_query.size()));
+			// multiple matches can begin inside the expansion of the same ligature
+			if ((matches.size() > num_previous_matches) && (matches.back() == match)) {
+				continue;
+			}
+			matches.push_back(match);
+		}
+	}
+}
+
+bool SearchIndex::matches_at(int position, const std::u16string& query, bool case_sensitive, int* end_position) const {
+	if ((position < 0) || (static_cast<size_t>(position) >= text.size()) || (query.size() == 0)) {
+		return false;
+	}
+
+	if (case_sensitive) {
+		if ((static_cast<size_t>(position) + query.size() > text.size()) || (text.compare(position, query.size(), query) != 0)) {
+			return false;
+		}
+		if (end_position) {
+			*end_position = position + static_cast<int>(query.size());
+		}
+		return true;
+	}
+
+	// the match can begin at any of the normalized characters of the glyph at `position`
+	int normalized_begin = get_normalized_position(position);
+	int normalized_end = get_normalized_position(get_glyph_end_position(position));
+	for (int i = normalized_begin; i < normalized_end; i++) {
+		if ((static_cast<size_t>(i) + query.size() <= normalized_text.size()) && (normalized_text.compare(i, query.size(), query) == 0)) {
+			if (end_position) {
+				*end_position = get_normalized_range_text_range(i, i + static_cast<int>(query.size())).second;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+void SearchIndex::clear() {
+	*this = SearchIndex();
+}
+
+const std::u16string& SearchIndex::get_text() const {
+	return text;
+}
+
+const std::u16string& SearchIndex::get_normalized_text() const {
+	return normalized_text;
+}
+
+WideCharIterator SearchIndex::begin() const {
+	return WideCharIterator(text.data());
+}
+
+WideCharIterator SearchIndex::end() const {
+	return WideCharIterator(text.data() + text.size());
+}
+
+size_t SearchIndex::size() const {
+	return text.size();
+}
+
+size_t SearchIndex::num_glyphs() const {
+	return glyph_rects.size();
+}
+
+int SearchIndex::get_glyph_index(int position) const {
+	// the number of extra code units (second halves of surrogate pairs) up to and including `position`
+	int num_surrogates = static_cast<int>(std::upper_bound(surrogate_positions.begin(), surrogate_positions.end(), position) - surrogate_positions.begin());
+	return position - num_surrogates;
+}
+
+int SearchIndex::get_glyph_position(int glyph_index) const {
+	// the second unit of the i'th surrogate pair belongs to glyph surrogate_positions[i] - i - 1, so the number of
+	// surrogate pairs before `glyph_index` is the number of i's where that glyph is before `glyph_index`
+	int low = 0;
+	int high = static_cast<int>(surrogate_positions.size());
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (surrogate_positions[mid] - mid - 1 < glyph_index) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return glyph_index + low;
+}
+
+int SearchIndex::get_page_index(int glyph_index) const {
+	int page_index = static_cast<int>(std::upper_bound(page_first_glyphs.begin(), page_first_glyphs.end(), glyph_index) - page_first_glyphs.begin()) - 1;
+	return std::max(page_index, 0);
+}
+
+int SearchIndex::get_glyph_page(int glyph_index) const {
+	if (page_numbers.size() == 0) {
+		return -1;
+	}
+	return page_numbers[get_page_index(glyph_index)];
+}
+
+fz_rect SearchIndex::get_glyph_rect(int glyph_index) const {
+	const fz_point& origin = page_origins[get_page_index(glyph_index)];
+	const PackedGlyphRect& packed = glyph_rects[glyph_index];
+
+	fz_rect res;
+	res.x0 = origin.x + packed.x0 / SEARCH_INDEX_RECT_SCALE;
+	res.y0 = origin.y + packed.y0 / SEARCH_INDEX_RECT_SCALE;
+	res.x1 = origin.x + packed.x1 / SEARCH_INDEX_RECT_SCALE;
+	res.y1 = origin.y + packed.y1 / SEARCH_INDEX_RECT_SCALE;
+	return res;
+}
+
+int SearchIndex::get_position_page(int position) const {
+	return get_glyph_page(get_glyph_index(position));
+}
+
+size_t SearchIndex::num_pages() const {
+	return page_numbers.size();
+}
+
+int SearchIndex::get_page_number(size_t page_index) const {
+	return page_numbers[page_index];
+}
+
+std::pair<int, int> SearchIndex::get_page_range(size_t page_index) const {
+	int begin_position = get_glyph_position(page_first_glyphs[page_index]);
+	int end_position = (page_index + 1 < page_first_glyphs.size()) ? get_glyph_position(page_first_glyphs[page_index + 1]) : static_cast<int>(text.size());
+	return std::make_pair(begin_position, end_position);
+}
+
+int SearchIndex::get_page_begin_position(int page) const {
+	size_t page_index = std::lower_bound(page_numbers.begin(), page_numbers.end(), page) - page_numbers.begin();
+	if (page_index >= page_numbers.size()) {
+		return static_cast<int>(text.size());
+	}
+	return get_glyph_position(page_first_glyphs[page_index]);
+}
+
+void SearchIndex::get_range_rects(int begin_position, int end_position, std::vector<fz_rect>& rects) const {
+	if (begin_position >= end_position) {
+		return;
+	}
+	int begin_glyph = get_glyph_index(begin_position);
+	int last_glyph = get_glyph_index(end_position - 1);
+	for (int i = begin_glyph; i <= last_glyph; i++) {
+		rects.push_back(get_glyph_rect(i));
+	}
+}
+
+size_t SearchIndex::get_memory_bytes() const {
+	return text.capacity() * sizeof(char16_t) +
+		normalized_text.capacity() * sizeof(char16_t) +
+		normalized_offsets.capacity() * sizeof(std::pair<int, int>) +
+		surrogate_positions.capacity() * sizeof(int) +
+		page_numbers.capacity() * sizeof(int) +
+		page_first_glyphs.capacity() * sizeof(int) +
+		page_origins.capacity() * sizeof(fz_point) +
+		glyph_rects.capacity() * sizeof(PackedGlyphRect);
+}
+
+void WordIndex::build(const SearchIndex& index) {
+	clear();
+
+	// words are indexed in the normalized text, so they match regardless of case, diacritics and ligatures
+	const std::u16string& text = index.get_normalized_text();
+	std::unordered_map<std::u16string, std::vector<int>> word_occurrences;
+
+	// there is no separator between the text of consecutive pages, so words also end at page boundaries
+	std::vector<size_t> page_end_positions;
+	for (size_t page_index = 0; page_index < index.num_pages(); page_index++) {
+		page_end_positions.push_back(index.get_normalized_position(index.get_page_range(page_index).second));
+	}
+	size_t current_page_index = 0;
+
+	size_t i = 0;
+	while (i < text.size()) {
+		while (page_end_positions[current_page_index] <= i) {
+			current_page_index++;
+		}
+		size_t word_end = get_word_end(text, i, page_end_positions[current_page_index]);
+		if (word_end == i) {
+			i++;
+			continue;
+		}
+		word_occurrences[text.substr(i, word_end - i)].push_back(static_cast<int>(i));
+		i = word_end;
+	}
+
+	words.reserve(word_occurrences.size());
+	for (const auto& [word, _] : word_occurrences) {
+		words.push_back(word);
+	}
+	std::sort(words.begin(), words.end());
+
+	word_first_occurrences.reserve(words.size() + 1);
+	for (const auto& word : words) {
+		const std::vector<int>& word_positions = word_occurrences[word];
+		word_first_occurrences.push_back(static_cast<int>(occurrences.size()));
+		occurrences.insert(occurrences.end(), word_positions.begin(), word_positions.end());
+	}
+	word_first_occurrences.push_back(static_cast<int>(occurrences.size()));
+}
+
+void WordIndex::clear() {
+	*this = WordIndex();
+}
+
+size_t WordIndex::num_words() const {
+	return words.size();
+}
+
+void WordIndex::get_occurrences(size_t first_word, size_t last_word, std::vector<std::pair<int, int>>& matches) const {
+	size_t num_previous_matches = matches.size();
+	for (size_t i = first_word; i < last_word; i++) {
+		int word_size = static_cast<int>(words[i].size());
+		for (int j = word_first_occurrences[i]; j < word_first_occurrences[i + 1]; j++) {
+			matches.push_back(std::make_pair(occurrences[j], occurrences[j] + word_size));
+		}
+	}
+	// the occurrences of each word are sorted, but we have to merge the occurrences of different words
+	if (last_word > first_word + 1) {
+		std::sort(matches.begin() + num_previous_matches, matches.end());
+	}
+}
+
+void WordIndex::find_word(const std::u16string& word, std::vector<std::pair<int, int>>& matches) const {
+	auto it = std::lower_bound(words.begin(), words.end(), word);
+	if ((it != words.end()) && (*it == word)) {
+		size_t word_index = it - words.begin();
+		get_occurrences(word_index, word_index + 1, matches);
+	}
+}
+
+void WordIndex::find_prefix(const std::u16string& prefix, std::vector<std::pair<int, int>>& matches) const {
+	auto first = std::lower_bound(words.begin(), words.end(), prefix);
+	auto last = first;
+	while ((last != words.end()) && (last->compare(0, prefix.size(), prefix) == 0)) {
+		last++;
+	}
+	get_occurrences(first - words.begin(), last - words.begin(), matches);
+}
+
+void WordIndex::search(const std::wstring& query, const SearchIndex& index, std::vector<std::pair<int, int>>& matches) const {
+	std::u16string normalized_query = normalize_utf16(wstring_to_utf16(query));
+
+	std::vector<std::vector<std::pair<int, int>>> term_matches;
+	size_t i = 0;
+	while (i < normalized_query.size()) {
+		size_t term_begin = i;
+		i = get_word_end(normalized_query, term_begin, normalized_query.size());
+		if (i == term_begin) {
+			i++;
+			continue;
+		}
+
+		term_matches.emplace_back();
+		size_t size;
+		if (is_single_char_word(get_code_point(normalized_query, term_begin, &size))) {
+			// the words of these scripts are single characters, so a run of them is searched as a substring of the text
+			while ((i < normalized_query.size()) && is_single_char_word(get_code_point(normalized_query, i, &size))) {
+				i += size;
+			}
+			index.find_all(normalized_query.substr(term_begin, i - term_begin), false, term_matches.back());
+		}
+		else {
+			std::u16string term = normalized_query.substr(term_begin, i - term_begin);
+			if ((i < normalized_query.size()) && (normalized_query[i] == u'*')) {
+				find_prefix(term, term_matches.back());
+			}
+			else {
+				find_word(term, term_matches.back());
+			}
+			for (auto& match : term_matches.back()) {
+				match = index.get_normalized_range_text_range(match.first, match.second);
+			}
+		}
+
+		// no page can contain all the terms
+		if (term_matches.back().size() == 0) {
+			return;
+		}
+	}
+
+	if (term_matches.size() == 0) {
+		return;
+	}
+
+	// intersect the pages of the terms, starting with the term with the fewest occurrences
+	std::sort(term_matches.begin(), term_matches.end(), [](const auto& lhs, const auto& rhs) {
+		return lhs.size() < rhs.size();
+		});
+
+	auto get_pages = [&](const std::vector<std::pair<int, int>>& term_occurrences) {
+		std::vector<int> pages;
+		for (auto [begin, end] : term_occurrences) {
+			int page = index.get_position_page(begin);
+			if ((pages.size() == 0) || (pages.back() != page)) {
+				pages.push_back(page);
+			}
+		}
+		return pages;
+	};
+
+	std::vector<int> common_pages = get_pages(term_matches[0]);
+	for (size_t j = 1; (j < term_matches.size()) && (common_pages.size() > 0); j++) {
+		std::vector<int> term_pages = get_pages(term_matches[j]);
+		std::vector<int> intersection;
+		std::set_intersection(common_pages.begin(), common_pages.end(), term_pages.begin(), term_pages.end(), std::back_inserter(intersection));
+		common_pages = std::move(intersection);
+	}
+
+	size_t num_previous_matches = matches.size();
+	for (const auto& term_occurrences : term_matches) {
+		for (auto match : term_occurrences) {
+			if (std::binary_search(common_pages.begin(), common_pages.end(), index.get_position_page(match.first))) {
+				matches.push_back(match);
+			}
+		}
+	}
+	std::sort(matches.begin() + num_previous_matches, matches.end());
+	// the same occurrence can match multiple terms (e.g. `word` and `wo*`)
+	matches.erase(std::unique(matches.begin() + num_previous_matches, matches.end()), matches.end());
+}
+
+size_t WordIndex::get_memory_bytes() const {
+	size_t res = words.capacity() * sizeof(std::u16string) +
+		word_first_occurrences.capacity() * sizeof(int) +
+		occurrences.capacity() * sizeof(int);
+	for (const auto& word : words) {
+		res += word.capacity() * sizeof(char16_t);
+	}
+	return res;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+#include <mupdf/fitz.h>
+
+// glyph rects are stored relative to the origin of their page in fixed point with this many steps per document unit
+const float SEARCH_INDEX_RECT_SCALE = 4.0f;
+
+struct PackedGlyphRect {
+	uint16_t x0;
+	uint16_t y0;
+	uint16_t x1;
+	uint16_t y1;
+};
+
+/*
+	A bidirectional iterator which reads UTF-16 code units as wchar_t, so that the UTF-16 text of the search index
+	can be searched using std::wregex on platforms where wchar_t is 32 bits.
+*/
+class WideCharIterator {
+private:
+	const char16_t* position = nullptr;
+
+public:
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = wchar_t;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const wchar_t*;
+	using reference = wchar_t;
+
+	WideCharIterator() {}
+	explicit WideCharIterator(const char16_t* position) : position(position) {}
+
+	wchar_t operator*() const { return static_cast<wchar_t>(*position); }
+	WideCharIterator& operator++() { position++; return *this; }
+	WideCharIterator operator++(int) { WideCharIterator res = *this; position++; return res; }
+	WideCharIterator& operator--() { position--; return *this; }
+	WideCharIterator operator--(int) { WideCharIterator res = *this; position--; return res; }
+	bool operator==(const WideCharIterator& other) const { return position == other.position; }
+	bool operator!=(const WideCharIterator& other) const { return position != other.position; }
+	const char16_t* get() const { return position; }
+};
+
+/*
+	The text of all the pages of a document along with the page and the rect of each glyph, used for super fast search.
+	Instead of storing a wchar_t, a page number and an fz_rect for each glyph (~24 bytes per glyph) we store:
+	- the text in UTF-16, along with the positions of the surrogate pairs which are used to map the
+	  positions in the text (code units) to glyph indices
+	- the index of the first glyph of each page instead of the page of each glyph
+	- the rects of glyphs relative to the top left of their page in 16 bit fixed point
+	- a normalized copy of the text, so case insensitive search doesn't have to normalize every character
+	which is ~12 bytes per glyph. The rects are only decoded for the matched ranges.
+*/
+class SearchIndex {
+private:
+	std::u16string text;
+
+	/*
+	The text used for case insensitive search: case folded, without diacritics and with ligatures expanded (see
+	normalize_utf16), so its positions are not the same as the positions of `text`. Each entry of normalized_offsets is
+	(normalized position, position in `text` - normalized position) for the normalized positions where the difference
+	changes, which is rare, so mapping the matches back to the text doesn't need a position for every character.
+	*/
+	std::u16string normalized_text;
+	std::vector<std::pair<int, int>> normalized_offsets;
+	// the number of code units at the beginning of `text` which are normalized
+	size_t num_normalized_units = 0;
+
+	// positions of the second code unit of surrogate pairs, these positions belong to the same glyph as the previous position
+	std::vector<int> surrogate_positions;
+
+	std::vector<int> page_numbers;
+	std::vector<int> page_first_glyphs;
+	std::vector<fz_point> page_origins;
+
+	std::vector<PackedGlyphRect> glyph_rects;
+
+	int get_page_index(int glyph_index) const;
+	void update_normalized_text();
+	void push_normalized_offset(int normalized_position, int difference);
+	// the position after the glyph at `position`
+	int get_glyph_end_position(int position) const;
+
+	friend bool save_document_index(const class Path& index_file_path, const std::wstring& document_path, int flags, const struct DocumentIndex& index);
+	friend bool load_document_index(const class Path& index_file_path, const std::wstring& document_path, int flags, struct DocumentIndex& index);
+
+public:
+	// appends the glyphs of `page`, `page_text` and `page_rects` should have the same size
+	void add_page(int page, const std::wstring& page_text, const std::vector<fz_rect>& page_rects);
+	void append(const SearchIndex& other);
+	void clear();
+
+	const std::u16string& get_text() const;
+	const std::u16string& get_normalized_text() const;
+	WideCharIterator begin() const;
+	WideCharIterator end() const;
+	size_t size() const;
+	size_t num_glyphs() const;
+
+	/*
+		The [begin, end) positions of all (possibly overlapping) occurrences of `query` which begin in text[begin, end),
+		in increasing order. Case insensitive search is done on the normalized text, so the size of a match may differ
+		from the size of the query (e.g. "file" matches "ﬁle").
+	*/
+	void find_all(const std::u16string& query, bool case_sensitive, std::vector<std::pair<int, int>>& matches, size_t begin = 0, size_t end = std::u16string::npos) const;
+	// whether an occurrence of `query` begins at `position`, in which case its end is stored in `end_position`,
+	// when !case_sensitive `query` should already be normalized
+	bool matches_at(int position, const std::u16string& query, bool case_sensitive, int* end_position = nullptr) const;
+
+	// converts a position in the text to the first normalized position which is not before it and vice versa
+	int get_normalized_position(int position) const;
+	int get_normalized_text_position(int normalized_position) const;
+	// the range of the text whose normalization contains normalized_text[normalized_begin, normalized_end)
+	std::pair<int, int> get_normalized_range_text_range(int normalized_begin, int normalized_end) const;
+
+	// converts a position in the text to the index of its glyph
+	int get_glyph_index(int position) const;
+	// converts the index of a glyph to the position of its first code unit in the text
+	int get_glyph_position(int glyph_index) const;
+	int get_glyph_page(int glyph_index) const;
+	fz_rect get_glyph_rect(int glyph_index) const;
+
+	// the number of pages which have text, the page number of the i'th one and the [begin, end) positions of its text
+	size_t num_pages() const;
+	int get_page_number(size_t page_index) const;
+	std::pair<int, int> get_page_range(size_t page_index) const;
+
+	// the position of the first glyph of the first page which is not before `page` (or the size of the text if there is no such page)
+	int get_page_begin_position(int page) const;
+
+	// the page and the glyph rects of the text in [begin_position, end_position)
+	int get_position_page(int position) const;
+	void get_range_rects(int begin_position, int end_position, std::vector<fz_rect>& rects) const;
+
+	// approximate memory used by the index
+	size_t get_memory_bytes() const;
+};
+
+/*
+	An inverted index of the words of a SearchIndex which maps each (normalized) word to the positions of its
+	occurrences in the normalized text, so whole word, prefix and multi-word queries don't have to scan the text.
+	The pages and rects of the occurrences are looked up in the SearchIndex.
+*/
+class WordIndex {
+private:
+	// sorted unique words
+	std::vector<std::u16string> words;
+	// the occurrences of words[i] are occurrences[word_first_occurrences[i]..word_first_occurrences[i + 1]), in increasing order
+	std::vector<int> word_first_occurrences;
+	std::vector<int> occurrences;
+
+	// appends the [begin, end) positions of the occurrences of the words in [first_word, last_word)
+	void get_occurrences(size_t first_word, size_t last_word, std::vector<std::pair<int, int>>& matches) const;
+
+public:
+	void build(const SearchIndex& index);
+	void clear();
+
+	size_t num_words() const;
+
+	// the [begin, end) normalized positions of the occurrences of `word` (or of all the words starting with `prefix`), in increasing order
+	void find_word(const std::u16string& word, std::vector<std::pair<int, int>>& matches) const;
+	void find_prefix(const std::u16string& prefix, std::vector<std::pair<int, int>>& matches) const;
+
+	/*
+		Finds the pages which contain all the terms of `query` and appends the [begin, end) text positions of the
+		occurrences of the terms in those pages to `matches`, in increasing order. Terms are separated by non-word characters and terms ending with `*` match
+		all the words starting with the term. Scripts without spaces between words (e.g. CJK and thai) are indexed one character per word and
+		runs of them in the query are searched as substrings.
+	*/
+	void search(const std::wstring& query, const SearchIndex& index, std::vector<std::pair<int, int>>& matches) const;
+
+	size_t get_memory_bytes() const;
+};
+
+std::u16string wstring_to_utf16(const std::wstring& str);
+// case folds `str`, removes its diacritics and soft hyphens and expands its ligatures and other compatibility characters
+std::u16string normalize_utf16(const std::u16string& str);
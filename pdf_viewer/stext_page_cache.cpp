@@ -0,0 +1,321 @@
+#include "stext_page_cache.h"
+
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+
+StextPageCache::StextPageCache(fz_context* context, const std::wstring& file_name, DocumentHandlePool* document_handle_pool) :
+	context(context),
+	file_name(file_name),
+	document_handle_pool(document_handle_pool)
+{
+}
+
+StextPageCache::~StextPageCache() {
+	if (prefetch_thread.has_value()) {
+		prefetch_mutex.lock();
+		should_quit = true;
+		prefetch_mutex.unlock();
+		prefetch_cv.notify_all();
+		prefetch_thread.value().join();
+	}
+	clear();
+}
+
+void StextPageCache::drop(CachedStextPage& cached_page) {
+	fz_drop_stext_page(context, cached_page.stext_page);
+	cached_page.stext_page = nullptr;
+}
+
+fz_stext_page* StextPageCache::find(int page) {
+	insert_prefetched_pages();
+
+	auto entry = page_entries.find(page);
+	if (entry == page_entries.end()) {
+		num_misses++;
+		return nullptr;
+	}
+	num_hits++;
+	lru_pages.splice(lru_pages.begin(), lru_pages, entry->second);
+	return entry->second->stext_page;
+}
+
+void StextPageCache::insert(int page, fz_stext_page* stext_page) {
+	auto entry = page_entries.find(page);
+	if (entry != page_entries.end()) {
+		num_bytes -= entry->second->num_bytes;
+		drop(*entry->second);
+		lru_pages.erase(entry->second);
+		page_entries.erase(entry);
+	}
+
+	CachedStextPage cached_page;
+	cached_page.page = page;
+	cached_page.stext_page = stext_page;
+	cached_page.num_bytes = get_stext_page_memory_bytes(stext_page);
+	num_bytes += cached_page.num_bytes;
+
+	lru_pages.push_front(cached_page);
+	page_entries[page] = lru_pages.begin();
+	evict(static_cast<size_t>(std::max(STEXT_CACHE_MEGABYTES, 0)) * 1024 * 1024);
+}
+
+void StextPageCache::insert_prefetched_pages() {
+	std::vector<CachedStextPage> new_pages;
+	{
+		std::lock_guard guard(prefetch_mutex);
+		if (prefetched_pages.size() == 0) {
+			return;
+		}
+		new_pages = std::move(prefetched_pages);
+		prefetched_pages.clear();
+	}
+
+	// prefetched pages are near the viewport so they are more likely to be used than the older pages, but they are
+	// inserted after the most recently used pages so they don't evict the pages which are in use
+	auto insert_position = lru_pages.begin();
+	std::advance(insert_position, std::min(lru_pages.size(), static_cast<size_t>(MIN_CACHED_STEXT_PAGES)));
+	for (auto& cached_page : new_pages) {
+		if (page_entries.find(cached_page.page) != page_entries.end()) {
+			drop(cached_page);
+			continue;
+		}
+		num_bytes += cached_page.num_bytes;
+		page_entries[cached_page.page] = lru_pages.insert(insert_position, cached_page);
+	}
+	evict(static_cast<size_t>(std::max(STEXT_CACHE_MEGABYTES, 0)) * 1024 * 1024);
+}
+
+void StextPageCache::evict(size_t budget_bytes) {
+	while ((num_bytes > budget_bytes) && (lru_pages.size() > static_cast<size_t>(MIN_CACHED_STEXT_PAGES))) {
+		CachedStextPage& least_recent = lru_pages.back();
+		num_bytes -= least_recent.num_bytes;
+		page_entries.erase(least_recent.page);
+		drop(least_recent);
+		lru_pages.pop_back();
+	}
+}
+
+void StextPageCache::clear() {
+	{
+		std::lock_guard guard(prefetch_mutex);
+		generation++;
+		requested_pages.clear();
+		prefetch_pages.clear();
+		for (auto& cached_page : prefetched_pages) {
+			drop(cached_page);
+		}
+		prefetched_pages.clear();
+		finished_pages.clear();
+		failed_pages.clear();
+	}
+	last_prefetch_request.clear();
+	page_callbacks.clear();
+
+	for (auto& cached_page : lru_pages) {
+		drop(cached_page);
+	}
+	lru_pages.clear();
+	page_entries.clear();
+	num_bytes = 0;
+}
+
+void StextPageCache::prefetch(const std::vector<int>& pages) {
+	if (STEXT_CACHE_MEGABYTES <= 0) {
+		return;
+	}
+
+	// this is called every frame, so we don't do anything unless the requested pages have changed
+	if (pages == last_prefetch_request) {
+		return;
+	}
+	last_prefetch_request = pages;
+
+	insert_prefetched_pages();
+	std::vector<int> uncached_pages;
+	for (int page : pages) {
+		if (page_entries.find(page) == page_entries.end()) {
+			uncached_pages.push_back(page);
+		}
+	}
+
+	std::lock_guard guard(prefetch_mutex);
+	prefetch_pages.clear();
+	for (int page : uncached_pages) {
+		if (std::find(requested_pages.begin(), requested_pages.end(), page) == requested_pages.end()) {
+			prefetch_pages.push_back(page);
+		}
+	}
+	start_prefetch_thread();
+	prefetch_cv.notify_one();
+}
+
+bool StextPageCache::request(const std::vector<int>& pages, QObject* receiver, std::function<void()> on_ready) {
+	insert_prefetched_pages();
+
+	std::lock_guard guard(prefetch_mutex);
+	std::vector<int> missing_pages;
+	for (int page : pages) {
+		if ((page_entries.find(page) == page_entries.end()) && (failed_pages.find(page) == failed_pages.end())) {
+			missing_pages.push_back(page);
+		}
+	}
+
+	// the cache may not be able to hold too many pages, in which case the callback would never find them all cached
+	if ((missing_pages.size() == 0) || (STEXT_CACHE_MEGABYTES <= 0) || (missing_pages.size() > static_cast<size_t>(MAX_ASYNC_STEXT_PAGES))) {
+		return true;
+	}
+
+	for (int page : missing_pages) {
+		prefetch_pages.erase(std::remove(prefetch_pages.begin(), prefetch_pages.end(), page), prefetch_pages.end());
+
+		bool is_queued = (page == extracting_page) ||
+			(std::find(requested_pages.begin(), requested_pages.end(), page) != requested_pages.end()) ||
+			std::any_of(prefetched_pages.begin(), prefetched_pages.end(), [&](const CachedStextPage& cached_page) {return cached_page.page == page; });
+		if (!is_queued) {
+			requested_pages.push_back(page);
+		}
+	}
+
+	// pages are extracted in order, so the other pages are usually extracted by the time the last one is. If not,
+	// the caller will request them again.
+	page_callbacks[missing_pages.back()].push_back(PageCallback{ receiver, on_ready });
+	start_prefetch_thread();
+	prefetch_cv.notify_one();
+	return false;
+}
+
+void StextPageCache::run_finished_callbacks() {
+	insert_prefetched_pages();
+
+	std::vector<int> pages;
+	{
+		std::lock_guard guard(prefetch_mutex);
+		pages = std::move(finished_pages);
+		finished_pages.clear();
+	}
+
+	// the callbacks may request other pages, so we don't run them while iterating page_callbacks
+	std::vector<PageCallback> callbacks;
+	for (int page : pages) {
+		auto page_callbacks_it = page_callbacks.find(page);
+		if (page_callbacks_it != page_callbacks.end()) {
+			for (auto& callback : page_callbacks_it->second) {
+				callbacks.push_back(std::move(callback));
+			}
+			page_callbacks.erase(page_callbacks_it);
+		}
+	}
+
+	for (auto& callback : callbacks) {
+		// the receiver (e.g. the window which requested the page) was closed while the page was being extracted
+		if (callback.receiver.isNull()) {
+			continue;
+		}
+		callback.on_ready();
+	}
+}
+
+void StextPageCache::start_prefetch_thread() {
+	if (!prefetch_thread.has_value()) {
+		prefetch_thread = std::thread([this]() {
+			run_prefetch_thread();
+			});
+	}
+}
+
+void StextPageCache::run_prefetch_thread() {
+	fz_context* prefetch_context = fz_clone_context(context);
+
+	while (true) {
+		std::unique_lock<std::mutex> lock(prefetch_mutex);
+		prefetch_cv.wait(lock, [&]() {
+			return should_quit || (requested_pages.size() > 0) || (prefetch_pages.size() > 0);
+			});
+
+		if (should_quit) break;
+
+		std::vector<int>& pages = requested_pages.size() > 0 ? requested_pages : prefetch_pages;
+		int page = pages.front();
+		pages.erase(pages.begin());
+		extracting_page = page;
+		int page_generation = generation;
+		lock.unlock();
+
+		fz_stext_page* stext_page = nullptr;
+		fz_var(stext_page);
+		fz_document* doc = document_handle_pool->acquire(prefetch_context, file_name);
+		if (doc != nullptr) {
+			fz_try(prefetch_context) {
+				stext_page = fz_new_stext_page_from_page_number(prefetch_context, doc, page, nullptr);
+			}
+			fz_catch(prefetch_context) {
+				std::wcout << L"Error: could not extract the text of page " << page << L"\n";
+			}
+			document_handle_pool->release(prefetch_context, doc);
+		}
+
+		CachedStextPage cached_page;
+		cached_page.page = page;
+		cached_page.stext_page = stext_page;
+		cached_page.num_bytes = stext_page ? get_stext_page_memory_bytes(stext_page) : 0;
+
+		lock.lock();
+		extracting_page = -1;
+		// the document was reloaded while we were extracting the page
+		if (page_generation != generation) {
+			if (stext_page != nullptr) {
+				fz_drop_stext_page(prefetch_context, stext_page);
+			}
+			continue;
+		}
+
+		if (stext_page != nullptr) {
+			prefetched_pages.push_back(cached_page);
+		}
+		else {
+			failed_pages.insert(page);
+		}
+		finished_pages.push_back(page);
+		lock.unlock();
+
+		QMetaObject::invokeMethod(&notifier, [this]() {
+			run_finished_callbacks();
+			}, Qt::QueuedConnection);
+	}
+
+	fz_drop_context(prefetch_context);
+}
+
+size_t StextPageCache::size() {
+	return lru_pages.size();
+}
+
+size_t StextPageCache::get_memory_bytes() {
+	return num_bytes;
+}
+
+long long StextPageCache::get_num_hits() {
+	return num_hits;
+}
+
+long long StextPageCache::get_num_misses() {
+	return num_misses;
+}
+
+size_t get_stext_page_memory_bytes(fz_stext_page* stext_page) {
+	// mupdf allocates the stext structures from a pool, so this is a slight underestimate
+	size_t res = sizeof(fz_stext_page);
+	for (fz_stext_block* block = stext_page->first_block; block != nullptr; block = block->next) {
+		res += sizeof(fz_stext_block);
+		if (block->type == FZ_STEXT_BLOCK_TEXT) {
+			for (fz_stext_line* line = block->u.t.first_line; line != nullptr; line = line->next) {
+				res += sizeof(fz_stext_line);
+				for (fz_stext_char* chr = line->first_char; chr != nullptr; chr = chr->next) {
+					res += sizeof(fz_stext_char);
+				}
+			}
+		}
+	}
+	return res;
+}
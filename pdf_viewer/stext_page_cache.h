@@ -0,0 +1,124 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+
+#include <qobject.h>
+#include <qpointer.h>
+#include <mupdf/fitz.h>
+
+#include "document_handle_pool.h"
+
+extern int STEXT_CACHE_MEGABYTES;
+extern const int MIN_CACHED_STEXT_PAGES;
+extern const int STEXT_PREFETCH_PAGES;
+extern const int MAX_ASYNC_STEXT_PAGES;
+
+/*
+	The structured text of the recently used pages of a document, indexed by page and evicted in least recently
+	used order when its size exceeds STEXT_CACHE_MEGABYTES. The text of the pages near the viewport can be extracted
+	in a background thread (see `prefetch`) and the actions which need the text of a page can wait for it without blocking
+	the main thread (see `request`). Apart from the background thread, the cache should only be used from the main thread. The
+	MIN_CACHED_STEXT_PAGES most recently used pages are never evicted, so the pages returned by `find` stay valid while
+	a few other pages are used. The stext pages of the background thread are created with a clone of the main context
+	and since cloned contexts share their allocator, the main thread can use and drop them.
+*/
+class StextPageCache {
+private:
+	struct CachedStextPage {
+		int page;
+		fz_stext_page* stext_page = nullptr;
+		size_t num_bytes = 0;
+	};
+
+	struct PageCallback {
+		// the callback is dropped if its receiver is deleted before the page is extracted
+		QPointer<QObject> receiver;
+		std::function<void()> on_ready;
+	};
+
+	fz_context* context = nullptr;
+	std::wstring file_name;
+	DocumentHandlePool* document_handle_pool = nullptr;
+
+	// the most recently used page is at the front
+	std::list<CachedStextPage> lru_pages;
+	std::unordered_map<int, std::list<CachedStextPage>::iterator> page_entries;
+	size_t num_bytes = 0;
+	long long num_hits = 0;
+	long long num_misses = 0;
+
+	// the pages which the background thread should extract, in the order of their priority. Pages which are requested
+	// using `request` are extracted before the prefetched pages
+	std::vector<int> requested_pages;
+	std::vector<int> prefetch_pages;
+	// the page which is being extracted by the background thread, or -1
+	int extracting_page = -1;
+	// the pages extracted by the background thread which are not moved to the cache yet
+	std::vector<CachedStextPage> prefetched_pages;
+	// the pages which the background thread is done with (including the pages it could not extract) since the
+	// main thread was last notified
+	std::vector<int> finished_pages;
+	// pages whose text could not be extracted, they are not requested again
+	std::unordered_set<int> failed_pages;
+	// incremented when the cache is cleared, so the pages which were being extracted for an older version of the
+	// document are discarded
+	int generation = 0;
+	bool should_quit = false;
+	std::mutex prefetch_mutex;
+	std::condition_variable prefetch_cv;
+	std::optional<std::thread> prefetch_thread = {};
+	std::vector<int> last_prefetch_request;
+
+	// the callbacks of `request` which are waiting for a page to be extracted, only used in the main thread
+	std::unordered_map<int, std::vector<PageCallback>> page_callbacks;
+	// the background thread notifies the main thread using queued calls to this object, so the calls which are
+	// pending when the cache is destroyed are discarded
+	QObject notifier;
+
+	// should be called with prefetch_mutex locked
+	void start_prefetch_thread();
+	void run_prefetch_thread();
+	void run_finished_callbacks();
+	void insert_prefetched_pages();
+	void evict(size_t budget_bytes);
+	void drop(CachedStextPage& cached_page);
+
+public:
+	StextPageCache(fz_context* context, const std::wstring& file_name, DocumentHandlePool* document_handle_pool);
+	~StextPageCache();
+
+	// returns the cached stext page of `page` or nullptr if it is not cached
+	fz_stext_page* find(int page);
+	// takes the ownership of `stext_page`
+	void insert(int page, fz_stext_page* stext_page);
+	// drops all the cached pages (e.g. because the document was reloaded)
+	void clear();
+
+	// extracts the text of `pages` which are not cached in the background, replacing the previous prefetch request
+	void prefetch(const std::vector<int>& pages);
+
+	/*
+		Returns true if the text of `pages` is cached (or if the caller should extract it itself because the cache is
+		disabled, too many pages are missing or their extraction failed). Otherwise the missing pages are extracted in
+		the background before the prefetched pages and `on_ready` is called in the main thread when they are extracted,
+		unless the cache is cleared or `receiver` is deleted before that.
+	*/
+	bool request(const std::vector<int>& pages, QObject* receiver, std::function<void()> on_ready);
+
+	size_t size();
+	size_t get_memory_bytes();
+	long long get_num_hits();
+	long long get_num_misses();
+};
+
+// approximate memory used by `stext_page`
+size_t get_stext_page_memory_bytes(fz_stext_page* stext_page);
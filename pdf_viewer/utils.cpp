@@ -2200,7 +2200,8 @@ void flat_char_prism(const std::vector<fz_stext_char*> chars, int page, std::wst
 
 	for (int j = 0; j < chars.size(); j++) {
 		if (is_line_separator(last_char, chars[j])) {
-			if (last_char->c == '-') {
+			// words which are split by a (possibly soft or unicode) hyphen at the end of a line are joined
+			if ((last_char->c == '-') || (last_char->c == 0xAD) || (last_char->c == 0x2010)) {
 				pages.pop_back();
 				rects.pop_back();
 				output_text.pop_back();
@@ -18,6 +18,8 @@ else{
 
 CONFIG += c++17
 DEFINES += QT_3DINPUT_LIB QT_OPENGL_LIB QT_OPENGLEXTENSIONS_LIB QT_WIDGETS_LIB
+# the library index uses the FTS5 extension of the bundled sqlite
+DEFINES += SQLITE_ENABLE_FTS5
 
 CONFIG(non_portable){
     DEFINES += NON_PORTABLE
@@ -36,6 +38,15 @@ HEADERS += pdf_viewer/book.h \
            pdf_viewer/pdf_renderer.h \
            pdf_viewer/pdf_view_opengl_widget.h \
            pdf_viewer/checksum.h \
+           pdf_viewer/page_image_cache.h \
+           pdf_viewer/document_index_cache.h \
+           pdf_viewer/search_index.h \
+           pdf_viewer/linear_regex.h \
+           pdf_viewer/library_index.h \
+           pdf_viewer/prefix_sum_tree.h \
+           pdf_viewer/document_handle_pool.h \
+           pdf_viewer/stext_page_cache.h \
+           pdf_viewer/page_data_cache.h \
            pdf_viewer/new_file_checker.h \
            pdf_viewer/coordinates.h \
            pdf_viewer/sqlite3.h \
@@ -63,6 +74,15 @@ SOURCES += pdf_viewer/book.cpp \
            pdf_viewer/pdf_renderer.cpp \
            pdf_viewer/pdf_view_opengl_widget.cpp \
            pdf_viewer/checksum.cpp \
+           pdf_viewer/page_image_cache.cpp \
+           pdf_viewer/document_index_cache.cpp \
+           pdf_viewer/search_index.cpp \
+           pdf_viewer/linear_regex.cpp \
+           pdf_viewer/library_index.cpp \
+           pdf_viewer/prefix_sum_tree.cpp \
+           pdf_viewer/document_handle_pool.cpp \
+           pdf_viewer/stext_page_cache.cpp \
+           pdf_viewer/page_data_cache.cpp \
            pdf_viewer/new_file_checker.cpp \
            pdf_viewer/coordinates.cpp \
            pdf_viewer/sqlite3.c \